@@ -0,0 +1,181 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"). You may not use this file except in compliance
+ * with the License. A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0/
+ *
+ * or in the "license" file accompanying this file. This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES
+ * OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions
+ * and limitations under the License.
+ */
+
+#ifndef __BRUTE_FORCE_H__
+#define __BRUTE_FORCE_H__
+
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils/matrix.hpp"
+#include "utils/dense_loader.hpp"
+#include "ann/feat_vectors.hpp"
+
+namespace pecos {
+
+namespace ann {
+
+    // Distances of exact_knn, the same as those of the FeatVecDense*Simd types:
+    //   l2:      squared L2 distance
+    //   ip:      1 - inner product
+    //   angular: 1 - cosine similarity
+    enum class KnnMetric { l2, ip, angular };
+
+    inline KnnMetric knn_metric_of(const std::string& name) {
+        if (name == "l2") {
+            return KnnMetric::l2;
+        } else if (name == "ip") {
+            return KnnMetric::ip;
+        } else if (name == "angular") {
+            return KnnMetric::angular;
+        }
+        throw std::invalid_argument("Unknown metric " + name + ", expected l2, ip or angular");
+    }
+
+    // Exact topk nearest rows of base for every row of queries, by brute force.
+    //
+    // base is streamed from its mapping in chunks of chunk_rows rows, so it can be larger than memory. The
+    // inner products of a block of queries with a chunk are computed by one sgemm (multi-threaded by the BLAS
+    // library itself), from which L2 distances follow with the squared norms of the rows. Each query keeps
+    // a max-heap of its topk best rows so far, updated by threads threads (<= 0 for all cores) in parallel
+    // over the queries of the block.
+    //
+    // ret_ids and ret_dists hold queries.rows x topk entries in row-major order, sorted by increasing
+    // distance and then by id.
+    inline void exact_knn(
+        const drm_t& queries,
+        const DenseFile& base,
+        index_type topk,
+        KnnMetric metric,
+        index_type* ret_ids,
+        float* ret_dists,
+        int threads=0,
+        uint64_t chunk_rows=16384,
+        uint64_t query_block_rows=1024
+    ) {
+        typedef std::pair<float, index_type> pair_t;
+        threads = (threads <= 0) ? omp_get_num_procs() : threads;
+        const uint64_t num_queries = queries.rows;
+        const uint64_t dim = queries.cols;
+        if (base.cols() != dim) {
+            throw std::invalid_argument("Queries and base vectors of different dimensions");
+        }
+        if (base.rows() < topk) {
+            throw std::invalid_argument("Fewer base vectors than topk");
+        }
+        if (base.rows() > std::numeric_limits<index_type>::max()) {
+            throw std::invalid_argument("Too many base vectors for index_type ids");
+        }
+        chunk_rows = std::max<uint64_t>(chunk_rows, 1);
+        query_block_rows = std::max<uint64_t>(query_block_rows, 1);
+
+        // queries, normalized for angular, and their squared norms for l2
+        std::vector<float> Q(queries.val, queries.val + num_queries * dim);
+        std::vector<float> query_sq_norms(num_queries, 0);
+#pragma omp parallel for schedule(static) num_threads(threads)
+        for (int64_t i = 0; i < (int64_t) num_queries; i++) {
+            float* q = &Q[i * dim];
+            float sq_norm = 0;
+            for (uint64_t d = 0; d < dim; d++) {
+                sq_norm += q[d] * q[d];
+            }
+            query_sq_norms[i] = sq_norm;
+            if (metric == KnnMetric::angular && sq_norm > 0) {
+                float inv_norm = 1.0f / std::sqrt(sq_norm);
+                for (uint64_t d = 0; d < dim; d++) {
+                    q[d] *= inv_norm;
+                }
+            }
+        }
+
+        std::vector<pair_t> heaps(num_queries * topk);
+        std::vector<index_type> heap_sizes(num_queries, 0);
+        std::vector<float> base_terms;  // squared norms for l2, inverse norms for angular
+        std::vector<float> scores(std::min<uint64_t>(query_block_rows, num_queries) * chunk_rows);
+        for (auto it = base.chunks(chunk_rows); it.next(); ) {
+            const drm_t& chunk = it.chunk();
+            const uint64_t num_rows = chunk.rows;
+            if (metric != KnnMetric::ip) {
+                base_terms.resize(num_rows);
+#pragma omp parallel for schedule(static) num_threads(threads)
+                for (int64_t j = 0; j < (int64_t) num_rows; j++) {
+                    const float* b = chunk.val + j * dim;
+                    float sq_norm = 0;
+                    for (uint64_t d = 0; d < dim; d++) {
+                        sq_norm += b[d] * b[d];
+                    }
+                    if (metric == KnnMetric::l2) {
+                        base_terms[j] = sq_norm;
+                    } else {
+                        base_terms[j] = sq_norm > 0 ? 1.0f / std::sqrt(sq_norm) : 0.0f;
+                    }
+                }
+            }
+            for (uint64_t q0 = 0; q0 < num_queries; q0 += query_block_rows) {
+                const uint64_t num_block_queries = std::min(query_block_rows, num_queries - q0);
+                do_matmul_abt(&Q[q0 * dim], num_block_queries, dim, chunk.val, num_rows, dim, scores.data(), num_rows);
+#pragma omp parallel for schedule(static) num_threads(threads)
+                for (int64_t bi = 0; bi < (int64_t) num_block_queries; bi++) {
+                    const uint64_t i = q0 + bi;
+                    const float* s = &scores[bi * num_rows];
+                    pair_t* heap = &heaps[i * topk];
+                    index_type& heap_size = heap_sizes[i];
+                    for (uint64_t j = 0; j < num_rows; j++) {
+                        float dist;
+                        if (metric == KnnMetric::l2) {
+                            // |q|^2 is the same for all rows, and added at the end
+                            dist = base_terms[j] - 2 * s[j];
+                        } else if (metric == KnnMetric::ip) {
+                            dist = 1.0f - s[j];
+                        } else {
+                            dist = 1.0f - s[j] * base_terms[j];
+                        }
+                        pair_t cand(dist, (index_type) (it.row_begin() + j));
+                        if (heap_size < topk) {
+                            heap[heap_size++] = cand;
+                            std::push_heap(heap, heap + heap_size);
+                        } else if (cand < heap[0]) {
+                            std::pop_heap(heap, heap + topk);
+                            heap[topk - 1] = cand;
+                            std::push_heap(heap, heap + topk);
+                        }
+                    }
+                }
+            }
+        }
+
+#pragma omp parallel for schedule(static) num_threads(threads)
+        for (int64_t i = 0; i < (int64_t) num_queries; i++) {
+            pair_t* heap = &heaps[i * topk];
+            std::sort_heap(heap, heap + topk);
+            for (index_type k = 0; k < topk; k++) {
+                float dist = heap[k].first;
+                if (metric == KnnMetric::l2) {
+                    dist = std::max(dist + query_sq_norms[i], 0.0f);
+                }
+                ret_ids[i * (uint64_t) topk + k] = heap[k].second;
+                ret_dists[i * (uint64_t) topk + k] = dist;
+            }
+        }
+    }
+
+} // end of namespace ann
+} // end of namespace pecos
+
+#endif  // end of __BRUTE_FORCE_H__
@@ -1,8 +1,9 @@
 #include <random>
-    template<typename dist_t, class FeatVec_T>
+    template<typename dist_t, class FeatVec_T, int Rank = 128>
     struct GraphFinger : GraphBase {
         typedef FeatVec_T feat_vec_t;
-        Finger<dist_t> finger;
+        typedef Finger<dist_t, Rank> finger_t;
+        finger_t finger;
         index_type num_node;
         // code_dimension is number of 4 bits code used to encode a data point in GraphPQ4Bits
         // code_dimension can be different from parameter num_local_codebooks in quantizer
@@ -12,48 +13,39 @@
         size_t code_offset;  
         size_t node_mem_size;
         index_type max_degree;
-        std::vector<uint64_t> mem_start_of_node;
-        std::vector<char> buffer;
+        pecos::mmap_util::MmapableVector<uint64_t> mem_start_of_node;
+        pecos::mmap_util::MmapableVector<char> buffer;
+
+        void save(pecos::mmap_util::BinaryWriter& writer) const {
+            writer.fput_one<index_type>(num_node);
+            writer.fput_one<size_t>(code_offset);
+            writer.fput_one<size_t>(node_mem_size);
+            writer.fput_one<index_type>(max_degree);
+            writer.fput_vector(mem_start_of_node);
+            writer.fput_vector(buffer);
+            finger.save(writer);
+        }
+
+        // with a memory-mapped reader, buffer (the neighbor lists, projections and residual codes) and
+        // mem_start_of_node point into the mapping; the small Finger basis is always copied
+        void load(pecos::mmap_util::BinaryReader& reader) {
+            reader.fget_multiple<index_type>(&num_node, 1);
+            reader.fget_multiple<size_t>(&code_offset, 1);
+            reader.fget_multiple<size_t>(&node_mem_size, 1);
+            reader.fget_multiple<index_type>(&max_degree, 1);
+            reader.fget_vector(mem_start_of_node);
+            reader.fget_vector(buffer);
+            finger.load(reader);
+        }
 
         void save(FILE *fp) const {
-            pecos::file_util::fput_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fput_multiple<size_t>(&code_offset, 1, fp);
-            pecos::file_util::fput_multiple<size_t>(&node_mem_size, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&max_degree, 1, fp);
-            size_t sz = mem_start_of_node.size();
-            pecos::file_util::fput_multiple<size_t>(&sz, 1, fp);
-            if (sz) {
-                pecos::file_util::fput_multiple<uint64_t>(&mem_start_of_node[0], sz, fp);
-            }
-            sz = buffer.size();
-            pecos::file_util::fput_multiple<size_t>(&sz, 1, fp);
-            if (sz) {
-                pecos::file_util::fput_multiple<char>(&buffer[0], sz, fp);
-            }
-            finger.save(fp);
-            //fclose(fp);
+            pecos::mmap_util::BinaryWriter writer(fp);
+            save(writer);
         }
 
         void load(FILE *fp) {
-            pecos::file_util::fget_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fget_multiple<size_t>(&code_offset, 1, fp);
-            pecos::file_util::fget_multiple<size_t>(&node_mem_size, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&max_degree, 1, fp);
-            size_t sz = 0;
-            pecos::file_util::fget_multiple<size_t>(&sz, 1, fp);
-            mem_start_of_node.resize(sz);
-            if (sz) {
-                pecos::file_util::fget_multiple<uint64_t>(&mem_start_of_node[0], sz, fp);
-            }
-            pecos::file_util::fget_multiple<size_t>(&sz, 1, fp);
-            buffer.resize(sz);
-            if (sz) {
-                pecos::file_util::fget_multiple<char>(&buffer[0], sz, fp);
-            }
-
-            finger.load(fp);
-
-            //fclose(fp);
+            pecos::mmap_util::BinaryReader reader(fp);
+            load(reader);
         }
 
         inline void prefetch_node_feat(index_type node_id) const {
@@ -94,131 +86,145 @@
             max_degree = max_degree % 16 == 0 ? max_degree : (max_degree / 16 + 1) * 16;
         }
 
-        void build_graph(const GraphL0<feat_vec_t>& G, int low_rank=128) {
+        // pack the signs of the low-rank residual into finger_t::code_words 64-bit words, word w going to
+        // code[w * word_stride]. Component r goes to word r / 64; inside a word the 16-component groups are
+        // stored from the high bits down, which is the order approximate_distance expects.
+        static inline void encode_sign_bits_default(const float* low_residual, uint64_t* code, index_type word_stride) {
+            uint64_t words[finger_t::code_words] = {0};
+            for (int r = 0; r < Rank; r++) {
+                uint64_t bit = (low_residual[r] >= 0) ? 1 : 0;
+                words[r / 64] |= bit << (48 - 16 * ((r % 64) / 16) + (r % 16));
+            }
+            for (int w = 0; w < finger_t::code_words; w++) {
+                code[w * word_stride] = words[w];
+            }
+        }
+
+        __attribute__((__target__("default")))
+        static void encode_sign_bits(const float* low_residual, uint64_t* code, index_type word_stride) {
+            encode_sign_bits_default(low_residual, code, word_stride);
+        }
+
+        __attribute__((__target__("avx512f")))
+        static void encode_sign_bits(const float* low_residual, uint64_t* code, index_type word_stride) {
+            const __m512 zero = _mm512_setzero_ps();
+            uint64_t words[finger_t::code_words] = {0};
+            for (int g = 0; g < Rank / 16; g++) {
+                uint64_t mask = _mm512_cmp_ps_mask(_mm512_loadu_ps(low_residual + g * 16), zero, _CMP_GE_OQ);
+                words[g / 4] |= mask << (48 - 16 * (g % 4));
+            }
+            for (int w = 0; w < finger_t::code_words; w++) {
+                code[w * word_stride] = words[w];
+            }
+        }
+
+        // The residual of an edge (i, j) is x_j minus its projection <x_i, x_j> / |x_i|^2 * x_i on x_i, from inner
+        // products whatever the distance of feat_vec_t, so that <q, x_j> = coef_q * coef_j * |x_i|^2 + <q_res, x_j_res>
+        // splits the same way for the L2 and the inner product kernels of Finger.
+        // if project_once is true, every node is projected once and the low-rank residual of an edge (i, j)
+        // is derived by linearity, P * (x_j - coef * x_i) = P * x_j - coef * P * x_i, instead of projecting
+        // the full-dimensional residual of every edge.
+        // The residual basis is learned from one edge residual for each of at most basis_samples nodes
+        // (0 means every valid node), by BDCSVD of the sample matrix. gram_basis takes the top Rank
+        // eigenvectors of their dimension x dimension Gram matrix instead, which never holds the samples.
+        void build_graph(
+            const GraphL0<feat_vec_t>& G,
+            int threads=1,
+            bool project_once=true,
+            size_t basis_samples=0,
+            bool gram_basis=false
+        ) {
             std::random_device rd;
             std::mt19937 gen(rd());
             const int dimension = G.feat_dim;
+            const int low_rank = Rank;
             num_node = G.num_node;
             max_degree = G.max_degree;
             pad_parameters();
-            // tmp storage of sampled residuals
-            std::vector<dist_t> sampled_residuals = std::vector<dist_t>(num_node * dimension, 0);
-            std::vector<dist_t> sampled_query_residuals = std::vector<dist_t>(num_node * dimension, 0); 
-            // rank for the system
-            // tmp basis storage
-            std::vector<std::vector<dist_t >> tmp_residual_basis;
-
-            // sampled qres dres ip
-            std::vector<dist_t > sampled_real_ip;
-            std::vector<std::vector<dist_t >> residual1;
-            std::vector<std::vector<dist_t >> residual2;
-            // norm
-            std::vector<dist_t> squared_norm_of_elements;
+            threads = (threads <= 0) ? omp_get_num_procs() : threads;
 
-            // Stage : Build R-1 rank for each edge
-            // collect sampled_residuals
-            int total_valid_nodes = 0;
-            int total_edge_links = 0;
-            std::cout<< "step 41" <<std::endl;
+            // norm
+            std::vector<dist_t> squared_norm_of_elements(num_node, 0);
+#pragma omp parallel for num_threads(threads) schedule(static)
             for (index_type i = 0; i < num_node; i++) {
-                dist_t norm_ = do_dot_product_simd(
+                squared_norm_of_elements[i] = do_dot_product_simd(
                     G.get_node_feat(i).val,
                     G.get_node_feat(i).val,
                     dimension
                 );
-                squared_norm_of_elements.push_back(norm_);
-                const auto neighbors = G.get_neighborhood(i, 0);
-                auto size = neighbors.degree();
-                total_edge_links += size;
-                if (size <= 1 || norm_ < 1e-6) {
-                    continue;
-                }
+            }
 
-                total_valid_nodes += 1;
-                std::uniform_int_distribution<> dis(0, size-1);
+            // Stage : Build R-1 rank for each edge
+            // nodes with at most one neighbor or a (nearly) zero vector cannot be sampled
+            std::vector<index_type> sampled_nodes;
+            for (index_type i = 0; i < num_node; i++) {
+                if (G.get_neighborhood(i, 0).degree() > 1 && squared_norm_of_elements[i] >= 1e-6) {
+                    sampled_nodes.push_back(i);
+                }
+            }
+            if (basis_samples > 0 && basis_samples < sampled_nodes.size()) {
+                std::shuffle(sampled_nodes.begin(), sampled_nodes.end(), gen);
+                sampled_nodes.resize(basis_samples);
+                std::sort(sampled_nodes.begin(), sampled_nodes.end());
+            }
+            size_t num_samples = sampled_nodes.size();
+            // every sampled node picks two different neighbors; only the picks are kept and the
+            // residuals are recomputed when needed, so no num_samples x dimension buffer is held
+            std::vector<index_type> sampled_picks(num_samples * 2);
+            for (size_t s = 0; s < num_samples; s++) {
+                std::uniform_int_distribution<> dis(0, G.get_neighborhood(sampled_nodes[s], 0).degree() - 1);
                 int pick = dis(gen);
                 int pick2 = dis(gen);
-
                 while (pick == pick2) {
                     pick2 = dis(gen);
-                    if (size == 1) {
-                        break;
-                    }
                 }
-
-               std::vector<dist_t > pick1_vec;
-               std::vector<dist_t > pick2_vec;
-              
-               dist_t norm1 = 0;
-               dist_t norm2 = 0;
-               for (index_type j = 0; j < size; j++) {
-                   G.prefetch_node_feat(neighbors[j + 1]);
-                   auto next_node = neighbors[j];
-                   if (j != pick & j != pick2) { 
-                       continue;
-                   }
-                
-                   dist_t dist = do_dot_product_simd(
-                       G.get_node_feat(next_node).val,
-                       G.get_node_feat(i).val,
-                       dimension
-                   );
-                   dist_t* cc2 = G.get_node_feat(next_node).val;
-                   dist_t* cc  = G.get_node_feat(i).val;
-                   if (j == pick) {
-                       for (int k = 0; k < dimension ; k++) {
-                           sampled_residuals[(i) * dimension + k] =  cc2[k] -  dist / squared_norm_of_elements[i] * cc[k];
-                           pick1_vec.push_back(sampled_residuals[(i) * dimension + k]);
-                       }
-                       for (int k = 0; k < dimension; k++) {
-                          norm1 += ( pick1_vec[k] * pick1_vec[k] );
-                       }
-                                               
-                       for(int k = 0; k < dimension; k++) { 
-                           pick1_vec[k] = pick1_vec[k] / std::sqrt(norm1);}
-                      }
-
-                    if( j == pick2){
-                          for (int k = 0; k < dimension ; k++) {
-                              pick2_vec.push_back(  cc2[k] -  dist/squared_norm_of_elements[i] * cc[k] );
-                              }
-                          for(int k = 0; k < dimension; k++){
-                              norm2 += ( pick2_vec[k] * pick2_vec[k] );
-                               }
-                          for(int k = 0; k < dimension; k++) { pick2_vec[k] = pick2_vec[k] / std::sqrt(norm2);}
-                      }
-               }
-                if( norm1 != 0 && norm2 != 0){
-                   if(pick != pick2)   {residual1.push_back(pick1_vec); }
-                   if(pick != pick2) { residual2.push_back(pick2_vec);}
-                   dist_t dist_ip = 0;
-                   for(int k = 0 ; k < dimension; k++){ 
-                       dist_ip += ( pick1_vec[k] * pick2_vec[k] );}
-                   sampled_real_ip.push_back(dist_ip);
+                sampled_picks[s * 2] = pick;
+                sampled_picks[s * 2 + 1] = pick2;
+            }
+            // residual of the t-th picked neighbor of sampled node s with respect to the node itself
+            auto compute_sampled_residual = [&](size_t s, int t, dist_t* res) {
+                index_type i = sampled_nodes[s];
+                dist_t* cc = G.get_node_feat(i).val;
+                dist_t* cc2 = G.get_node_feat(G.get_neighborhood(i, 0)[sampled_picks[s * 2 + t]]).val;
+                dist_t dist = do_dot_product_simd(cc2, cc, dimension);
+                for (int k = 0; k < dimension; k++) {
+                    res[k] = cc2[k] - dist / squared_norm_of_elements[i] * cc[k];
                 }
-          }
+            };
+
           // Calculate the Total Residual Basis
-          std::cout<< "step 42" <<std::endl;
-          Eigen::MatrixXf X(total_valid_nodes,dimension);
-          for(int i = 0; i < total_valid_nodes; i++){
-              for(int j = 0; j < dimension;j++){
-                  X(i,j) = sampled_residuals[i * dimension + j];
+          typedef Eigen::Matrix<dist_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> row_major_mat_t;
+          // columns of V are the right singular vectors of the sampled residuals, by decreasing singular value
+          Eigen::MatrixXf V;
+          if (!gram_basis) {
+              row_major_mat_t X(num_samples, dimension);
+#pragma omp parallel for num_threads(threads) schedule(static)
+              for (size_t s = 0; s < num_samples; s++) {
+                  compute_sampled_residual(s, 0, X.row(s).data());
+              }
+              Eigen::BDCSVD<Eigen::MatrixXf> SVD(X, Eigen::ComputeThinV);
+              V = SVD.matrixV();
+          } else {
+              // X^T X = V S^2 V^T, so its eigenvectors are the right singular vectors of X.
+              // The Gram matrix is accumulated over chunks of samples.
+              const size_t chunk_size = 4096;
+              row_major_mat_t chunk(std::min(chunk_size, num_samples), dimension);
+              Eigen::MatrixXd gram = Eigen::MatrixXd::Zero(dimension, dimension);
+              for (size_t s0 = 0; s0 < num_samples; s0 += chunk_size) {
+                  size_t rows = std::min(chunk_size, num_samples - s0);
+#pragma omp parallel for num_threads(threads) schedule(static)
+                  for (size_t s = 0; s < rows; s++) {
+                      compute_sampled_residual(s0 + s, 0, chunk.row(s).data());
+                  }
+                  auto block = chunk.topRows(rows);
+                  gram += (block.transpose() * block).template cast<double>();
               }
+              Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_solver(gram);
+              V = eigen_solver.eigenvectors().rowwise().reverse().template cast<float>();
           }
-          std::cout<< "step 43" <<std::endl;
-          Eigen::BDCSVD<Eigen::MatrixXf> SVD(X, Eigen::ComputeThinU | Eigen::ComputeThinV);
-          std::cout<< "step 44" <<std::endl;
-          Eigen::MatrixXf U = SVD.matrixU();
-          std::cout<< "step 45" <<std::endl;
-          Eigen::MatrixXf V = SVD.matrixV();
-          std::cout<< "step " <<std::endl;
-          std::cout<<V.rows()<<" "<<V.cols()<<" "<<residual1.size()<<" "<<residual2.size()<<" "<<sampled_real_ip.size()<<std::endl;
-          //Eigen::MatrixXf recover2 = U * S * V.transpose();
-          Eigen::MatrixXf projMatrix;
-          std::vector<dist_t > appx_ip;
-          // Setup finger projection matrix
+          // Setup finger projection matrix; components beyond the rank of the samples stay zero
 	  finger.projection_matrix.resize(low_rank * dimension, 0);
-          for (int i = 0; i < low_rank; i++) {
+          for (int i = 0; i < std::min<int>(low_rank, V.cols()); i++) {
               for (int j = 0; j < dimension; j++) {
                   finger.projection_matrix[i * dimension + j] = V(j,i);
               }
@@ -226,26 +232,61 @@
           // Low-dimensional center learning
           finger.low_rank = low_rank; 
           finger.dimension = dimension;
+          finger.setup();
 
-          // calculate the correlation coefficient 
-          float dummy_a, dummy_b; 
-          std::vector<float> low_residual1(low_rank, 0);
-          std::vector<float> low_residual2(low_rank, 0); 
-          appx_ip.clear(); 
+          // calculate the correlation coefficient between the real angle of two residuals of the same
+          // node and its hamming approximation
+          std::vector<dist_t> sampled_real_ip(num_samples, 0);
+          std::vector<dist_t> appx_ip(num_samples, 0);
+          std::vector<char> is_valid_pair(num_samples, 0);
           float base_angle = 3.141592653589793238462643383279502884197169399375105820974944 / low_rank;
-          for (int i = 0; i < residual1.size();i++) {
-              finger.compute_projection_information(residual1[i].data(), low_residual1.data(), dummy_a, dummy_b);
-              finger.compute_projection_information(residual2[i].data(), low_residual2.data(), dummy_a, dummy_b);
-              int hamming_count = 0;
-              for (int j = 0; j < low_rank; j++ ) {
-                  bool a = low_residual1[j] >= 0;
-                  bool b = low_residual2[j] >= 0;
-                  if ( a != b) {
-                      hamming_count += 1;
+#pragma omp parallel num_threads(threads)
+          {
+              float dummy_a, dummy_b;
+              std::vector<dist_t> pick1_vec(dimension, 0);
+              std::vector<dist_t> pick2_vec(dimension, 0);
+              std::vector<float> low_residual1(low_rank, 0);
+              std::vector<float> low_residual2(low_rank, 0);
+#pragma omp for schedule(dynamic, 64)
+              for (size_t s = 0; s < num_samples; s++) {
+                  compute_sampled_residual(s, 0, pick1_vec.data());
+                  compute_sampled_residual(s, 1, pick2_vec.data());
+                  dist_t norm1 = do_dot_product_simd(pick1_vec.data(), pick1_vec.data(), dimension);
+                  dist_t norm2 = do_dot_product_simd(pick2_vec.data(), pick2_vec.data(), dimension);
+                  if (norm1 == 0 || norm2 == 0) {
+                      continue;
+                  }
+                  for (int k = 0; k < dimension; k++) {
+                      pick1_vec[k] = pick1_vec[k] / std::sqrt(norm1);
+                      pick2_vec[k] = pick2_vec[k] / std::sqrt(norm2);
                   }
+                  sampled_real_ip[s] = do_dot_product_simd(pick1_vec.data(), pick2_vec.data(), dimension);
+
+                  finger.compute_projection_information(pick1_vec.data(), low_residual1.data(), dummy_a, dummy_b);
+                  finger.compute_projection_information(pick2_vec.data(), low_residual2.data(), dummy_a, dummy_b);
+                  int hamming_count = 0;
+                  for (int j = 0; j < low_rank; j++ ) {
+                      bool a = low_residual1[j] >= 0;
+                      bool b = low_residual2[j] >= 0;
+                      if ( a != b) {
+                          hamming_count += 1;
+                      }
+                  }
+                  appx_ip[s] = std::cos(base_angle * hamming_count);
+                  is_valid_pair[s] = 1;
+              }
+          }
+          // keep only the valid pairs, in sample order
+          size_t num_pairs = 0;
+          for (size_t s = 0; s < num_samples; s++) {
+              if (is_valid_pair[s]) {
+                  sampled_real_ip[num_pairs] = sampled_real_ip[s];
+                  appx_ip[num_pairs] = appx_ip[s];
+                  num_pairs += 1;
               }
-              appx_ip.push_back(std::cos(base_angle * hamming_count)); 
           }
+          sampled_real_ip.resize(num_pairs);
+          appx_ip.resize(num_pairs);
  
           // 2. Calculate the correlation coefficient
           float real_mean = 0;
@@ -275,240 +316,129 @@
 
           float center_appx_error = std::numeric_limits<float>::min(); 
           for (int i = 0; i < low_rank; i++) {
-              float tmp = std::cos( i * ANGLE);
+              float tmp = std::cos( i * base_angle);
               if ( mode_map[tmp] > center_appx_error) {
                   center_appx_error = mode_map[tmp];
                   select = i;
               } 
           }
-           
-/*
-          float center_appx_error = std::numeric_limits<float>::max(); 
-          for ( int i = 0; i < low_rank; i++) {
-              float tmp = std::cos( i * ANGLE);
-              if ( std::abs( tmp - appx_mean) < center_appx_error) {
-                  center_appx_error = std::abs(tmp - appx_mean);
-                  select = i;
-              } 
-          }
-*/
           std::cout<<select<<std::endl;
           finger.select = select;
-          //std::vector<float> low_residuals(total_edge_links * low_rank, 0);
-          std::vector<index_type> encoded_result(total_edge_links, 0);
-          std::vector<float> total_res_norm(total_edge_links, 0);
-          std::vector<float> tmp_residual(dimension, 0);
-          std::vector<float> tmp_low_residual(low_rank, 0);
-
-          int edge_cnt = 0;
-/*
-          for (size_t i = 0; i < num_node; i++) {
-              const index_type size = *reinterpret_cast<const index_type*>(&G.buffer[G.mem_start_of_node[i]]);
-
-              dist_t* center_node_feature  = G.get_node_feat(i).val;
-                            
-              float center_node_squared_norm = do_dot_product_simd(center_node_feature, center_node_feature, dimension); 
-              for (index_type j = 0; j < size; j++) {
-                  const index_type next_node = *reinterpret_cast<const index_type *>(&G.buffer[G.mem_start_of_node[i] + sizeof(index_type) + j * sizeof(index_type)]);
-                  dist_t* neighbor_node_feature = G.get_node_feat(next_node).val;
-                  dist_t dist = do_dot_product(center_node_feature, neighbor_node_feature, dimension);
-                    
-                  for (int k = 0; k < dimension ; k++) {
-                      tmp_residual[k] = (neighbor_node_feature[k] -  dist / center_node_squared_norm * center_node_feature[k]);
-                  }
-                  total_res_norm[edge_cnt] = std::sqrt(do_dot_product_simd(tmp_residual.data(), tmp_residual.data(), dimension));
-                  finger.compute_projection_information(tmp_residual.data(), &low_residuals[next_node * 32], dummy_a, dummy_b);
-                  edge_cnt += 1; 
-              }
-          }
-*/
+
             size_t neighbor_size = (1 + max_degree) * sizeof(index_type);
             code_offset = neighbor_size;
-            node_mem_size = neighbor_size + 2 * sizeof(float) + low_rank * sizeof(float) + 2 * sizeof(uint64_t) * max_degree + max_degree * 2 * sizeof(float);   // node_only : center_node_norm : center_node_squared_norm : center_node_low_projection | neighbors : residual norm^2 ; center projection coefficient ; low-rank qres quantized index | neighbors : quantized vector index;
+            node_mem_size = neighbor_size + 2 * sizeof(float) + low_rank * sizeof(float) + finger_t::code_words * sizeof(uint64_t) * max_degree + max_degree * 2 * sizeof(float);   // node_only : center_node_norm : center_node_squared_norm : center_node_low_projection | neighbors : residual norm^2 ; center projection coefficient ; low-rank qres quantized index | neighbors : quantized vector index;
             
-            mem_start_of_node.resize(num_node + 1);
+            mem_start_of_node.assign(num_node + 1, 0);
             mem_start_of_node[0] = 0;
  
             for (size_t i = 0; i < num_node; i++) {
                 mem_start_of_node[i + 1] = mem_start_of_node[i] + node_mem_size;
             }
-            buffer.resize(mem_start_of_node[num_node], 0);
-            std::vector<float> neighbor_res_norm(max_degree, 0);
-            //std::vector<float> neighbor_residual_center_negative_dot_product_result(max_degree, 0);
-            std::vector<float> neighbor_center_projection_coefficient(max_degree, 0);
-            //std::vector<index_type> neighbor_residual_quantized_idx(max_degree, 0);
-            std::vector<uint64_t> neighbor_residual_codes(max_degree * 2, 0);
-/*
-            for( int i = 0; i < 60000; i++) { 
-                for( int j = 0; j < low_rank;j++) {
-                std::cout<<finger.codebook[i * low_rank + j]<<",";} std::cout<<std::endl;
-            }
-*/
-            std::vector<float> center_node_projection(low_rank, 0);
-            edge_cnt = 0;
-            for (size_t i = 0; i < num_node; i++) {
-                memcpy(&buffer[mem_start_of_node[i]], &G.buffer[G.mem_start_of_node[i]], (1 + max_degree) * sizeof(index_type));
-                const index_type size = *reinterpret_cast<const index_type*>(&G.buffer[G.mem_start_of_node[i]]);
-
-                dist_t* center_node_feature  = G.get_node_feat(i).val;
-                              
-                float center_node_squared_norm = do_dot_product_simd(center_node_feature, center_node_feature, dimension); 
-                float center_node_norm = std::sqrt(center_node_squared_norm);
-                for (index_type j = 0; j < size; j++) {
-                    const index_type next_node = *reinterpret_cast<const index_type *>(&G.buffer[G.mem_start_of_node[i] + sizeof(index_type) + j * sizeof(index_type)]);
-                    dist_t* neighbor_node_feature = G.get_node_feat(next_node).val;
-                    dist_t dist = do_dot_product(center_node_feature, neighbor_node_feature, dimension);
-
-                    for (int k = 0; k < dimension ; k++) {
-                        tmp_residual[k] =  (neighbor_node_feature[k] -  dist / center_node_squared_norm * center_node_feature[k]);
-                    }
-
-                    finger.compute_projection_information(tmp_residual.data(), tmp_low_residual.data(), dummy_a, dummy_b);
-                    
-                    neighbor_res_norm[j] = std::sqrt(do_dot_product_simd(tmp_residual.data(), tmp_residual.data(), dimension));
-                    neighbor_center_projection_coefficient[j] = dist / center_node_squared_norm; 
-                    //neighbor_res_norm[j] = total_res_norm[edge_cnt];
-                    //neighbor_center_projection_coefficient[j] = dist / center_node_squared_norm;
-                    //if(j==0) { std::cout<<i<<"  "<<next_node<<" : ";}
-
-
-                    uint64_t tmp = 0;
-
-                    for (int r = 15; r >= 0; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                        }
-                        tmp <<= 1;
-                    }
-                    for (int r = 31; r >= 16; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                        }
-                        tmp <<= 1;
+            buffer.assign(mem_start_of_node[num_node], 0);
+            const size_t projection_offset = code_offset + 2 * sizeof(float);
+            if (project_once) {
+                // project all nodes with one GEMM per chunk, straight into the center projection slot of each node
+                const index_type chunk_size = 4096;
+                std::vector<float> chunk_feat((size_t) chunk_size * dimension);
+                for (index_type i0 = 0; i0 < num_node; i0 += chunk_size) {
+                    index_type rows = std::min<index_type>(chunk_size, num_node - i0);
+#pragma omp parallel for num_threads(threads) schedule(static)
+                    for (index_type i = 0; i < rows; i++) {
+                        memcpy(&chunk_feat[(size_t) i * dimension], G.get_node_feat(i0 + i).val, dimension * sizeof(float));
                     }
-                    for (int r = 47; r >= 32; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                        }
-                        tmp <<= 1;
-                    }
-                    for (int r = 63; r >= 48; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                        }
-                        if ( r != 48) {
-                            tmp <<= 1;
+                    pecos::do_matmul_abt(
+                        chunk_feat.data(), rows, dimension,
+                        finger.projection_matrix.data(), low_rank, dimension,
+                        reinterpret_cast<float*>(&buffer[mem_start_of_node[i0] + projection_offset]), node_mem_size / sizeof(float)
+                    );
+                }
+            }
+            // Every node only writes to its own slot of buffer, so the nodes are encoded in parallel.
+            // Each thread owns its scratch space; the resulting buffer is identical to a serial build.
+#pragma omp parallel num_threads(threads)
+            {
+                std::vector<float> tmp_residual(dimension, 0);
+                std::vector<float> tmp_low_residual(low_rank, 0);
+                std::vector<float> center_node_projection(low_rank, 0);
+                std::vector<float> neighbor_res_norm(max_degree, 0);
+                std::vector<float> neighbor_center_projection_coefficient(max_degree, 0);
+                std::vector<uint64_t> neighbor_residual_codes(max_degree * finger_t::code_words, 0);
+                float dummy_a, dummy_b;
+
+#pragma omp for schedule(dynamic, 64)
+                for (index_type i = 0; i < num_node; i++) {
+                    memcpy(&buffer[mem_start_of_node[i]], &G.buffer[G.mem_start_of_node[i]], (1 + max_degree) * sizeof(index_type));
+                    const index_type size = *reinterpret_cast<const index_type*>(&G.buffer[G.mem_start_of_node[i]]);
+
+                    dist_t* center_node_feature  = G.get_node_feat(i).val;
+
+                    float center_node_squared_norm = squared_norm_of_elements[i];
+                    float center_node_norm = std::sqrt(center_node_squared_norm);
+                    const float* center_node_projection_ptr = reinterpret_cast<const float*>(&buffer[mem_start_of_node[i] + projection_offset]);
+                    for (index_type j = 0; j < size; j++) {
+                        const index_type next_node = *reinterpret_cast<const index_type *>(&G.buffer[G.mem_start_of_node[i] + sizeof(index_type) + j * sizeof(index_type)]);
+                        dist_t* neighbor_node_feature = G.get_node_feat(next_node).val;
+                        dist_t dist = do_dot_product(center_node_feature, neighbor_node_feature, dimension);
+                        float coef = dist / center_node_squared_norm;
+
+                        if (project_once) {
+                            // |x_j - coef * x_i|^2 = |x_j|^2 - coef * <x_i, x_j>, clamped against cancellation
+                            const float* neighbor_node_projection = reinterpret_cast<const float*>(&buffer[mem_start_of_node[next_node] + projection_offset]);
+                            for (int r = 0; r < low_rank; r++) {
+                                tmp_low_residual[r] = neighbor_node_projection[r] - coef * center_node_projection_ptr[r];
+                            }
+                            neighbor_res_norm[j] = std::sqrt(std::max<float>(squared_norm_of_elements[next_node] - coef * dist, 0));
+                            neighbor_center_projection_coefficient[j] = coef;
+                            encode_sign_bits(tmp_low_residual.data(), &neighbor_residual_codes[j], max_degree);
+                            continue;
                         }
-                    }
 
-                    neighbor_residual_codes[j] = tmp; 
-
-
-                    tmp = 0;                    
+                        for (int k = 0; k < dimension ; k++) {
+                            tmp_residual[k] =  (neighbor_node_feature[k] -  dist / center_node_squared_norm * center_node_feature[k]);
+                        }
 
+                        finger.compute_projection_information(tmp_residual.data(), tmp_low_residual.data(), dummy_a, dummy_b);
 
-                    for (int r = 79; r >= 64; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                        }
-                        tmp <<= 1;
+                        neighbor_res_norm[j] = std::sqrt(do_dot_product_simd(tmp_residual.data(), tmp_residual.data(), dimension));
+                        neighbor_center_projection_coefficient[j] = dist / center_node_squared_norm;
+                        encode_sign_bits(tmp_low_residual.data(), &neighbor_residual_codes[j], max_degree);
                     }
-                    for (int r = 95; r >= 80; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
+                    // padded slots do not depend on which node the thread encoded before
+                    for (index_type j = size; j < max_degree; j++) {
+                        neighbor_res_norm[j] = 0;
+                        neighbor_center_projection_coefficient[j] = 0;
+                        for (int w = 0; w < finger_t::code_words; w++) {
+                            neighbor_residual_codes[w * max_degree + j] = 0;
                         }
-                        tmp <<= 1;
                     }
-                    for (int r = 111; r >= 96; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                        }
-                        tmp <<= 1;
-                    }
-                    for (int r = 127; r >= 112; r--) {
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                        }
-                        if ( r != 112) {
-                            tmp <<= 1;
-                        }
-                    }
-                    neighbor_residual_codes[max_degree + j] = tmp; 
-
-/*
-                    uint64_t tmp = 0;
-                    for (int r = 0; r < 64; r++) { 
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                            //if(j==0) { std::cout<<"1,";}
-                        } else {
-                            //if(j==0) { std::cout<<"0,";}
-                        }                 
-                        if (r != 63) {
-                            tmp <<= 1;
-                        }
+
+                    int num_groups = max_degree / 16;
+                    // save center node info
+                    memcpy(&buffer[mem_start_of_node[i] + (1 + max_degree) * sizeof(index_type)], &center_node_norm, sizeof(float));
+                    memcpy(&buffer[mem_start_of_node[i] + (1 + max_degree) * sizeof(index_type) + 1 * sizeof(float)], &center_node_squared_norm, sizeof(float));
+                    size_t buffer_position = (1 + max_degree) * sizeof(index_type) + 2 * sizeof(float);
+                    // save center node low rank projection, which is already in place if project_once
+                    if (!project_once) {
+                        finger.compute_projection_information(center_node_feature, center_node_projection.data(), dummy_a, dummy_b);
+                        memcpy(&buffer[mem_start_of_node[i] + buffer_position], center_node_projection.data(), low_rank * sizeof(float));
                     }
-                    neighbor_residual_codes[j * 2] = tmp; 
-                    tmp = 0;
-                    for (int r = 64; r < 128; r++) { 
-                        if (tmp_low_residual[r] >= 0) {
-                            tmp += 1;
-                            //if(j==0) { std::cout<<"1,";}
-                        } else {
-                            //if(j==0) { std::cout<<"0,";}
-                        }                 
-                        if (r != 127) {
-                            tmp <<= 1;
+                    buffer_position += (low_rank * sizeof(float));
+
+                    // save neighboring node info
+                    for (int j = 0; j < num_groups; j++) {
+                        memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_res_norm[j * 16], 16 * sizeof(float));
+                        buffer_position += (16 * sizeof(float));
+                        memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_center_projection_coefficient[j * 16], 16 * sizeof(float));
+                        buffer_position += (16 * sizeof(float));
+                        for (int w = 0; w < finger_t::code_words; w++) {
+                            memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_residual_codes[w * max_degree + j * 16], 16 * sizeof(uint64_t));
+                            buffer_position += (16 * sizeof(uint64_t));
                         }
                     }
-                    neighbor_residual_codes[j * 2 + 1] = tmp; 
-*/
-                    //if(j==0) { std::cout<<std::endl;}
-                    //if(j==0) { for(int k = 0; k < 32; k++) {std::cout<<tmp_low_residual[k]<<",";} std::cout<<std::endl;}
-                    //memcpy(&neighbor_residual_vectors[j * low_rank], &low_residuals[edge_cnt * low_rank], sizeof(float) * low_rank);
-                    //neighbor_residual_quantized_idx[j] = finger.encode(tmp_low_residual.data());
-                    //neighbor_residual_quantized_idx[j] = encoded_result[edge_cnt];
-                    edge_cnt += 1; 
-                }
-
-                int num_groups = max_degree / 16;
-                // save center node info 
-                memcpy(&buffer[mem_start_of_node[i] + (1 + max_degree) * sizeof(index_type)], &center_node_norm, sizeof(float));
-                memcpy(&buffer[mem_start_of_node[i] + (1 + max_degree) * sizeof(index_type) + 1 * sizeof(float)], &center_node_squared_norm, sizeof(float));
-                size_t buffer_position = (1 + max_degree) * sizeof(index_type) + 2 * sizeof(float);
-                // save center node low rank projection
-                finger.compute_projection_information(center_node_feature, center_node_projection.data(), dummy_a, dummy_b);
-                memcpy(&buffer[mem_start_of_node[i] + buffer_position], center_node_projection.data(), low_rank * sizeof(float));
-                buffer_position += (low_rank * sizeof(float));                
-
-                //memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_residual_quantized_idx[0], max_degree * sizeof(index_type));
-                //memcpy(&buffer[mem_start_of_node[i] + buffer_position], neighbor_residual_codes.data(), max_degree * sizeof(uint32_t));
-                //buffer_position += (max_degree * sizeof(uint32_t));
-                
-                // save neighboring node info 
-                for (int j = 0; j < num_groups; j++) { 
-                    // save to main buffer
-                    memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_res_norm[j * 16], 16 * sizeof(float));
-                    buffer_position += (16 * sizeof(float));
-                    memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_center_projection_coefficient[j * 16], 16 * sizeof(float));
-                    buffer_position += (16 * sizeof(float));
-                    memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_residual_codes[j * 16], 16 * sizeof(uint64_t));
-                    buffer_position += (16 * sizeof(uint64_t));
-                    memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_residual_codes[max_degree + j * 16], 16 * sizeof(uint64_t));
-                    buffer_position += (16 * sizeof(uint64_t));
-                    //memcpy(&buffer[mem_start_of_node[i] + buffer_position], neighbor_residual_vectors.data[j * 16 * low_rank], 16 * low_rank * sizeof(float));
-                    //buffer_position += (16 * low_rank * sizeof(float));
-                    //memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_residual_center_negative_dot_product_result[j * 16], 16 * sizeof(float));
-                    //buffer_position += (16 * sizeof(float));
-                    //memcpy(&buffer[mem_start_of_node[i] + buffer_position], &neighbor_residual_quantized_idx[j * 16], 16 * sizeof(index_type));
-                    //buffer_position += (16 * sizeof(index_type));
                 }
             }
 
-
-          //finger.scale = (real_std / appx_std);
-          //finger.bias =  (real_mean - appx_mean / appx_std * real_std);
-
         }
 
         inline const char* get_stored_info(index_type node_id) const {
@@ -32,7 +32,6 @@
                 pecos::file_util::fput_multiple<char>(&buffer[0], sz, fp);
             }
             quantizer.save(fp);
-            fclose(fp);
         }
 
         void load(FILE *fp) {
@@ -54,8 +53,6 @@
             }
 
             quantizer.load(fp);
-
-            fclose(fp);
         }
 
 
@@ -13,25 +13,37 @@
 
 #include <sys/stat.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdlib>
 #include <fstream>
 #include <functional>
+#include <initializer_list>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <random>
 #include <string>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
 #include <Eigen/Dense>
+#if defined(__x86_64__) || defined(__amd64__)
+#include <x86intrin.h>
+#endif
 
 #include "ann/feat_vectors.hpp"
 #include "ann/quantizer.hpp"
 #include "third_party/nlohmann_json/json.hpp"
 #include "utils/file_util.hpp"
+#include "utils/latency_histogram.hpp"
 #include "utils/matrix.hpp"
+#include "utils/mem_util.hpp"
+#include "utils/mmap_util.hpp"
 #include "utils/random.hpp"
 #include "utils/type_util.hpp"
 
@@ -94,44 +106,37 @@ namespace ann {
         index_type feat_dim;
         index_type max_degree;
         index_type node_mem_size;
-        std::vector<uint64_t> mem_start_of_node;
-        std::vector<char> buffer;
+        pecos::mmap_util::MmapableVector<uint64_t> mem_start_of_node;
+        pecos::mmap_util::MmapableVector<char> buffer;
 
         size_t neighborhood_memory_size() const { return (1 + max_degree) * sizeof(index_type); }
 
+        void save(pecos::mmap_util::BinaryWriter& writer) const {
+            writer.fput_one<index_type>(num_node);
+            writer.fput_one<index_type>(feat_dim);
+            writer.fput_one<index_type>(max_degree);
+            writer.fput_one<index_type>(node_mem_size);
+            writer.fput_vector(mem_start_of_node);
+            writer.fput_vector(buffer);
+        }
+
+        void load(pecos::mmap_util::BinaryReader& reader) {
+            reader.fget_multiple<index_type>(&num_node, 1);
+            reader.fget_multiple<index_type>(&feat_dim, 1);
+            reader.fget_multiple<index_type>(&max_degree, 1);
+            reader.fget_multiple<index_type>(&node_mem_size, 1);
+            reader.fget_vector(mem_start_of_node);
+            reader.fget_vector(buffer);
+        }
+
         void save(FILE *fp) const {
-            pecos::file_util::fput_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&feat_dim, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&max_degree, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&node_mem_size, 1, fp);
-            size_t sz = mem_start_of_node.size();
-            pecos::file_util::fput_multiple<size_t>(&sz, 1, fp);
-            if (sz) {
-                pecos::file_util::fput_multiple<uint64_t>(&mem_start_of_node[0], sz, fp);
-            }
-            sz = buffer.size();
-            pecos::file_util::fput_multiple<size_t>(&sz, 1, fp);
-            if (sz) {
-                pecos::file_util::fput_multiple<char>(&buffer[0], sz, fp);
-            }
+            pecos::mmap_util::BinaryWriter writer(fp);
+            save(writer);
         }
 
         void load(FILE *fp) {
-            pecos::file_util::fget_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&feat_dim, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&max_degree, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&node_mem_size, 1, fp);
-            size_t sz = 0;
-            pecos::file_util::fget_multiple<size_t>(&sz, 1, fp);
-            mem_start_of_node.resize(sz);
-            if (sz) {
-                pecos::file_util::fget_multiple<uint64_t>(&mem_start_of_node[0], sz, fp);
-            }
-            pecos::file_util::fget_multiple<size_t>(&sz, 1, fp);
-            buffer.resize(sz);
-            if (sz) {
-                pecos::file_util::fget_multiple<char>(&buffer[0], sz, fp);
-            }
+            pecos::mmap_util::BinaryReader reader(fp);
+            load(reader);
         }
 
         template<class MAT_T>
@@ -139,18 +144,18 @@ namespace ann {
             this->num_node = feat_mat.rows;
             this->feat_dim = feat_mat.cols;
             this->max_degree = max_degree;
-            mem_start_of_node.resize(num_node + 1);
+            mem_start_of_node.assign(num_node + 1, 0);
             mem_start_of_node[0] = 0;
             for (size_t i = 0; i < num_node; i++) {
                 const feat_vec_t& xi(feat_mat.get_row(i));
                 mem_start_of_node[i + 1] = mem_start_of_node[i] + neighborhood_memory_size() + xi.memory_size();
             }
-            buffer.resize(mem_start_of_node[num_node], 0);
+            buffer.assign(mem_start_of_node[num_node], 0);
             if (feat_vec_t::is_fixed_size::value) {
                 node_mem_size = buffer.size() / num_node;
             }
 
-            // get_node_feat_ptr must appear after memory allocation (buffer.resize())
+            // get_node_feat_ptr must appear after memory allocation (buffer.assign())
             for (size_t i = 0; i < num_node; i++) {
                 const feat_vec_t& xi(feat_mat.get_row(i));
                 xi.copy_to(get_node_feat_ptr(i));
@@ -192,54 +197,112 @@ namespace ann {
         }
     };
 
+    // Neighborhood graphs for level l=1,...,L. Node i only stores the levels 1,...,L_i it reaches, in a block
+    // starting at buffer[mem_start_of_node[i]] that holds L_i, like the degree in front of a neighborhood,
+    // followed by its neighborhood at level l at offset 1 + (l - 1) * level_mem_size. The last level_mem_size
+    // entries of buffer form an empty neighborhood, which is returned for any level a node does not reach.
     struct GraphL1 : GraphBase {
         index_type num_node;
         index_type max_level;
         index_type max_degree;
-        index_type node_mem_size;
+        index_type node_mem_size;  // 0 for the compact layout; num_node x max_level slots in legacy binaries
         index_type level_mem_size;
-        std::vector<index_type> buffer;
+        pecos::mmap_util::MmapableVector<index_type> buffer;
+        pecos::mmap_util::MmapableVector<mem_index_type> mem_start_of_node;
 
-        void save(FILE *fp) const {
-            pecos::file_util::fput_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&max_level, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&max_degree, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&node_mem_size, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&level_mem_size, 1, fp);
-            size_t sz = buffer.size();
-            pecos::file_util::fput_multiple<size_t>(&sz, 1, fp);
-            if (sz) {
-                pecos::file_util::fput_multiple<index_type>(&buffer[0], sz, fp);
+        void save(pecos::mmap_util::BinaryWriter& writer) const {
+            writer.fput_one<index_type>(num_node);
+            writer.fput_one<index_type>(max_level);
+            writer.fput_one<index_type>(max_degree);
+            writer.fput_one<index_type>(node_mem_size);
+            writer.fput_one<index_type>(level_mem_size);
+            writer.fput_vector(buffer);
+            writer.fput_vector(mem_start_of_node);
+        }
+
+        void load(pecos::mmap_util::BinaryReader& reader) {
+            reader.fget_multiple<index_type>(&num_node, 1);
+            reader.fget_multiple<index_type>(&max_level, 1);
+            reader.fget_multiple<index_type>(&max_degree, 1);
+            reader.fget_multiple<index_type>(&node_mem_size, 1);
+            reader.fget_multiple<index_type>(&level_mem_size, 1);
+            reader.fget_vector(buffer);
+            if (node_mem_size == 0) {
+                reader.fget_vector(mem_start_of_node);
+            } else {
+                compact_legacy_buffer();
             }
         }
 
+        void save(FILE *fp) const {
+            pecos::mmap_util::BinaryWriter writer(fp);
+            save(writer);
+        }
+
         void load(FILE *fp) {
-            pecos::file_util::fget_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&max_level, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&max_degree, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&node_mem_size, 1, fp);
-            pecos::file_util::fget_multiple<index_type>(&level_mem_size, 1, fp);
-            size_t sz = 0;
-            pecos::file_util::fget_multiple<size_t>(&sz, 1, fp);
-            buffer.resize(sz);
-            if (sz) {
-                pecos::file_util::fget_multiple<index_type>(&buffer[0], sz, fp);
-            }
+            pecos::mmap_util::BinaryReader reader(fp);
+            load(reader);
         }
 
         template<class MAT_T>
-        void init(const MAT_T& feat_mat, index_type max_degree, index_type max_level) {
+        void init(const MAT_T& feat_mat, index_type max_degree, index_type max_level, const std::vector<index_type>& node2level) {
             this->num_node = feat_mat.rows;
             this->max_level = max_level;
             this->max_degree = max_degree;
             this->level_mem_size = 1 + max_degree;
-            this->node_mem_size = max_level * this->level_mem_size;
-            buffer.resize(num_node * (mem_index_type) this->node_mem_size, 0);
+            this->node_mem_size = 0;
+            allocate(node2level);
         }
 
         inline const NeighborHood get_neighborhood(index_type node_id, index_type level_id=0) const {
-            const index_type *neighborhood_ptr = &buffer[node_id * (mem_index_type) this->node_mem_size + (level_id - 1) * (mem_index_type) this->level_mem_size];
-            return NeighborHood((void*)neighborhood_ptr);
+            // level_id = 0 wraps around and is treated as a missing level as well
+            mem_index_type offset = mem_start_of_node[node_id];
+            index_type level_idx = level_id - 1;
+            if (level_idx < buffer[offset]) {
+                offset += 1 + (mem_index_type) level_idx * this->level_mem_size;
+            } else {
+                offset = buffer.size() - this->level_mem_size;
+            }
+            return NeighborHood((void*)&buffer[offset]);
+        }
+
+        // set up the offsets and a buffer of empty neighborhoods, where node i reaches node2level[i] levels
+        void allocate(const std::vector<index_type>& node2level) {
+            mem_start_of_node.assign(num_node + 1, 0);
+            mem_start_of_node[0] = 0;
+            for (index_type i = 0; i < num_node; i++) {
+                mem_start_of_node[i + 1] = mem_start_of_node[i] + 1 + node2level[i] * (mem_index_type) level_mem_size;
+            }
+            buffer.assign(mem_start_of_node[num_node] + level_mem_size, 0);
+            for (index_type i = 0; i < num_node; i++) {
+                buffer[mem_start_of_node[i]] = node2level[i];
+            }
+        }
+
+        // binaries written before the compact layout reserve max_level levels for every node.
+        // A node keeps the levels up to its highest non-empty one; dropped empty levels read as
+        // the shared empty neighborhood, so searches see the same graph.
+        void compact_legacy_buffer() {
+            std::vector<index_type> legacy_buffer;
+            buffer.detach();
+            buffer.swap(legacy_buffer);
+            std::vector<index_type> node2level(num_node, 0);
+            for (index_type i = 0; i < num_node; i++) {
+                for (index_type l = 1; l <= max_level; l++) {
+                    if (legacy_buffer[i * (mem_index_type) node_mem_size + (l - 1) * (mem_index_type) level_mem_size] > 0) {
+                        node2level[i] = l;
+                    }
+                }
+            }
+            allocate(node2level);
+            for (index_type i = 0; i < num_node; i++) {
+                std::copy_n(
+                    &legacy_buffer[i * (mem_index_type) node_mem_size],
+                    node2level[i] * (mem_index_type) level_mem_size,
+                    &buffer[mem_start_of_node[i] + 1]
+                );
+            }
+            node_mem_size = 0;
         }
     };
 
@@ -270,6 +333,445 @@ namespace ann {
         }
     };
 
+    // Open-addressing hash set of the node ids visited by one query. Its memory and reset() scale with the
+    // number of visited nodes instead of num_node: the table grows by doubling to stay at most half full,
+    // and reset() clears it in O(capacity), i.e. in the number of nodes visited by the largest query so far.
+    struct HashSetOfVisitedNodes {
+        enum : unsigned { empty_slot = ~0u };  // not a valid node id
+        std::vector<unsigned> table;
+        int shift;
+        size_t size;
+
+        // starts with init_capacity slots, or fewer if num_nodes nodes fit
+        HashSetOfVisitedNodes(size_t num_nodes, size_t init_capacity=1024) : size(0) {
+            init_capacity = std::min(init_capacity, 2 * num_nodes);
+            size_t capacity = 2;
+            for (shift = 31; capacity < init_capacity; shift--) {
+                capacity *= 2;
+            }
+            table.assign(capacity, empty_slot);
+        }
+
+        // Fibonacci hashing: the top bits of the product, which depend on all bits of node_id
+        size_t slot_of(unsigned node_id) const { return (uint32_t) (node_id * 2654435769u) >> shift; }
+
+        void mark_visited(unsigned node_id) {
+            size_t mask = table.size() - 1;
+            size_t i = slot_of(node_id);
+            while (table[i] != empty_slot) {
+                if (table[i] == node_id) {
+                    return;
+                }
+                i = (i + 1) & mask;
+            }
+            table[i] = node_id;
+            if (++size * 2 > table.size()) {
+                grow();
+            }
+        }
+
+        bool is_visited(unsigned node_id) const {
+            size_t mask = table.size() - 1;
+            for (size_t i = slot_of(node_id); table[i] != empty_slot; i = (i + 1) & mask) {
+                if (table[i] == node_id) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void reset() {
+            if (size > 0) {
+                std::fill(table.begin(), table.end(), empty_slot);
+                size = 0;
+            }
+        }
+
+        void grow() {
+            std::vector<unsigned> old_table(table.size() * 2, empty_slot);
+            old_table.swap(table);
+            shift -= 1;
+            size = 0;
+            for (unsigned node_id : old_table) {
+                if (node_id != empty_slot) {
+                    mark_visited(node_id);
+                }
+            }
+        }
+    };
+
+    // One bit per node, a sixteenth of the memory of SetOfVistedNodes<unsigned short>. The words set by a
+    // query are remembered, so reset() clears only those instead of the whole bitset.
+    struct BitSetOfVisitedNodes {
+        std::vector<uint64_t> words;
+        std::vector<unsigned> dirty_words;
+
+        BitSetOfVisitedNodes(size_t num_nodes) : words((num_nodes + 63) / 64, 0) { }
+
+        void mark_visited(unsigned node_id) {
+            uint64_t& word = words[node_id >> 6];
+            if (word == 0) {
+                dirty_words.push_back(node_id >> 6);
+            }
+            word |= 1ULL << (node_id & 63);
+        }
+
+        bool is_visited(unsigned node_id) const { return (words[node_id >> 6] >> (node_id & 63)) & 1; }
+
+        void reset() {
+            for (unsigned w : dirty_words) {
+                words[w] = 0;
+            }
+            dirty_words.clear();
+        }
+    };
+
+    // Visited sets of the Searchers of an index, see set_visited_set_kind():
+    //   dense:  SetOfVistedNodes<unsigned short>, num_node * 2 bytes per Searcher and O(1) checks, but a full
+    //           clear every 65535 queries when the token wraps around
+    //   hash:   HashSetOfVisitedNodes, memory and reset() in O(visited nodes), for large indexes and small efS
+    //   bitset: BitSetOfVisitedNodes, num_node / 8 bytes per Searcher, O(1) checks and O(visited nodes) reset()
+    // A Searcher takes its visited set as a template parameter, dense by default, so the checks of a search
+    // compile against one implementation.
+    enum class VisitedSetKind { dense, hash, bitset };
+
+    inline VisitedSetKind visited_set_kind_of(const std::string& name) {
+        if (name == "dense") {
+            return VisitedSetKind::dense;
+        } else if (name == "hash") {
+            return VisitedSetKind::hash;
+        } else if (name == "bitset") {
+            return VisitedSetKind::bitset;
+        }
+        throw std::invalid_argument("Unknown visited set " + name + ", expected dense, hash or bitset");
+    }
+
+    template<class VisitedSet_T>
+    struct visited_set_tag {
+        typedef VisitedSet_T type;
+    };
+
+    // Calls fn(visited_set_tag<VisitedSet_T>()) for the visited set of the given kind, so that the caller can
+    // instantiate its Searchers for a kind only known at runtime, e.g. once per predict_batch call.
+    template<class Fn>
+    inline void dispatch_visited_set_kind(VisitedSetKind kind, Fn&& fn) {
+        switch (kind) {
+            case VisitedSetKind::dense: fn(visited_set_tag<SetOfVistedNodes<unsigned short int>>()); break;
+            case VisitedSetKind::hash: fn(visited_set_tag<HashSetOfVisitedNodes>()); break;
+            case VisitedSetKind::bitset: fn(visited_set_tag<BitSetOfVisitedNodes>()); break;
+        }
+    }
+
+    // Nodes eligible as results of a filtered search, e.g. the items of one tenant, given either as a bitset
+    // (bit i % 64 of bits[i / 64] for node i) or as a callback. Filtered-out nodes are still traversed, so
+    // the graph stays navigable whatever the filter.
+    //
+    // num_allowed is the number of eligible nodes, counted for a bitset and given (or unknown, max()) for a
+    // callback. When it is smaller than the number of distances of a graph search, predict_single computes
+    // the distances of just the eligible nodes instead; for a callback, that calls it on all node ids.
+    struct SearchFilter {
+        const uint64_t* bits;
+        std::function<bool(index_type)> callback;
+        index_type num_allowed;
+
+        // bits must outlive the filter
+        SearchFilter(const uint64_t* bits, index_type num_node) : bits(bits), num_allowed(0) {
+            for (index_type w = 0; w < (num_node + 63) / 64; w++) {
+                uint64_t word = bits[w];
+                if (w == num_node / 64) {
+                    word &= (1ULL << (num_node % 64)) - 1;
+                }
+                num_allowed += __builtin_popcountll(word);
+            }
+        }
+
+        SearchFilter(std::function<bool(index_type)> callback, index_type num_allowed=std::numeric_limits<index_type>::max()) :
+            bits(nullptr), callback(std::move(callback)), num_allowed(num_allowed) { }
+
+        bool allows(index_type node_id) const {
+            if (bits) {
+                return (bits[node_id >> 6] >> (node_id & 63)) & 1;
+            }
+            return callback(node_id);
+        }
+
+        // f(node_id) for every eligible node in increasing order
+        template<class Func>
+        void for_each_allowed(index_type num_node, Func f) const {
+            if (!bits) {
+                for (index_type node_id = 0; node_id < num_node; node_id++) {
+                    if (callback(node_id)) {
+                        f(node_id);
+                    }
+                }
+                return;
+            }
+            for (index_type w = 0; w < (num_node + 63) / 64; w++) {
+                for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+                    index_type node_id = w * 64 + __builtin_ctzll(word);
+                    if (node_id >= num_node) {
+                        return;
+                    }
+                    f(node_id);
+                }
+            }
+        }
+    };
+
+    // A thread-safe pool of Searchers owned by an index, so that batch inference reuses the
+    // per-thread search memory across calls. Copying an index gives the copy an empty pool.
+    template<class Searcher_T>
+    struct SearcherPool {
+        std::mutex mtx;
+        std::vector<std::unique_ptr<Searcher_T>> free_searchers;
+
+        SearcherPool() {}
+        SearcherPool(const SearcherPool&) {}
+        SearcherPool& operator=(const SearcherPool&) { return *this; }
+
+        // create_searcher is only called if the pool is empty
+        template<class CreateFunc>
+        std::unique_ptr<Searcher_T> acquire(CreateFunc create_searcher) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!free_searchers.empty()) {
+                    std::unique_ptr<Searcher_T> searcher = std::move(free_searchers.back());
+                    free_searchers.pop_back();
+                    return searcher;
+                }
+            }
+            return std::unique_ptr<Searcher_T>(new Searcher_T(create_searcher()));
+        }
+
+        void release(std::unique_ptr<Searcher_T>&& searcher) {
+            std::lock_guard<std::mutex> lock(mtx);
+            free_searchers.emplace_back(std::move(searcher));
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mtx);
+            free_searchers.clear();
+        }
+
+        // call f(searcher) on every Searcher in the pool; must not run concurrently with predict_batch
+        template<class Func>
+        void for_each(Func f) {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (auto& searcher : free_searchers) {
+                f(*searcher);
+            }
+        }
+    };
+
+    // A SearcherPool of Searcher_TT<VisitedSet_T> for every visited set, see dispatch_visited_set_kind
+    template<template<class> class Searcher_TT>
+    struct VisitedSetSearcherPools {
+        std::tuple<
+            SearcherPool<Searcher_TT<SetOfVistedNodes<unsigned short int>>>,
+            SearcherPool<Searcher_TT<HashSetOfVisitedNodes>>,
+            SearcherPool<Searcher_TT<BitSetOfVisitedNodes>>
+        > pools;
+
+        template<class VisitedSet_T>
+        SearcherPool<Searcher_TT<VisitedSet_T>>& get() {
+            return std::get<SearcherPool<Searcher_TT<VisitedSet_T>>>(pools);
+        }
+
+        void clear() {
+            std::get<0>(pools).clear();
+            std::get<1>(pools).clear();
+            std::get<2>(pools).clear();
+        }
+
+        // call f(searcher) on every pooled Searcher, whatever its visited set, so f takes an auto& argument
+        template<class Func>
+        void for_each(Func f) {
+            std::get<0>(pools).for_each(f);
+            std::get<1>(pools).for_each(f);
+            std::get<2>(pools).for_each(f);
+        }
+    };
+
+    // Counters of the work done by searches, accumulated in a Searcher over all of its queries.
+    // They are only updated if compiled with -DPECOS_ANN_SEARCH_STATS; otherwise ANN_SEARCH_STAT compiles to
+    // nothing and the counters stay zero.
+    struct SearchStats {
+#ifdef PECOS_ANN_SEARCH_STATS
+        static constexpr bool enabled = true;
+#else
+        static constexpr bool enabled = false;
+#endif
+        uint64_t num_queries = 0;
+        uint64_t upper_hops = 0;         // greedy moves on levels >= 1
+        uint64_t upper_distances = 0;    // exact distances on levels >= 1
+        uint64_t exact_hops = 0;         // candidates expanded on level 0 with exact distances
+        uint64_t exact_distances = 0;    // exact distances to their neighbors
+        uint64_t appx_hops = 0;          // candidates expanded on level 0 with approximate distances
+        uint64_t appx_scanned = 0;       // neighbors whose approximate distance was computed
+        uint64_t appx_passed = 0;        // of which were unvisited and under the top-k bound, so got an exact distance
+        uint64_t rerank_distances = 0;   // exact distances when reranking the result
+        uint64_t visited = 0;            // nodes marked visited
+
+        void merge(const SearchStats& other) {
+            num_queries += other.num_queries;
+            upper_hops += other.upper_hops;
+            upper_distances += other.upper_distances;
+            exact_hops += other.exact_hops;
+            exact_distances += other.exact_distances;
+            appx_hops += other.appx_hops;
+            appx_scanned += other.appx_scanned;
+            appx_passed += other.appx_passed;
+            rerank_distances += other.rerank_distances;
+            visited += other.visited;
+        }
+
+        void clear() { *this = SearchStats(); }
+
+        // fraction of the approximately scanned neighbors that needed no exact distance
+        double prune_ratio() const { return appx_scanned ? 1.0 - (double) appx_passed / appx_scanned : 0.0; }
+
+        // totals, and means per query of every counter
+        nlohmann::json to_json() const {
+            nlohmann::json j = {
+                {"num_queries", num_queries},
+                {"prune_ratio", prune_ratio()}
+            };
+            const std::pair<const char*, uint64_t> counters[] = {
+                {"upper_hops", upper_hops},
+                {"upper_distances", upper_distances},
+                {"exact_hops", exact_hops},
+                {"exact_distances", exact_distances},
+                {"appx_hops", appx_hops},
+                {"appx_scanned", appx_scanned},
+                {"appx_passed", appx_passed},
+                {"rerank_distances", rerank_distances},
+                {"visited", visited}
+            };
+            for (const auto& c : counters) {
+                j[c.first] = c.second;
+                j[std::string(c.first) + "_per_query"] = num_queries ? (double) c.second / num_queries : 0.0;
+            }
+            return j;
+        }
+    };
+
+#ifdef PECOS_ANN_SEARCH_STATS
+#define ANN_SEARCH_STAT(searcher, counter, n) ((searcher).stats.counter += (n))
+#else
+#define ANN_SEARCH_STAT(searcher, counter, n) ((void) 0)
+#endif
+
+    // Time stamp counter ticks spent by predict_single and predict_range in each phase of a query, one histogram
+    // per phase, accumulated in a Searcher over all of its queries. A query is timed from start() through a
+    // lap(phase) at the end of each phase to the lap(RERANK) that ends it; laps outside of a timed query are ignored.
+    // Only kept if compiled with -DPECOS_ANN_SEARCH_TIMING; otherwise this is empty and the
+    // ANN_SEARCH_TIMER_* macros compile to nothing.
+    struct SearchTiming {
+        enum phase_t {
+            DESCEND,     // greedy search on levels >= 1
+            PROJECTION,  // projection of the query on the low-rank basis
+            EXACT,       // first stage of the level-0 search, with exact distances
+            APPX,        // second stage of the level-0 search, with approximate distances
+            RERANK,      // reranking and sorting of the result
+            NUM_PHASES
+        };
+
+        static const char* phase_name(int phase) {
+            static const char* names[] = {"descend", "projection", "exact", "appx", "rerank"};
+            return names[phase];
+        }
+
+        // time stamp counter, or steady_clock nanoseconds where there is none
+        static uint64_t now() {
+#if defined(__x86_64__) || defined(__amd64__)
+            return __rdtsc();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        }
+
+        // ticks of now() per microsecond, measured against steady_clock on the first call
+        static double ticks_per_us() {
+            static const double value = []() {
+                auto wall_begin = std::chrono::steady_clock::now();
+                uint64_t tick_begin = now();
+                while (std::chrono::steady_clock::now() - wall_begin < std::chrono::milliseconds(50)) {}
+                uint64_t tick_end = now();
+                double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - wall_begin).count();
+                return (tick_end - tick_begin) / us;
+            }();
+            return value;
+        }
+
+#ifdef PECOS_ANN_SEARCH_TIMING
+        static constexpr bool enabled = true;
+
+        LatencyHistogram ticks[NUM_PHASES];
+        uint64_t last = 0;
+        bool active = false;
+
+        void start() {
+            active = true;
+            last = now();
+        }
+
+        void lap(phase_t phase) {
+            if (active) {
+                uint64_t t = now();
+                ticks[phase].record(t - last);
+                last = t;
+                active = (phase != RERANK);
+            }
+        }
+
+        void merge(const SearchTiming& other) {
+            for (int p = 0; p < NUM_PHASES; p++) {
+                ticks[p].merge(other.ticks[p]);
+            }
+        }
+
+        void clear() {
+            for (int p = 0; p < NUM_PHASES; p++) {
+                ticks[p].clear();
+            }
+            active = false;
+        }
+
+        // mean, p50, p90, p99 and max of every phase in microseconds
+        nlohmann::json to_json() const {
+            double scale = 1.0 / ticks_per_us();
+            nlohmann::json j;
+            for (int p = 0; p < NUM_PHASES; p++) {
+                j[phase_name(p)] = {
+                    {"count", ticks[p].count()},
+                    {"mean", ticks[p].mean() * scale},
+                    {"p50", ticks[p].percentile(50) * scale},
+                    {"p90", ticks[p].percentile(90) * scale},
+                    {"p99", ticks[p].percentile(99) * scale},
+                    {"max", ticks[p].max() * scale}
+                };
+            }
+            return j;
+        }
+#else
+        static constexpr bool enabled = false;
+
+        void start() {}
+        void lap(phase_t) {}
+        void merge(const SearchTiming&) {}
+        void clear() {}
+        nlohmann::json to_json() const { return nullptr; }
+#endif
+    };
+
+#ifdef PECOS_ANN_SEARCH_TIMING
+#define ANN_SEARCH_TIMER_START(searcher) ((searcher).timing.start())
+#define ANN_SEARCH_TIMER_LAP(searcher, phase) ((searcher).timing.lap(SearchTiming::phase))
+#else
+#define ANN_SEARCH_TIMER_START(searcher) ((void) 0)
+#define ANN_SEARCH_TIMER_LAP(searcher, phase) ((void) 0)
+#endif
+
     template <typename T1, typename T2>
     struct Pair {
         T1 dist;
@@ -279,6 +781,21 @@ namespace ann {
         bool operator>(const Pair<T1, T2>& other) const { return dist > other.dist; }
     };
 
+    // write a sorted search result to row-majored id and distance arrays with topk columns.
+    // Missing entries, if fewer than topk pairs are found, get pad_id and the largest distance.
+    template<class pairs_t, typename dist_t>
+    inline void write_topk_result(const pairs_t& ret_pairs, index_type topk, index_type pad_id, index_type* ret_ids, dist_t* ret_dists) {
+        index_type k = 0;
+        for (; k < topk && k < ret_pairs.size(); k++) {
+            ret_ids[k] = ret_pairs[k].node_id;
+            ret_dists[k] = ret_pairs[k].dist;
+        }
+        for (; k < topk; k++) {
+            ret_ids[k] = pad_id;
+            ret_dists[k] = std::numeric_limits<dist_t>::max();
+        }
+    }
+
     template<typename T, typename _Compare = std::less<T>>
     struct heap_t : public std::vector<T> {
         typedef typename std::vector<T> container_type;
@@ -314,6 +831,237 @@ namespace ann {
             this->pop_back();
         }
     };
+
+    // Candidate queues of the level-0 search at inference, see set_candidate_queue_kind():
+    //   heap:        a min-heap of candidates to expand and a max-heap of the efS best nodes (search_level)
+    //   linear_pool: one LinearPool of the efS best nodes, as in NSG and DiskANN
+    // Both give the same results up to ties in distance.
+    enum class CandidateQueueKind { heap, linear_pool };
+
+    inline CandidateQueueKind candidate_queue_kind_of(const std::string& name) {
+        if (name == "heap") {
+            return CandidateQueueKind::heap;
+        } else if (name == "linear_pool") {
+            return CandidateQueueKind::linear_pool;
+        }
+        throw std::invalid_argument("Unknown candidate queue " + name + ", expected heap or linear_pool");
+    }
+
+    // The efS best nodes found so far by a best-first search, sorted by increasing distance in one array,
+    // each with a flag whether its neighbors were expanded yet. The next node to expand is the first one
+    // not expanded, so the array replaces both heaps of search_level; it stays in cache for typical efS,
+    // insertion is a branch-free binary search and one shift of the worse entries, and nodes beyond the
+    // efS best are never inserted rather than pushed and popped again.
+    template<typename dist_t>
+    struct LinearPool {
+        struct Entry {
+            dist_t dist;
+            index_type node_id;
+            bool expanded;
+        };
+
+        std::vector<Entry> entries;
+        index_type capacity = 0;
+        index_type size = 0;
+        index_type cursor = 0;  // first entry not expanded, or size if there is none
+
+        void reset(index_type new_capacity) {
+            capacity = std::max<index_type>(new_capacity, 1);
+            if (entries.size() < capacity) {
+                entries.resize(capacity);
+            }
+            size = 0;
+            cursor = 0;
+        }
+
+        bool full() const { return size == capacity; }
+
+        // distance of the worst entry, which a new node must beat once the pool is full
+        dist_t bound() const { return entries[size - 1].dist; }
+
+        // whether a node at distance dist would be inserted
+        bool admits(dist_t dist) const { return !full() || dist < bound(); }
+
+        // insert node_id unless the pool is full of nodes at most as far; returns its position or capacity
+        index_type insert(dist_t dist, index_type node_id) {
+            if (!admits(dist)) {
+                return capacity;
+            }
+            // first entry farther than dist, so that ties keep their insertion order
+            index_type pos = 0;
+            index_type len = size;
+            while (len > 0) {
+                index_type half = len / 2;
+                bool right = entries[pos + half].dist <= dist;
+                pos = right ? pos + half + 1 : pos;
+                len = right ? len - half - 1 : half;
+            }
+            index_type last = std::min<index_type>(size, capacity - 1);
+            std::copy_backward(entries.begin() + pos, entries.begin() + last, entries.begin() + last + 1);
+            entries[pos] = Entry{dist, node_id, false};
+            size = std::min<index_type>(size + 1, capacity);
+            cursor = std::min(cursor, pos);
+            return pos;
+        }
+
+        bool has_next() const { return cursor < size; }
+
+        const Entry& peek_next() const { return entries[cursor]; }
+
+        // the closest entry not expanded yet, now marked as expanded
+        Entry next() {
+            Entry& entry = entries[cursor];
+            entry.expanded = true;
+            Entry ret = entry;
+            while (cursor < size && entries[cursor].expanded) {
+                cursor++;
+            }
+            return ret;
+        }
+
+        // the entries into heap by decreasing distance, which is a valid max-heap for the rest of predict_single
+        template<class heap_t>
+        void copy_to(heap_t& heap) const {
+            heap.clear();
+            for (index_type i = size; i > 0; i--) {
+                heap.emplace_back(entries[i - 1].dist, entries[i - 1].node_id);
+            }
+        }
+    };
+
+    // index.bin of version v1.0 packs all fields; v1.1 starts every array at a multiple of
+    // mmap_util::section_alignment, so that it can also be memory-mapped; v2.0 additionally puts each
+    // part of the index into its own section of a mmap_util sectioned file, with a checksum
+    inline size_t index_file_alignment(const std::string& version) {
+        if (version == "v1.0") {
+            return 1;
+        } else if (version == "v1.1" || version == "v2.0") {
+            return pecos::mmap_util::section_alignment;
+        }
+        throw std::runtime_error("Unable to load this binary with version = " + version);
+    }
+
+    struct IndexLoadOptions {
+        // memory-map index.bin instead of reading it, see load_index_file()
+        bool lazy_load = false;
+        pecos::mmap_util::MmapAdvice advice = pecos::mmap_util::MmapAdvice::normal;
+        // sections of a v2.0 index left unloaded (empty), e.g. {"graph_l0_finger"}; the header section is always
+        // loaded, and older versions are always loaded completely. Only the searches that do not read the
+        // skipped sections can be served, e.g. HNSWFinger::route; the others throw.
+        std::vector<std::string> skip_sections;
+        // check the checksums of the loaded sections of a v2.0 index, with up to threads threads (<= 0 for all cores)
+        bool verify_checksums = false;
+        int threads = 0;
+
+        bool skips(const std::string& name) const {
+            return std::find(skip_sections.begin(), skip_sections.end(), name) != skip_sections.end();
+        }
+    };
+
+    // write index.bin of version v2.0 with save_section(name, writer) for each of section_names. The file is
+    // written next to the old one and renamed over it, so processes that have the old one memory-mapped keep
+    // a consistent view.
+    template<class SaveSectionFunc>
+    inline void save_index_file(const std::string& index_path, const std::vector<std::string>& section_names, SaveSectionFunc save_section) {
+        std::string tmp_path = index_path + ".tmp";
+        pecos::mmap_util::SectionFileWriter file_writer(tmp_path);
+        for (const auto& name : section_names) {
+            file_writer.begin_section(name);
+            save_section(name, file_writer.writer());
+            file_writer.end_section();
+        }
+        file_writer.finish();
+        if (rename(tmp_path.c_str(), index_path.c_str()) != 0) {
+            throw std::runtime_error("Unable to save index file to " + index_path);
+        }
+    }
+
+    // read index.bin with load_section(name, reader) for each of section_names, which are read in this
+    // order from indexes older than v2.0, and return the names of the sections skipped by options.
+    // With options.lazy_load, the file is memory-mapped instead and the graph buffers point into the
+    // mapping: loading is immediate, pages are read on first access or as advised, and processes
+    // serving the same index share them through the page cache.
+    template<class LoadSectionFunc>
+    inline std::vector<std::string> load_index_file(
+        const std::string& index_path,
+        const std::string& version,
+        const IndexLoadOptions& options,
+        const std::vector<std::string>& section_names,
+        LoadSectionFunc load_section
+    ) {
+        size_t alignment = index_file_alignment(version);
+        bool sectioned = (version == "v2.0");
+        std::vector<std::string> loaded_names;
+        std::vector<std::string> skipped_names;
+        for (size_t i = 0; i < section_names.size(); i++) {
+            if (!sectioned || i == 0 || !options.skips(section_names[i])) {
+                loaded_names.push_back(section_names[i]);
+            } else {
+                skipped_names.push_back(section_names[i]);
+            }
+        }
+        auto load_all = [&](pecos::mmap_util::BinaryReader& reader, const pecos::mmap_util::MmapFile* file) {
+            if (!sectioned) {
+                for (const auto& name : loaded_names) {
+                    load_section(name, reader);
+                }
+                return;
+            }
+            pecos::mmap_util::SectionTable table;
+            table.load(reader);
+            if (options.verify_checksums) {
+                if (file) {
+                    table.verify(*file, loaded_names, options.threads);
+                } else {
+                    // also brings the file into the page cache for the reads below
+                    table.verify(pecos::mmap_util::MmapFile(index_path), loaded_names, options.threads);
+                }
+            }
+            for (const auto& name : loaded_names) {
+                const auto& entry = table.find(name);
+                reader.seek(entry.offset);
+                load_section(name, reader);
+                if (reader.tell() != entry.offset + entry.length) {
+                    throw std::runtime_error("Inconsistent length of section " + name + " in " + index_path);
+                }
+            }
+        };
+        if (options.lazy_load) {
+            if (alignment == 1) {
+                throw std::runtime_error("Unable to memory-map a binary with version = " + version + ", save it again to upgrade it");
+            }
+            auto file = std::make_shared<const pecos::mmap_util::MmapFile>(index_path, options.advice);
+            pecos::mmap_util::BinaryReader reader(file, alignment);
+            load_all(reader, file.get());
+        } else {
+            FILE *fp = fopen(index_path.c_str(), "rb");
+            if (fp == nullptr) {
+                throw std::runtime_error("Unable to open index file at " + index_path);
+            }
+            pecos::mmap_util::BinaryReader reader(fp, alignment);
+            try {
+                load_all(reader, nullptr);
+            } catch (...) {
+                fclose(fp);
+                throw;
+            }
+            fclose(fp);
+        }
+        return skipped_names;
+    }
+
+    // A search calls this first with the sections it reads, to fail cleanly on an index loaded without one of
+    // them (see IndexLoadOptions::skip_sections) instead of reading its empty buffers.
+    inline void check_sections_loaded(const std::vector<std::string>& skipped_sections, std::initializer_list<const char*> section_names) {
+        for (const auto& skipped : skipped_sections) {
+            for (const char* name : section_names) {
+                if (skipped == name) {
+                    throw std::runtime_error("Unable to search an index loaded without its " + skipped + " section");
+                }
+            }
+        }
+    }
+
 #include "search_struct_impl/hnsw.hpp"
 #include "search_struct_impl/hnswpq4bit.hpp"
 #include "search_struct_impl/hnswfinger.hpp"
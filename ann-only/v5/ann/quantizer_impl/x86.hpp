@@ -41,27 +41,19 @@
 #endif
 
 #include <algorithm>
+#include <cmath>
 #include <limits>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #pragma once
 #include "common.hpp"
+#include "utils/matrix.hpp"
+#include "utils/mmap_util.hpp"
 #include "utils/clustering.hpp"
 #include "inttypes.h"
 #include "stdio.h"
 
-//_mm512_set_epi8 std::vector<uint32_t> popcnt_lookup_table = {
-__m256i _popcnt_lookup_table_256 =    _mm256_set_epi8(
-    4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0,
-    4, 3, 3, 2, 3, 2, 2, 1, 3, 2, 2, 1, 2, 1, 1, 0
-);
-
-__m512i _popcnt_lookup_table_512 = _mm512_castsi256_si512(_popcnt_lookup_table_256);
-__m512i _popcnt_lookup_table = _mm512_inserti64x4(_popcnt_lookup_table_512, _popcnt_lookup_table_256, 1); 
-
-__m512i _cos_select;// = _mm512_set1_epi32(63);
-__m512 _cos_table0, _cos_table1, _cos_table2, _cos_table3, _cos_table4, _cos_table5, _cos_table6, _cos_table7;
-int ultimate_select;
-
 
 
 //const __m512i _popcnt_lookup_table = _mm512_loadu_si512(popcnt_lookup_table.data());
@@ -245,8 +237,67 @@ namespace ann {
         }
     };
 
-    template<typename dist_t> 
+    // cos(i * pi / Rank) for i = 0, ..., Rank - 1: the estimated cosine between two residual vectors whose
+    // Rank-bit sign codes differ in i bits. Every version of the Finger kernels reads this table, so they agree
+    // bit by bit.
+    template<int Rank>
+    inline const float* finger_cos_table() {
+        static const std::vector<float> cos_table = []() {
+            std::vector<float> table(Rank);
+            for (int i = 0; i < Rank; i++) {
+                table[i] = std::cos(i * (3.14159265358979323846 / Rank));
+            }
+            return table;
+        }();
+        return cos_table.data();
+    }
+
+    // Popcount policies of the AVX-512 kernels: the number of set bits of each 64-bit lane, narrowed to 32 bits.
+    // The lookup version counts nibbles with pshufb and sums them up to 64-bit lanes, the native version uses
+    // AVX512-VPOPCNTDQ (Ice Lake and later). Both return the same counts.
+    struct FingerPopcntLookup {
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        static inline __m256i popcnt_epi64(__m512i _x) {
+            const __m512i _popcnt_lookup_table = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+            const __m512i _mask = _mm512_set1_epi8(0x0f);
+            const __m512i _mask00ff = _mm512_set1_epi16(0x00ff);
+            const __m512i _mask0000ffff = _mm512_set1_epi32(0x0000ffff);
+            const __m512i _mask00000000ffffffff = _mm512_set1_epi64(0x00000000ffffffff);
+            __m512i _low = _mm512_and_si512(_x, _mask);
+            __m512i _high = _mm512_and_si512(_mm512_srli_epi16(_x, 4), _mask);
+            __m512i _s = _mm512_add_epi8(_mm512_shuffle_epi8(_popcnt_lookup_table, _low), _mm512_shuffle_epi8(_popcnt_lookup_table, _high));
+            _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
+            _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
+            _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
+            return _mm512_cvtepi64_epi32(_s);
+        }
+    };
+
+    struct FingerPopcntNative {
+        // not always_inline: GCC only inlines it once the kernel body sits in a caller that enables VPOPCNTDQ
+        __attribute__((__target__("avx512bw,avx512dq,avx512vpopcntdq")))
+        static inline __m256i popcnt_epi64(__m512i _x) {
+            return _mm512_cvtepi64_epi32(_mm512_popcnt_epi64(_x));
+        }
+    };
+
+    // Rank is the dimension of the low-rank residual basis and the number of bits of a residual sign code;
+    // the kernels are unrolled for it at compile time.
+    template<typename dist_t, int Rank = 128>
     struct Finger {
+        static_assert(Rank == 32 || Rank == 64 || Rank == 128 || Rank == 256, "Finger supports ranks 32, 64, 128 and 256");
+
+        static constexpr int rank = Rank;
+        // 64-bit words of a sign code; a 32-bit code uses the high half of one word
+        static constexpr int code_words = (Rank + 63) / 64;
+        // bytes of one group of 16 neighbors: residual norms, center projection coefficients and sign codes
+        static constexpr size_t neighbor_group_size = 32 * sizeof(float) + 16 * code_words * sizeof(uint64_t);
+        // The kernels look the cosine up in cos_blocks 16-entry blocks of the cos table centered
+        // on Rank / 2, starting at cos_first; a hamming distance outside of them keeps its offset in its 16-entry
+        // block and is moved to the first or the last block.
+        static constexpr int cos_blocks = Rank >= 64 ? Rank / 32 : 2;
+        static constexpr int cos_first = Rank / 2 - 8 * cos_blocks;
+        static constexpr int cos_last = cos_first + 16 * (cos_blocks - 1);
 
         int low_rank;
         int dimension;
@@ -254,47 +305,57 @@ namespace ann {
         //float scale;
         //float bias;
         int select;
-        std::vector<float> projection_matrix;
+        std::vector<float> projection_matrix;     // low_rank x dimension
         std::vector<float> codebook;
+        // projection_matrix transposed to dimension x Rank, so that the projection of a query is the sum of its
+        // rows scaled by the query values and is computed in one pass over it; derived by setup(), not saved
+        std::vector<float> projection_matrix_t;
         // no need to save, calculate in preprosee
         //pecos::bnn::HNSW<float, FeatVecDenseL2Simd<float>> encoder;
        
 
-        inline void save(FILE* fp) const {
-            pecos::file_util::fput_multiple<index_type>(&num_codebooks, 1, fp);
-            pecos::file_util::fput_multiple<int>(&dimension, 1, fp);
-            pecos::file_util::fput_multiple<int>(&low_rank, 1, fp);
-            pecos::file_util::fput_multiple<int>(&select, 1, fp);
-            size_t sz = projection_matrix.size();
-            pecos::file_util::fput_multiple<size_t>(&sz, 1, fp);
-            if (sz) {
-                pecos::file_util::fput_multiple<float>(&projection_matrix[0], sz, fp);
-            }
-            sz = codebook.size();
-            pecos::file_util::fput_multiple<size_t>(&sz, 1, fp);
-            if (sz) {
-                pecos::file_util::fput_multiple<float>(&codebook[0], sz, fp);
+        inline void save(pecos::mmap_util::BinaryWriter& writer) const {
+            writer.fput_one<index_type>(num_codebooks);
+            writer.fput_one<int>(dimension);
+            writer.fput_one<int>(low_rank);
+            writer.fput_one<int>(select);
+            writer.fput_vector(projection_matrix);
+            writer.fput_vector(codebook);
+        }
+
+        inline void load(pecos::mmap_util::BinaryReader& reader) {
+            reader.fget_multiple<index_type>(&num_codebooks, 1);
+            reader.fget_multiple<int>(&dimension, 1);
+            reader.fget_multiple<int>(&low_rank, 1);
+            if (low_rank != Rank) {
+                throw std::runtime_error("Finger index of rank " + std::to_string(low_rank) + " cannot be loaded with rank " + std::to_string(Rank));
             }
+            reader.fget_multiple<int>(&select, 1);
+            reader.fget_vector(projection_matrix);
+            reader.fget_vector(codebook);
+            setup();
+        }
+
+        inline void save(FILE* fp) const {
+            pecos::mmap_util::BinaryWriter writer(fp);
+            save(writer);
         }
 
         inline void load(FILE* fp) {
-            pecos::file_util::fget_multiple<index_type>(&num_codebooks, 1, fp);
-            pecos::file_util::fget_multiple<int>(&dimension, 1, fp);
-            pecos::file_util::fget_multiple<int>(&low_rank, 1, fp);
-            pecos::file_util::fget_multiple<int>(&select, 1, fp);
-            size_t sz = 0;
-            pecos::file_util::fget_multiple<size_t>(&sz, 1, fp);
-            projection_matrix.resize(sz);
-            if (sz) {
-                pecos::file_util::fget_multiple<float>(&projection_matrix[0], sz, fp);
-            }
-            pecos::file_util::fget_multiple<size_t>(&sz, 1, fp);
-            codebook.resize(sz);
-            if (sz) {
-                pecos::file_util::fget_multiple<float>(&codebook[0], sz, fp);
-            }
+            pecos::mmap_util::BinaryReader reader(fp);
+            load(reader);
         }
+        // derive the members that are not saved, once projection_matrix and dimension are set
         inline void setup() {
+            if (low_rank != Rank || projection_matrix.size() != (size_t) Rank * dimension) {
+                throw std::runtime_error("Finger projection matrix does not match its rank and dimension");
+            }
+            projection_matrix_t.resize((size_t) dimension * Rank);
+            for (int i = 0; i < Rank; i++) {
+                for (int j = 0; j < dimension; j++) {
+                    projection_matrix_t[(size_t) j * Rank + i] = projection_matrix[(size_t) i * dimension + j];
+                }
+            }
         }
         inline void compute_query_rplsh_code(uint64_t& result, const float* query_lowrank_projection_ptr) const {
 /*
@@ -352,15 +413,122 @@ namespace ann {
         }
 
         inline void compute_projection_information(const float* query, float* result, float& query_norm, float& query_squared_norm) const {
-            query_squared_norm = do_dot_product_simd(query, query, dimension); 
+            compute_query_norms(query, query_norm, query_squared_norm);
+            project_query(query, result);
+        }
+
+        inline void compute_query_norms(const float* query, float& query_norm, float& query_squared_norm) const {
+            query_squared_norm = do_dot_product_simd(query, query, dimension);
             query_norm = std::sqrt(query_squared_norm);
-            for (int i = 0; i < low_rank; i++) {
-                result[i] = do_dot_product_simd(query, &projection_matrix[i * dimension], dimension);
-            } 
         }
 
+        // result = projection_matrix * query, as a GEMV over projection_matrix_t blocked on the registers: the
+        // Rank sums stay in registers while the matrix is streamed once, instead of Rank dot products that
+        // each end with a horizontal sum. Low ranks keep several sets of sums to hide the latency of the FMAs.
+        __attribute__((__target__("avx512f")))
+        void project_query(const float* query, float* result) const {
+            constexpr int num_sums = Rank / 16;
+            constexpr int num_sets = num_sums >= 8 ? 1 : 8 / num_sums;
+            __m512 _sums[num_sets][num_sums];
+            for (int s = 0; s < num_sets; s++) {
+                for (int a = 0; a < num_sums; a++) {
+                    _sums[s][a] = _mm512_setzero_ps();
+                }
+            }
+            const float* row = projection_matrix_t.data();
+            int j = 0;
+            for (; j + num_sets <= dimension; j += num_sets) {
+                for (int s = 0; s < num_sets; s++) {
+                    __m512 _q = _mm512_set1_ps(query[j + s]);
+                    for (int a = 0; a < num_sums; a++) {
+                        _sums[s][a] = _mm512_fmadd_ps(_q, _mm512_loadu_ps(row + 16 * a), _sums[s][a]);
+                    }
+                    row += Rank;
+                }
+            }
+            for (; j < dimension; j++) {
+                __m512 _q = _mm512_set1_ps(query[j]);
+                for (int a = 0; a < num_sums; a++) {
+                    _sums[0][a] = _mm512_fmadd_ps(_q, _mm512_loadu_ps(row + 16 * a), _sums[0][a]);
+                }
+                row += Rank;
+            }
+            for (int a = 0; a < num_sums; a++) {
+                for (int s = 1; s < num_sets; s++) {
+                    _sums[0][a] = _mm512_add_ps(_sums[0][a], _sums[s][a]);
+                }
+                _mm512_storeu_ps(result + 16 * a, _sums[0][a]);
+            }
+        }
+
+        __attribute__((__target__("default")))
+        void project_query(const float* query, float* result) const {
+            std::fill(result, result + Rank, 0.0f);
+            const float* row = projection_matrix_t.data();
+            for (int j = 0; j < dimension; j++) {
+                float q = query[j];
+                for (int i = 0; i < Rank; i++) {
+                    result[i] += q * row[i];
+                }
+                row += Rank;
+            }
+        }
+
+        // projections of num_queries queries, each of dimension floats and ld floats apart, with one GEMM;
+        // row i of results holds the Rank values of query i
+        inline void project_queries(const float* queries, size_t num_queries, size_t ld, float* results) const {
+            pecos::do_matmul_abt(queries, num_queries, ld, projection_matrix.data(), Rank, dimension, results, Rank);
+        }
 
 
+
+        // Per-candidate scalars of the approximate distance kernels. They are computed out of line so that every
+        // version of a kernel gets them from the same instructions, whatever floating-point contraction its
+        // target allows; the kernels themselves only use explicit fused multiply-adds.
+        __attribute__((noinline))
+        void compute_l2_center_terms(
+            const char* stored_info,
+            float query_norm,
+            float query_squared_norm,
+            float center_query_l2_distance,
+            float& center_node_squared_norm,
+            float& query_center_projection_coefficient,
+            float& qres_norm,
+            float& qres_squared_norm
+        ) const {
+            float center_node_norm = reinterpret_cast<const float*>(stored_info)[0];
+            center_node_squared_norm = reinterpret_cast<const float*>(stored_info)[1];
+            float query_center_ip = (center_node_squared_norm + query_squared_norm - center_query_l2_distance) * 0.5;
+            float cos_value = query_center_ip / query_norm / center_node_norm;
+            float sin_value = std::sqrt ( 1 - cos_value * cos_value );
+            qres_norm = query_norm * sin_value;
+            qres_squared_norm = qres_norm * qres_norm;
+            query_center_projection_coefficient = query_center_ip / center_node_squared_norm;
+        }
+
+        __attribute__((noinline))
+        void compute_ip_center_terms(
+            const char* stored_info,
+            float query_norm,
+            float center_query_ip,
+            float& center_node_squared_norm,
+            float& query_center_projection_coefficient,
+            float& qres_norm
+        ) const {
+            float center_node_norm = reinterpret_cast<const float*>(stored_info)[0];
+            center_node_squared_norm = reinterpret_cast<const float*>(stored_info)[1];
+            float cos_value = center_query_ip / query_norm / center_node_norm;
+            // clamped, as the cosine of a query along the center may round past 1
+            float sin_value = std::sqrt ( std::max(1 - cos_value * cos_value, 0.0f) );
+            qres_norm = query_norm * sin_value;
+            query_center_projection_coefficient = center_query_ip / center_node_squared_norm;
+        }
+
+        __attribute__((noinline))
+        float compute_angular_qres_norm(float query_center_projection_coefficient) const {
+            return std::sqrt ( 1 - query_center_projection_coefficient * query_center_projection_coefficient );
+        }
+
         __attribute__((__target__("avx512f")))
         inline void compute_non_approximate_terms(const float* query, uint8_t* lut_ptr, float& scale, float& bias) const {
         }
@@ -369,748 +537,846 @@ namespace ann {
         inline void compute_non_approximate_terms(const float* query, uint8_t* lut_ptr, float& scale, float& bias) const {
         }
 
-        __attribute__((__target__("avx512f")))
-        inline void approximate_angular_distance(
+        // Building blocks of the AVX-512 kernels, unrolled for Rank.
+
+        // sign code of coef * center_projection - query_projection (bit 0 for >= 0) in the bit order of the
+        // neighbor codes stored by GraphFinger, one word per entry of _query_code, broadcast to every lane
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        static inline void residual_sign_code_avx512(const float* query_projection, const float* center_projection, __m512 _coef, __m512i* _query_code) {
+            for (int w = 0; w < code_words; w++) {
+                uint64_t code = 0;
+                for (int g = 0; g < 4 && 64 * w + 16 * g < Rank; g++) {
+                    int r = 64 * w + 16 * g;
+                    __m512 _residual = _mm512_fmsub_ps(_coef, _mm512_loadu_ps(center_projection + r), _mm512_loadu_ps(query_projection + r));
+                    code |= (uint64_t) _mm512_cmp_ps_mask(_residual, _mm512_setzero_ps(), _CMP_NGE_UQ) << (48 - 16 * g);
+                }
+                _query_code[w] = _mm512_set1_epi64(code);
+            }
+        }
+
+        // hamming distances between the query code and the codes of a group of 16 neighbors, as 16 int32
+        template<class Popcount>
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        static inline __m512i hamming_distance_avx512(const char* neighbor_codes, const __m512i* _query_code) {
+            __m512i _s_total = _mm512_setzero_si512();
+            for (int w = 0; w < code_words; w++) {
+                __m256i _s1 = Popcount::popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512((__m512i const*)neighbor_codes), _query_code[w]));
+                __m256i _s2 = Popcount::popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512((__m512i const*)(neighbor_codes + 64)), _query_code[w]));
+                _s_total = _mm512_add_epi32(_s_total, _mm512_inserti64x4(_mm512_castsi256_si512(_s1), _s2, 1));
+                neighbor_codes += 16 * sizeof(uint64_t);
+            }
+            return _s_total;
+        }
+
+        // the cos_blocks blocks of the cos table used by hamming_cos_avx512
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        static inline void load_cos_blocks_avx512(__m512* _cos_blocks) {
+            const float* cos_table = finger_cos_table<Rank>();
+            for (int b = 0; b < cos_blocks; b++) {
+                _cos_blocks[b] = _mm512_loadu_ps(cos_table + cos_first + 16 * b);
+            }
+        }
+
+        // estimated cosine of each hamming distance: a permutexvar in its block of the cos table
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        static inline __m512 hamming_cos_avx512(__m512i _hamming, const __m512* _cos_blocks) {
+            __m512 _cos_value = _mm512_permutexvar_ps(_hamming, _cos_blocks[cos_blocks - 1]);
+            for (int b = cos_blocks - 2; b >= 0; b--) {
+                __mmask16 _in_block = _mm512_cmp_epi32_mask(_hamming, _mm512_set1_epi32(cos_first + 16 * b + 15), _MM_CMPINT_LE);
+                _cos_value = _mm512_mask_blend_ps(_in_block, _cos_value, _mm512_permutexvar_ps(_hamming, _cos_blocks[b]));
+            }
+            return _cos_value;
+        }
+
+        template<class Popcount>
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        inline void approximate_angular_distance_avx512_impl(
             float* appx_result,
             const index_type& max_degree,
             const float& topk_ub_dist,
             const size_t neighbor_size,
             const float& query_norm,
             const float& query_squared_norm,
-            const float* query_lowrank_projection, 
+            const float* query_lowrank_projection,
             const float& query_center_projection_coefficient,
             const char* stored_info,
             const float& ss=1,
             const float& bb=0
         ) const {
-            // number of iterative loads
-            size_t neighboring_float_size = sizeof(float) * 16;
-            size_t neighboring_uint64_size = 64;
-            size_t neighboring_index_size = sizeof(index_type) * 16;
-            size_t center_size = 2 * sizeof(float);
             int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
-            __m512 _trueValue     = _mm512_set1_ps( 1.0f );
-            __m512 _falseValue    = _mm512_setzero_ps();
-            __m512i _trueValuei32     = _mm512_set1_epi32( 1 );
-            __m512i _falseValuei32    = _mm512_setzero_si512();
-            float* appx_result_ptr = appx_result;
-            
-            stored_info += center_size;
-            
+            __m512 _trueValue = _mm512_set1_ps(1.0f);
+            __m512 _falseValue = _mm512_setzero_ps();
+            __m512 _cos_blocks[cos_blocks];
+            load_cos_blocks_avx512(_cos_blocks);
             // process query information
-            float qres_norm = std::sqrt ( 1 - query_center_projection_coefficient * query_center_projection_coefficient );
-            // define returned mm512 values
+            float qres_norm = compute_angular_qres_norm(query_center_projection_coefficient);
             __m512 _topk_ub_dist = _mm512_set1_ps(topk_ub_dist);
             __m512 _query_center_projection_coefficient = _mm512_set1_ps(query_center_projection_coefficient);
-
-            // compute normalized projected query residual vector
-
             __m512 _qres_norm = _mm512_set1_ps(qres_norm);
-            
-            const float* query_lowrank_projection_ptr = query_lowrank_projection;
-            uint64_t talk2 = 0;// =  (uint64_t) zzs[0] << 48 | (uint64_t) zzs[1] << 32 | (uint64_t) zzs[2] << 16 | zzs[3];
-            size_t offset = 48;
-            //std::vector<uint16_t> zzs(4);
-            for (int i = 0; i < 4; i++) {
-                __m512 _query_sub_vector = _mm512_loadu_ps(query_lowrank_projection_ptr);
-                __m512 _center_sub_vector = _mm512_loadu_ps(stored_info);
-                _query_sub_vector = _mm512_fmsub_ps(_query_center_projection_coefficient, _center_sub_vector, _query_sub_vector);
-                __m512i _qr =  _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(_query_sub_vector, _mm512_setzero_ps(), _CMP_GE_OQ), _trueValuei32, _mm512_setzero_si512());
-                talk2 += (uint64_t) _mm512_movepi32_mask(_mm512_slli_epi32(_qr, 31)) << offset;
-                query_lowrank_projection_ptr += 16;
-                offset -= 16;
-                stored_info += neighboring_float_size;
-            }
-            __m512i _lookup_table = _mm512_set1_epi64(talk2);
-            
-            uint64_t talk3 = 0;// =  (uint64_t) zzs[0] << 48 | (uint64_t) zzs[1] << 32 | (uint64_t) zzs[2] << 16 | zzs[3];
-            size_t offset2 = 48;
-            //std::vector<uint16_t> zzs(4);
-            for (int i = 0; i < 4; i++) {
-                __m512 _query_sub_vector = _mm512_loadu_ps(query_lowrank_projection_ptr);
-                __m512 _center_sub_vector = _mm512_loadu_ps(stored_info);
-                _query_sub_vector = _mm512_fmsub_ps(_query_center_projection_coefficient, _center_sub_vector, _query_sub_vector);
-                __m512i _qr =  _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(_query_sub_vector, _mm512_setzero_ps(), _CMP_GE_OQ), _trueValuei32, _mm512_setzero_si512());
-                talk3 += (uint64_t) _mm512_movepi32_mask(_mm512_slli_epi32(_qr, 31)) << offset2;
-                query_lowrank_projection_ptr += 16;
-                offset2 -= 16;
-                stored_info += neighboring_float_size;
-            }
-            __m512i _lookup_table2 = _mm512_set1_epi64(talk3);
-
-
-            __m512i _mask = _mm512_set1_epi8(0x0f);  
-            __m512i _mask00ff = _mm512_set1_epi16(0x00ff);  
-            __m512i _mask0000ffff = _mm512_set1_epi32(0x0000ffff);  
-            __m512i _mask00000000ffffffff = _mm512_set1_epi64(0x00000000ffffffff);  
+            // sign code of the projected query residual
+            __m512i _query_code[code_words];
+            residual_sign_code_avx512(query_lowrank_projection, reinterpret_cast<const float*>(stored_info + 2 * sizeof(float)), _query_center_projection_coefficient, _query_code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
 
             for (int i = 0; i < rounds; i++) {
-                // compute |dres|^2 
                 __m512 _neighbor_res_norm = _mm512_loadu_ps(stored_info);
-                stored_info += neighboring_float_size;
-                // compute |qproj - dproj|^2
-                __m512 _neighbor_center_projection_coefficient = _mm512_loadu_ps(stored_info);
-                stored_info += neighboring_float_size;
-
-                __m512i _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                __m512i _xor = _mm512_xor_si512(_points, _lookup_table);
-
-                __m512i _s = _mm512_setzero_si512();
-                __m512i _low = _mm512_and_si512(_xor, _mask);
-                __m512i _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                __m512i _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                __m512i _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s1 = _mm512_cvtepi64_epi32(_s);
-
-                _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                _xor = _mm512_xor_si512(_points, _lookup_table);
-
-                _s = _mm512_setzero_si512(); //mm512_set1_epi32( 0 );//_falseValuei32;//_mm512_setzero_si512();
-                _low = _mm512_and_si512(_xor, _mask);
-                _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s2 = _mm512_cvtepi64_epi32(_s);
-
-                __m512i _s_total = _mm512_castsi256_si512(_s1);
-                _s_total = _mm512_inserti64x4(_s_total, _s2, 1); 
-
-
-                _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                _xor = _mm512_xor_si512(_points, _lookup_table2);
-                _s = _mm512_setzero_si512(); //mm512_set1_epi32( 0 );//_falseValuei32;//_mm512_setzero_si512();
-                _low = _mm512_and_si512(_xor, _mask);
-                _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s3 = _mm512_cvtepi64_epi32(_s);
-
-                _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                _xor = _mm512_xor_si512(_points, _lookup_table2);
-
-                _s = _mm512_setzero_si512(); //mm512_set1_epi32( 0 );//_falseValuei32;//_mm512_setzero_si512();
-                _low = _mm512_and_si512(_xor, _mask);
-                _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s4 = _mm512_cvtepi64_epi32(_s);
-
-                __m512i _s_total2 = _mm512_castsi256_si512(_s3);
-                _s_total2 = _mm512_inserti64x4(_s_total2, _s4, 1); 
-
-                _s_total = _mm512_add_epi32(_s_total, _s_total2);
-                //std::vector<uint32_t> h2(16);
-                //_mm512_storeu_si512(&h2[0], _s_total);
-                //for(int i = 0 ;i < 16;i++) {
-                //    std::cout<<h2[i]<<",";
-                //} std::cout<<std::endl;
-                //_s_total = _mm512_inserti64x4(_s_total, _s2, 1); 
-                //__m512i _s_max = _mm512_set1_epi32(ultimate_select + 16);
-                //__m512i _s_min = _mm512_set1_epi32(ultimate_select - 16);
-
-                //_s_total = _mm512_mask_blend_epi32(_mm512_cmp_epi32_mask(_s_total, _s_max , _MM_CMPINT_LE), _s_max, _s_total);
-                //_s_total = _mm512_mask_blend_epi32(_mm512_cmp_epi32_mask(_s_total, _s_min , _MM_CMPINT_LE), _s_total, _s_min);
-
-
-
-                //__m512 _tmp1 = _mm512_permutexvar_ps(_s_total, _cos_table0);
-                //__m512 _tmp2 = _mm512_permutexvar_ps(_s_total, _cos_table1);
-                __m512 _tmp3 = _mm512_permutexvar_ps(_s_total, _cos_table2);
-                __m512 _tmp4 = _mm512_permutexvar_ps(_s_total, _cos_table3);
-                __m512 _tmp5 = _mm512_permutexvar_ps(_s_total, _cos_table4);
-                __m512 _tmp6 = _mm512_permutexvar_ps(_s_total, _cos_table5);
-                //__m512 _tmp7 = _mm512_permutexvar_ps(_s_total, _cos_table6);
-                //__m512 _tmp8 = _mm512_permutexvar_ps(_s_total, _cos_table7);
-                __m512 _qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(79), _MM_CMPINT_LE), _tmp6, _tmp5);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(95), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp6);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(79), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp5);
-                _qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(63), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp4);
-                _qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(47), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp3);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(31), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp2);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(15), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp1);
-
-
-
-                //std::vector<float> ff(16);
-                //_mm512_storeu_ps(ff.data(), _qres_dres_cos_value);
-                //for(int j = 0; j < 16;j++) { std::cout<<ff[j]<<",";} std::cout<<std::endl;
-
-
-                //__m512 _neighbor_res_squared_norm = _mm512_mul_ps(_neighbor_res_norm, _neighbor_res_norm);
+                __m512 _neighbor_center_projection_coefficient = _mm512_loadu_ps(stored_info + 16 * sizeof(float));
+                __m512i _hamming = hamming_distance_avx512<Popcount>(stored_info + 32 * sizeof(float), _query_code);
+                __m512 _qres_dres_cos_value = hamming_cos_avx512(_hamming, _cos_blocks);
                 __m512 _qproj_dproj_ip = _mm512_mul_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient);
-               
-                //_qres_dres_cos_value = _mm512_fmadd_ps(_correct_scale, _qres_dres_cos_value, _correct_bias);
-                //__m512 _qres_dres_ip = _mm512_mul_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm));
-                __m512 _qres_dres_ip = _mm512_mul_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm));
-                //__m512 _qres_dres_ip = _mm512_mul_ps(_qres_dres_cos_value, _neighbor_res_norm);
-                __m512 _appx_ip_dist = _mm512_sub_ps(_trueValue, _mm512_add_ps(_qres_dres_ip, _qproj_dproj_ip));
-                //_mm512_storeu_ps(&appx_result_ptr[0], _appx_ip_dist);
-                //for (int r = 0; r <=  15; r++) { std::cout<<appx_result_ptr[r]<<",";  } std::cout<<std::endl;
-                _mm512_storeu_ps(&appx_result_ptr[0], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_appx_ip_dist, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
+                __m512 _appx_ip_dist = _mm512_sub_ps(_trueValue, _mm512_fmadd_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm), _qproj_dproj_ip));
+                _mm512_storeu_ps(&appx_result[i * 16], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_appx_ip_dist, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
+                stored_info += neighbor_group_size;
+            }
+        }
 
-                appx_result_ptr += 16;
+        __attribute__((__target__("avx512bw,avx512dq")))
+        inline void approximate_angular_distance_avx512(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& query_center_projection_coefficient,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_angular_distance_avx512_impl<FingerPopcntLookup>(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
+        }
 
-            }
+        __attribute__((__target__("avx512bw,avx512dq,avx512vpopcntdq")))
+        inline void approximate_angular_distance_avx512_vpopcntdq(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& query_center_projection_coefficient,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_angular_distance_avx512_impl<FingerPopcntNative>(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
         }
  
-        __attribute__((__target__("avx512f")))
-        inline void approximate_ip_distance(
+        template<class Popcount>
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        inline void approximate_ip_distance_avx512_impl(
             float* appx_result,
             const index_type& max_degree,
             const float& topk_ub_dist,
             const size_t neighbor_size,
             const float& query_norm,
             const float& query_squared_norm,
-            const float* query_lowrank_projection, 
+            const float* query_lowrank_projection,
             const float& center_query_ip,
             const char* stored_info,
             const float& ss=1,
             const float& bb=0
         ) const {
-            // number of iterative loads
-            size_t neighboring_float_size = sizeof(float) * 16;
-            size_t neighboring_uint64_size = 64;
-            //size_t neighboring_residual_vector_size = sizeof(float) * low_rank;
-            size_t neighboring_index_size = sizeof(index_type) * 16;
-            size_t center_size = 2 * sizeof(float);
             int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
-            __m512 _correct_bias = _mm512_set1_ps(bb);
-            __m512 _correct_scale = _mm512_set1_ps(ss);
-            //int num_left_index = rounds * 16 == neighbor_size ? 0 : neighbor_size - rounds * 16;
-            float* appx_result_ptr = appx_result;
-             
-            float center_node_norm = reinterpret_cast<const float*>(stored_info)[0];
-            float center_node_squared_norm = reinterpret_cast<const float*>(stored_info)[1]; 
-            
-            stored_info += center_size;
-            //for (int r = 8; r < 16; r++) { 
-            //    _mm_prefetch(stored_info + r * 64, _MM_HINT_T0);
-            //} 
+            __m512 _trueValue = _mm512_set1_ps(1.0f);
+            __m512 _falseValue = _mm512_setzero_ps();
+            __m512 _cos_blocks[cos_blocks];
+            load_cos_blocks_avx512(_cos_blocks);
             // process query information
-            float cos_value = center_query_ip / query_norm / center_node_norm;
-            float sin_value = std::sqrt ( 1 - cos_value * cos_value );
-            float qres_norm = query_norm * sin_value;
-            float query_center_projection_coefficient = center_query_ip / center_node_squared_norm;
-            
-            // define returned mm512 values
-            __m512 _trueValue     = _mm512_set1_ps( 1.0f );
-            __m512 _falseValue    = _mm512_set1_ps( 0.0f );
-            __m512i _trueValuei32     = _mm512_set1_epi32( 1 );
-            __m512i _falseValuei32    = _mm512_setzero_si512();
+            float center_node_squared_norm, query_center_projection_coefficient, qres_norm;
+            compute_ip_center_terms(stored_info, query_norm, center_query_ip, center_node_squared_norm, query_center_projection_coefficient, qres_norm);
             __m512 _topk_ub_dist = _mm512_set1_ps(topk_ub_dist);
-            //std::cout<<"query center l2 : "<<center_query_l2_distance<<" COS : "<<cos_value<<" SIN : "<<sin_value<<" QUERY^2 : "<<query_squared_norm<<" CENTER^2 : "<<center_node_squared_norm<<" QUERY^T CENTER : "<<query_center_ip<<std::endl;
-            // compute |qproj - dproj|^2 + |qres|^2 + |dres|^2 + Qres Dres appx IP
+            // compute 1 - (<qproj, dproj> + Qres Dres appx IP)
             __m512 _center_node_squared_norm = _mm512_set1_ps(center_node_squared_norm);
             __m512 _query_center_projection_coefficient = _mm512_set1_ps(query_center_projection_coefficient);
             __m512 _qres_norm = _mm512_set1_ps(qres_norm);
-            
-
-            // compute normalized projected query residual vector
-            const float* query_lowrank_projection_ptr = query_lowrank_projection;
-            std::vector<uint16_t> zzs(4);
-            for (int i = 0; i < 4; i++) {
-                __m512 _query_sub_vector = _mm512_loadu_ps(query_lowrank_projection_ptr);
-                __m512 _center_sub_vector = _mm512_loadu_ps(stored_info);
-                _query_sub_vector = _mm512_sub_ps(_query_sub_vector, _mm512_mul_ps(_query_center_projection_coefficient, _center_sub_vector));
-                __m512i _qr =  _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(_query_sub_vector, _falseValue, _CMP_LT_OQ), _trueValuei32, _falseValuei32);
-                //__m512i _qr =  _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(_query_sub_vector, _falseValue, _CMP_LT_OQ), _mm512_set1_epi32(1), _mm512_setzero_si512());
-                zzs[i] = _mm512_movepi32_mask(_mm512_slli_epi32(_qr, 31));
-                query_lowrank_projection_ptr += 16;
-                stored_info += neighboring_float_size;
-            }
-            //_mm_prefetch(stored_info, _MM_HINT_T0);
-
-            //const auto codebook_index_ptr = reinterpret_cast<const index_type*>(stored_info);     
-            //float projected_qres_norm = _mm512_reduce_add_ps(_accumulator);
-            //projected_qres_norm = std::sqrt(projected_qres_norm); 
-            //__m512 _projected_qres_norm = _mm512_set1_ps(projected_qres_norm);
-
-            uint64_t talk2 =  (uint64_t) zzs[0] << 48 | (uint64_t) zzs[1] << 32 | (uint64_t) zzs[2] << 16 | zzs[3];
-            __m512i _lookup_table = _mm512_set1_epi64(talk2);
-
-            __m512i _mask = _mm512_set1_epi8(0x0f);  
-            __m512i _mask00ff = _mm512_set1_epi16(0x00ff);  
-            __m512i _mask0000ffff = _mm512_set1_epi32(0x0000ffff);  
-            __m512i _mask00000000ffffffff = _mm512_set1_epi64(0x00000000ffffffff);  
+            // sign code of the projected query residual
+            __m512i _query_code[code_words];
+            residual_sign_code_avx512(query_lowrank_projection, reinterpret_cast<const float*>(stored_info + 2 * sizeof(float)), _query_center_projection_coefficient, _query_code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
 
             for (int i = 0; i < rounds; i++) {
-                // compute |dres|^2 
                 __m512 _neighbor_res_norm = _mm512_loadu_ps(stored_info);
-                stored_info += neighboring_float_size;
-                // compute |qproj - dproj|^2
-                __m512 _neighbor_center_projection_coefficient = _mm512_loadu_ps(stored_info);
-                stored_info += neighboring_float_size;
-
-                //__m512 _neighbor_res_squared_norm = _mm512_mul_ps(_neighbor_res_norm, _neighbor_res_norm);
+                __m512 _neighbor_center_projection_coefficient = _mm512_loadu_ps(stored_info + 16 * sizeof(float));
+                __m512i _hamming = hamming_distance_avx512<Popcount>(stored_info + 32 * sizeof(float), _query_code);
+                __m512 _qres_dres_cos_value = hamming_cos_avx512(_hamming, _cos_blocks);
                 __m512 _qproj_dproj_ip = _mm512_mul_ps(_mm512_mul_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient), _center_node_squared_norm);
+                __m512 _appx_ip_dist = _mm512_sub_ps(_trueValue, _mm512_fmadd_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm), _qproj_dproj_ip));
+                _mm512_storeu_ps(&appx_result[i * 16], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_appx_ip_dist, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
+                stored_info += neighbor_group_size;
+            }
+        }
 
-                __m512i _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                __m512i _xor = _mm512_xor_si512(_points, _lookup_table);
-
-                //  lookup table trick
-                __m512i _s = _falseValuei32;//_mm512_setzero_si512();
-                __m512i _low = _mm512_and_si512(_xor, _mask);
-                __m512i _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                __m512i _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                __m512i _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s1 = _mm512_cvtepi64_epi32(_s);
-
-                _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                _xor = _mm512_xor_si512(_points, _lookup_table);
-
-                //  lookup table trick
-                _s = _falseValuei32;//_mm512_setzero_si512();
-                _low = _mm512_and_si512(_xor, _mask);
-                _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s2 = _mm512_cvtepi64_epi32(_s);
-
-                __m512i _s_total = _mm512_castsi256_si512(_s1);
-                _s_total = _mm512_inserti64x4(_s_total, _s2, 1); 
-                //__m512i _s_max = _mm512_set1_epi32(48);
-                //__m512i _s_min = _mm512_set1_epi32(16);
-                __m512i _s_max = _mm512_set1_epi32(ultimate_select + 16);
-                __m512i _s_min = _mm512_set1_epi32(ultimate_select - 16);
-
-                _s_total = _mm512_mask_blend_epi32(_mm512_cmp_epi32_mask(_s_total, _s_max , _MM_CMPINT_LE), _s_max, _s_total);
-                _s_total = _mm512_mask_blend_epi32(_mm512_cmp_epi32_mask(_s_total, _s_min , _MM_CMPINT_LE), _s_total, _s_min);
-                __m512 _tmp1 = _mm512_permutexvar_ps(_s_total, _cos_table0);
-                __m512 _tmp2 = _mm512_permutexvar_ps(_s_total, _cos_table1);
-                __m512 _qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _cos_select, _MM_CMPINT_LE), _tmp1, _tmp2);
-
-                _qres_dres_cos_value = _mm512_fmadd_ps(_correct_scale, _qres_dres_cos_value, _correct_bias);
-                __m512 _qres_dres_ip = _mm512_mul_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm));
-                __m512 _appx_ip_dist = _mm512_sub_ps(_trueValue, _mm512_add_ps(_qres_dres_ip, _qproj_dproj_ip));
-                //_mm512_storeu_ps(&appx_result_ptr[0], _appx_ip_dist);
-                //for (int r = 0; r <=  15; r++) { std::cout<<appx_result_ptr[r]<<",";  } std::cout<<std::endl;
-                _mm512_storeu_ps(&appx_result_ptr[0], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_appx_ip_dist, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
-
-                //stored_info += neighboring_index_size;
-                appx_result_ptr += 16;
+        __attribute__((__target__("avx512bw,avx512dq")))
+        inline void approximate_ip_distance_avx512(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_ip,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_ip_distance_avx512_impl<FingerPopcntLookup>(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, center_query_ip, stored_info, ss, bb);
+        }
 
-            }
+        __attribute__((__target__("avx512bw,avx512dq,avx512vpopcntdq")))
+        inline void approximate_ip_distance_avx512_vpopcntdq(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_ip,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_ip_distance_avx512_impl<FingerPopcntNative>(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, center_query_ip, stored_info, ss, bb);
         }
-        __attribute__((__target__("avx512f")))
-        inline void approximate_distance(
+        template<class Popcount>
+        __attribute__((__target__("avx512bw,avx512dq"), always_inline))
+        inline void approximate_distance_avx512_impl(
             float* appx_result,
             const index_type& max_degree,
             const float& topk_ub_dist,
             const size_t neighbor_size,
             const float& query_norm,
             const float& query_squared_norm,
-            const float* query_lowrank_projection, 
+            const float* query_lowrank_projection,
             const float& center_query_l2_distance,
             const char* stored_info,
             const float& ss=1,
             const float& bb=0
         ) const {
-            // number of iterative loads
-            size_t neighboring_float_size = sizeof(float) * 16;
-            size_t neighboring_uint64_size = 64;
-            //size_t neighboring_residual_vector_size = sizeof(float) * low_rank;
-            size_t neighboring_index_size = sizeof(index_type) * 16;
-            size_t center_size = 2 * sizeof(float);
-            int num_dimension_blocks = low_rank / 16;
             int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
-            //__m512 _correct_bias = _mm512_set1_ps(bb);
-            //__m512 _correct_scale = _mm512_set1_ps(ss);
-            //int num_left_index = rounds * 16 == neighbor_size ? 0 : neighbor_size - rounds * 16;
-            float* appx_result_ptr = appx_result;
-            float center_node_norm = reinterpret_cast<const float*>(stored_info)[0];
-            float center_node_squared_norm = reinterpret_cast<const float*>(stored_info)[1]; 
-            stored_info += center_size;
-            //for (int r = 0; r < (neighbor_size  + 1) * num_dimension_blocks + rounds * 2; r++) { 
-            //    _mm_prefetch(stored_info + r * 64, _MM_HINT_T0);
-            //} 
+            __m512 _cos_blocks[cos_blocks];
+            load_cos_blocks_avx512(_cos_blocks);
             // process query information
-            float query_center_ip = (center_node_squared_norm + query_squared_norm - center_query_l2_distance) * 0.5;
-            float cos_value = query_center_ip / query_norm / center_node_norm;
-            float sin_value = std::sqrt ( 1 - cos_value * cos_value );
-            float qres_norm = query_norm * sin_value;
-            float qres_squared_norm = qres_norm * qres_norm;
-            float query_center_projection_coefficient = query_center_ip / center_node_squared_norm;
-            // define returned mm512 values
+            float center_node_squared_norm, query_center_projection_coefficient, qres_norm, qres_squared_norm;
+            compute_l2_center_terms(stored_info, query_norm, query_squared_norm, center_query_l2_distance, center_node_squared_norm, query_center_projection_coefficient, qres_norm, qres_squared_norm);
             __m512 _minus2 = _mm512_set1_ps(-2);
-            __m512 _trueValue     = _mm512_set1_ps( 1.0f );
-            __m512 _falseValue    = _mm512_setzero_ps( );
-            __m512i _trueValuei32     = _mm512_set1_epi32( 1 );
-            __m512i _falseValuei32    = _mm512_setzero_si512( );
+            __m512 _trueValue = _mm512_set1_ps(1.0f);
+            __m512 _falseValue = _mm512_setzero_ps();
             __m512 _topk_ub_dist = _mm512_set1_ps(topk_ub_dist);
-            //std::cout<<"query center l2 : "<<center_query_l2_distance<<" COS : "<<cos_value<<" SIN : "<<sin_value<<" QUERY^2 : "<<query_squared_norm<<" CENTER^2 : "<<center_node_squared_norm<<" QUERY^T CENTER : "<<query_center_ip<<std::endl;
             // compute |qproj - dproj|^2 + |qres|^2 + |dres|^2 + Qres Dres appx IP
             __m512 _center_node_squared_norm = _mm512_set1_ps(center_node_squared_norm);
             __m512 _query_center_projection_coefficient = _mm512_set1_ps(query_center_projection_coefficient);
             __m512 _qres_squared_norm = _mm512_set1_ps(qres_squared_norm);
             __m512 _qres_norm = _mm512_set1_ps(qres_norm);
-            
+            // sign code of the projected query residual
+            __m512i _query_code[code_words];
+            residual_sign_code_avx512(query_lowrank_projection, reinterpret_cast<const float*>(stored_info + 2 * sizeof(float)), _query_center_projection_coefficient, _query_code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
+
+            for (int i = 0; i < rounds; i++) {
+                __m512 _neighbor_res_norm = _mm512_loadu_ps(stored_info);
+                __m512 _neighbor_center_projection_coefficient = _mm512_loadu_ps(stored_info + 16 * sizeof(float));
+                __m512 _neighbor_res_squared_norm_plus_qres_squared_norm = _mm512_fmadd_ps(_neighbor_res_norm, _neighbor_res_norm, _qres_squared_norm);
+                __m512 _qproj_dproj_diff = _mm512_sub_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient);
+                __m512 _exact_l2_distance = _mm512_fmadd_ps(_mm512_mul_ps(_qproj_dproj_diff, _qproj_dproj_diff), _center_node_squared_norm, _neighbor_res_squared_norm_plus_qres_squared_norm);
+                __m512i _hamming = hamming_distance_avx512<Popcount>(stored_info + 32 * sizeof(float), _query_code);
+                __m512 _qres_dres_cos_value = hamming_cos_avx512(_hamming, _cos_blocks);
+                __m512 _qres_dres_ip = _mm512_mul_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm));
+                __m512 _appx_l2 = _mm512_fmadd_ps(_minus2, _qres_dres_ip, _exact_l2_distance);
+                _mm512_storeu_ps(&appx_result[i * 16], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_appx_l2, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
+                stored_info += neighbor_group_size;
+            }
+        }
 
+        __attribute__((__target__("avx512bw,avx512dq")))
+        inline void approximate_distance_avx512(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_l2_distance,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_distance_avx512_impl<FingerPopcntLookup>(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
+        }
 
+        __attribute__((__target__("avx512bw,avx512dq,avx512vpopcntdq")))
+        inline void approximate_distance_avx512_vpopcntdq(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_l2_distance,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_distance_avx512_impl<FingerPopcntNative>(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
+        }
 
-            const float* query_lowrank_projection_ptr = query_lowrank_projection;
-            uint64_t talk2 = 0;// =  (uint64_t) zzs[0] << 48 | (uint64_t) zzs[1] << 32 | (uint64_t) zzs[2] << 16 | zzs[3];
-            size_t offset = 48;
-            //std::vector<uint16_t> zzs(4);
-            for (int i = 0; i < 4; i++) {
-                __m512 _query_sub_vector = _mm512_loadu_ps(query_lowrank_projection_ptr);
-                __m512 _center_sub_vector = _mm512_loadu_ps(stored_info);
-                _query_sub_vector = _mm512_fmsub_ps(_query_center_projection_coefficient, _center_sub_vector, _query_sub_vector);
-                __m512i _qr =  _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(_query_sub_vector, _mm512_setzero_ps(), _CMP_GE_OQ), _trueValuei32, _mm512_setzero_si512());
-                talk2 += (uint64_t) _mm512_movepi32_mask(_mm512_slli_epi32(_qr, 31)) << offset;
-                query_lowrank_projection_ptr += 16;
-                offset -= 16;
-                stored_info += neighboring_float_size;
+        // Portable and AVX2 versions of the AVX-512 kernels above. They read the same index layout and produce bit-identical
+        // pruning decisions: every floating-point operation of the AVX-512 kernels is done in the same order and
+        // with the same rounding (fused multiply-adds via std::fma / _mm256_fmadd_ps), popcounts are exact, and
+        // the permutexvar lookups in the 16-entry cos tables are replaced by the equivalent index into
+        // finger_cos_table<Rank>().
+
+        // index into finger_cos_table<Rank>() used by approximate_distance, approximate_angular_distance and
+        // approximate_ip_distance for the hamming distance h between two sign codes, see cos_blocks
+        static inline int hamming_cos_index(int h) {
+            return std::min(std::max(h & ~15, cos_first), cos_last) + (h & 15);
+        }
+
+        // sign code of coef * center_projection - query_projection (bit 0 for >= 0), in the bit order of the
+        // neighbor codes stored by GraphFinger
+        static inline void residual_sign_code_default(const float* query_projection, const float* center_projection, float coef, uint64_t* code) {
+            for (int w = 0; w < code_words; w++) {
+                code[w] = 0;
             }
-            __m512i _lookup_table = _mm512_set1_epi64(talk2);
-            
-            uint64_t talk3 = 0;// =  (uint64_t) zzs[0] << 48 | (uint64_t) zzs[1] << 32 | (uint64_t) zzs[2] << 16 | zzs[3];
-            size_t offset2 = 48;
-            //std::vector<uint16_t> zzs(4);
-            for (int i = 0; i < 4; i++) {
-                __m512 _query_sub_vector = _mm512_loadu_ps(query_lowrank_projection_ptr);
-                __m512 _center_sub_vector = _mm512_loadu_ps(stored_info);
-                _query_sub_vector = _mm512_fmsub_ps(_query_center_projection_coefficient, _center_sub_vector, _query_sub_vector);
-                __m512i _qr =  _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(_query_sub_vector, _mm512_setzero_ps(), _CMP_GE_OQ), _trueValuei32, _mm512_setzero_si512());
-                talk3 += (uint64_t) _mm512_movepi32_mask(_mm512_slli_epi32(_qr, 31)) << offset2;
-                query_lowrank_projection_ptr += 16;
-                offset2 -= 16;
-                stored_info += neighboring_float_size;
+            for (int r = 0; r < Rank; r++) {
+                if (!(std::fma(coef, center_projection[r], -query_projection[r]) >= 0)) {
+                    code[r / 64] |= uint64_t(1) << (48 - 16 * ((r % 64) / 16) + r % 16);
+                }
+            }
+        }
+
+        // hamming distance between the query code and the code of neighbor j of a group of 16 neighbors
+        static inline int hamming_distance_default(const uint64_t* neighbor_codes, int j, const uint64_t* code) {
+            int hamming = 0;
+            for (int w = 0; w < code_words; w++) {
+                hamming += __builtin_popcountll(neighbor_codes[w * 16 + j] ^ code[w]);
             }
-            __m512i _lookup_table2 = _mm512_set1_epi64(talk3);
+            return hamming;
+        }
+
+        inline void approximate_angular_distance_default(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& query_center_projection_coefficient,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            const float* cos_table = finger_cos_table<Rank>();
+            int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
+            float qres_norm = compute_angular_qres_norm(query_center_projection_coefficient);
+            const float* center_projection = reinterpret_cast<const float*>(stored_info + 2 * sizeof(float));
+            uint64_t code[code_words];
+            residual_sign_code_default(query_lowrank_projection, center_projection, query_center_projection_coefficient, code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
 
             for (int i = 0; i < rounds; i++) {
-                // compute |dres|^2 
-                __m512 _neighbor_res_norm = _mm512_loadu_ps(stored_info);
-                stored_info += neighboring_float_size;
-                // compute |qproj - dproj|^2
-                __m512 _neighbor_center_projection_coefficient = _mm512_loadu_ps(stored_info);
-                stored_info += neighboring_float_size;
+                const float* neighbor_res_norm = reinterpret_cast<const float*>(stored_info);
+                const float* neighbor_center_projection_coefficient = neighbor_res_norm + 16;
+                const uint64_t* neighbor_codes = reinterpret_cast<const uint64_t*>(neighbor_center_projection_coefficient + 16);
+                for (int j = 0; j < 16; j++) {
+                    int hamming = hamming_distance_default(neighbor_codes, j, code);
+                    float qres_dres_cos_value = cos_table[hamming_cos_index(hamming)];
+                    float qproj_dproj_ip = query_center_projection_coefficient * neighbor_center_projection_coefficient[j];
+                    float appx_ip_dist = 1.0f - std::fma(qres_dres_cos_value, qres_norm * neighbor_res_norm[j], qproj_dproj_ip);
+                    appx_result[i * 16 + j] = (appx_ip_dist < topk_ub_dist) ? 1.0f : 0.0f;
+                }
+                stored_info += neighbor_group_size;
+            }
+        }
 
-                __m512 _neighbor_res_squared_norm_plus_qres_squared_norm = _mm512_fmadd_ps(_neighbor_res_norm, _neighbor_res_norm, _qres_squared_norm);
-                __m512 _qproj_dproj_diff = _mm512_sub_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient);
-                __m512 _exact_l2_distance = _mm512_fmadd_ps(_mm512_mul_ps(_qproj_dproj_diff, _qproj_dproj_diff), _center_node_squared_norm, _neighbor_res_squared_norm_plus_qres_squared_norm);
-                // combine exact distances
-                //__m512 _exact_l2_distance = _qproj_dproj_l2 + _qres_squared_norm + _neighbor_res_squared_norm;
-                //std::vector<float> ff(16);
-                //_mm512_storeu_ps(ff.data(), _exact_l2_distance);
-                //for(int j = 0; j < 16; j++) { std::cout<<ff[j]<<",";} std::cout<<std::endl; 
-             
-                __m512i _mask = _mm512_set1_epi8(0x0f);  
-                __m512i _mask00ff = _mm512_set1_epi16(0x00ff);  
-                __m512i _mask0000ffff = _mm512_set1_epi32(0x0000ffff);  
-                __m512i _mask00000000ffffffff = _mm512_set1_epi64(0x00000000ffffffff);  
-
-                __m512i _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                __m512i _xor = _mm512_xor_si512(_points, _lookup_table);
-
-                __m512i _s = _mm512_setzero_si512();
-                __m512i _low = _mm512_and_si512(_xor, _mask);
-                __m512i _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                __m512i _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                __m512i _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s1 = _mm512_cvtepi64_epi32(_s);
-
-                _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                _xor = _mm512_xor_si512(_points, _lookup_table);
-
-                _s = _mm512_setzero_si512(); //mm512_set1_epi32( 0 );//_falseValuei32;//_mm512_setzero_si512();
-                _low = _mm512_and_si512(_xor, _mask);
-                _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s2 = _mm512_cvtepi64_epi32(_s);
-
-                __m512i _s_total = _mm512_castsi256_si512(_s1);
-                _s_total = _mm512_inserti64x4(_s_total, _s2, 1); 
-
-
-                _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                _xor = _mm512_xor_si512(_points, _lookup_table2);
-                _s = _mm512_setzero_si512(); //mm512_set1_epi32( 0 );//_falseValuei32;//_mm512_setzero_si512();
-                _low = _mm512_and_si512(_xor, _mask);
-                _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s3 = _mm512_cvtepi64_epi32(_s);
-
-                _points = _mm512_loadu_si512((__m512i const*)stored_info);
-                stored_info += neighboring_uint64_size;
-                _xor = _mm512_xor_si512(_points, _lookup_table2);
-
-                _s = _mm512_setzero_si512(); //mm512_set1_epi32( 0 );//_falseValuei32;//_mm512_setzero_si512();
-                _low = _mm512_and_si512(_xor, _mask);
-                _high = _mm512_and_si512(_mm512_srli_epi16(_xor, 4), _mask);
-                _pl = _mm512_shuffle_epi8(_popcnt_lookup_table, _low);
-                _ph = _mm512_shuffle_epi8(_popcnt_lookup_table, _high);
-                _s = _mm512_add_epi8(_s, _pl);
-                _s = _mm512_add_epi8(_s, _ph);
-
-                _s = _mm512_add_epi16(_mm512_and_si512(_s, _mask00ff), _mm512_and_si512(_mm512_srli_epi16(_s, 8), _mask00ff));
-                _s = _mm512_add_epi32(_mm512_and_si512(_s, _mask0000ffff), _mm512_and_si512(_mm512_srli_epi32(_s, 16), _mask0000ffff));
-                _s = _mm512_add_epi64(_mm512_and_si512(_s, _mask00000000ffffffff), _mm512_and_si512(_mm512_srli_epi64(_s, 32), _mask00000000ffffffff));
-                __m256i _s4 = _mm512_cvtepi64_epi32(_s);
-
-                __m512i _s_total2 = _mm512_castsi256_si512(_s3);
-                _s_total2 = _mm512_inserti64x4(_s_total2, _s4, 1); 
-
-                _s_total = _mm512_add_epi32(_s_total, _s_total2);
-                //__m512i _s_max = _mm512_set1_epi32(80);
-                //__m512i _s_min = _mm512_set1_epi32(48);
-
-
-                
-                //std::vector<uint32_t> h(16);
-                //_mm512_storeu_si512(h.data(), _s_total);
-                //for(int j = 0; j < 16; j++) { std::cout<<h[j]<<",";} std::cout<<std::endl; 
-
-
-                //__m512 _tmp1 = _mm512_permutexvar_ps(_s_total, _cos_table0);
-                //__m512 _tmp2 = _mm512_permutexvar_ps(_s_total, _cos_table1);
-                __m512 _tmp3 = _mm512_permutexvar_ps(_s_total, _cos_table2);
-                __m512 _tmp4 = _mm512_permutexvar_ps(_s_total, _cos_table3);
-                __m512 _tmp5 = _mm512_permutexvar_ps(_s_total, _cos_table4);
-                __m512 _tmp6 = _mm512_permutexvar_ps(_s_total, _cos_table5);
-                //__m512 _tmp7 = _mm512_permutexvar_ps(_s_total, _cos_table6);
-                //__m512 _tmp8 = _mm512_permutexvar_ps(_s_total, _cos_table7);
-                __m512 _qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(79), _MM_CMPINT_LE), _tmp6, _tmp5);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(95), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp6);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(79), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp5);
-                _qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(63), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp4);
-                _qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(47), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp3);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(31), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp2);
-                //_qres_dres_cos_value = _mm512_mask_blend_ps(_mm512_cmp_epi32_mask(_s_total, _mm512_set1_epi32(15), _MM_CMPINT_LE), _qres_dres_cos_value, _tmp1);
-
-                //_mm512_storeu_ps(ff.data(), _qres_dres_cos_value);
-                //for(int j = 0; j < 16; j++) { std::cout<<ff[j]<<",";} std::cout<<std::endl; 
-/*
-                _mm512_storeu_si512(&zz[0], _high);
-
-                for(int i = 0 ; i < 16;i++) {
-                    uint32_t tmp = zz[i];
-                    for (int j = 0; j < 32; j++) { 
-                        std::cout<<(tmp & 1)<<",";
-                        tmp >>= 1;                  
-                    } std::cout<<std::endl;
+        inline void approximate_ip_distance_default(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_ip,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            const float* cos_table = finger_cos_table<Rank>();
+            int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
+            float center_node_squared_norm, query_center_projection_coefficient, qres_norm;
+            compute_ip_center_terms(stored_info, query_norm, center_query_ip, center_node_squared_norm, query_center_projection_coefficient, qres_norm);
+            const float* center_projection = reinterpret_cast<const float*>(stored_info + 2 * sizeof(float));
+            uint64_t code[code_words];
+            residual_sign_code_default(query_lowrank_projection, center_projection, query_center_projection_coefficient, code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
+
+            for (int i = 0; i < rounds; i++) {
+                const float* neighbor_res_norm = reinterpret_cast<const float*>(stored_info);
+                const float* neighbor_center_projection_coefficient = neighbor_res_norm + 16;
+                const uint64_t* neighbor_codes = reinterpret_cast<const uint64_t*>(neighbor_center_projection_coefficient + 16);
+                for (int j = 0; j < 16; j++) {
+                    int hamming = hamming_distance_default(neighbor_codes, j, code);
+                    float qres_dres_cos_value = cos_table[hamming_cos_index(hamming)];
+                    float qproj_dproj_ip = (query_center_projection_coefficient * neighbor_center_projection_coefficient[j]) * center_node_squared_norm;
+                    float appx_ip_dist = 1.0f - std::fma(qres_dres_cos_value, qres_norm * neighbor_res_norm[j], qproj_dproj_ip);
+                    appx_result[i * 16 + j] = (appx_ip_dist < topk_ub_dist) ? 1.0f : 0.0f;
                 }
-                std::vector<uint8_t> h(64);
-                _mm512_storeu_si512(&h[0], _popcnt_lookup_table);
-                for(int i = 0 ;i < 64;i++) {
-                    uint8_t tmp = h[i];
-                    std::cout<<unsigned(tmp)<<",";
-                } std::cout<<std::endl;
-                 
-
-                std::cout<<"PUPUPUPUPUPU"<<std::endl;
-                _mm512_storeu_si512(&h[0], _pl);
-
-                for(int i = 0 ;i < 64;i++) {
-                    uint8_t tmp = h[i];
-                    std::cout<<unsigned(tmp)<<",";
-                } std::cout<<std::endl;
-
-                std::cout<<"PUPUPUPUPUPU"<<std::endl;
-                _mm512_storeu_si512(&h[0], _ph);
-
-                for(int i = 0 ;i < 64;i++) {
-                    uint8_t tmp = h[i];
-                    std::cout<<unsigned(tmp)<<",";
-                } std::cout<<std::endl;
-*/
+                stored_info += neighbor_group_size;
+            }
+        }
 
-                //__m512i _sum_result = _mm512_setzero_si512();
-                //_sum_result = _mm512_adds_epu16(_sum_result, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(_s, 0)));
-                //_sum_result = _mm512_adds_epu16(_sum_result, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(_s, 1)));
-                //_s = _mm512_add_epi16(_mm512_and_si512(_s, _mask), _mm512_and_si512(_mm512_srli_epi16(_s, 4), _mask));
-
-/*                std::vector<uint32_t> h(16);
-                std::vector<uint8_t> h2(32);
-                _mm512_storeu_si512(&h2[0], _s);
-                for(int i = 0 ;i < 64;i++) {
-                    uint8_t tmp = h2[i];
-                    std::cout<<unsigned(tmp)<<",";
-                } std::cout<<std::endl;
-*/
-/*
-                std::vector<uint32_t> h(16);
-                _mm512_storeu_si512(&h[0], _s);
-                for (int i = 0 ; i < 16; i++) {
-                    uint32_t tmp = h[i];
-                    std::cout<<unsigned(tmp)<<",";
-                } std::cout<<std::endl;
-*/
-                //std::vector<uint32_t> h(16);
-                //_mm512_storeu_si512(&h[0], _s);
-                //for (int i = 0 ; i < 16; i++) {
-                 //   hamming[i] = std::cos( h[i] * ANGLE );
-                //}
-/*
-                _mm512_storeu_si512(&h[0], _s);
-                for (int i = 0 ; i < 16; i++) {
-                    uint32_t tmp = h[i];
-                    std::cout<<unsigned(tmp)<<",";
-                } std::cout<<std::endl;
-                for (int i = 0 ; i < 16; i++) {
-                    uint16_t kk = tmp[i];//std::cout<<tmp[i]<<",";                  
-                    for(int j = 0; j < 16; j++) { 
-                        std::cout<<(kk & 1)<<",";
-                        kk >>= 1;
-                    } std::cout<<std::endl;
-                    //hamming[i] = _popcnt32(tmp[i]);
-                    //std::cout<<hamming[i]<<",";
-                    hamming[i] = std::cos( hamming[i] * ANGLE );
-                } 
-                std::cout<<std::endl;
-*/
-                // compute Projected Qres Dres IP, save the exact_distance - query_projection_coefficient * neighbor_center_dot_product into results first
-                //__m512 _neighbor_residual_center_negative_dot_product = _mm512_loadu_ps(stored_info);
-                //stored_info += (16 * sizeof(float));
-                //_mm512_storeu_ps(&appx_result_ptr[0], _mm512_add_ps(_exact_l2_distance, _mm512_mul_ps(_query_center_projection_coefficient, _neighbor_residual_center_negative_dot_product)));
-                //for (int r = 0; r < 16; r++) { 
-                //    appx_result_ptr[r] = (do_dot_product_simd(query_residual_vector.data(), &codebook[codebook_index_ptr[r] * low_rank], low_rank)); 
-                //}
-
-                //__m512 _qres_dres_cos_value = (__m512) _mm512_loadu_si512(hamming.data());
-                //_qres_dres_cos_value = _mm512_mul_ps(_qres_dres_cos_value, _angle);
-
-                //_mm512_storeu_ps(&appx_result_ptr[0], _qres_dres_cos_value);
-                //for (int r = 0; r <=  15; r++) { std::cout<<appx_result_ptr[r]<<",";  } std::cout<<std::endl;
-                //_qres_dres_cos_value = _mm512_div_ps(_qres_dres_cos_value, _projected_qres_norm);
-                //_qres_dres_cos_value = _mm512_add_ps(_mm512_mul_ps(_correct_scale, _qres_dres_cos_value), _correct_bias);
-                //_qres_dres_cos_value = _mm512_fmadd_ps(_correct_scale, _qres_dres_cos_value, _correct_bias);
-                __m512 _qres_dres_ip = _mm512_mul_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm));
-                __m512 _appx_l2 = _mm512_fmadd_ps(_minus2, _qres_dres_ip, _exact_l2_distance);
-                //_mm512_storeu_ps(&appx_result_ptr[0], _appx_l2);
-                //for (int r = 0; r <=  15; r++) { std::cout<<appx_result_ptr[r]<<",";  } std::cout<<std::endl;
-                //_mm512_storeu_ps(&appx_result_ptr[0], _appx_l2);
-                _mm512_storeu_ps(&appx_result_ptr[0], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_appx_l2, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
+        inline void approximate_distance_default(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_l2_distance,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            const float* cos_table = finger_cos_table<Rank>();
+            int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
+            float center_node_squared_norm, query_center_projection_coefficient, qres_norm, qres_squared_norm;
+            compute_l2_center_terms(stored_info, query_norm, query_squared_norm, center_query_l2_distance, center_node_squared_norm, query_center_projection_coefficient, qres_norm, qres_squared_norm);
+            const float* center_projection = reinterpret_cast<const float*>(stored_info + 2 * sizeof(float));
+            uint64_t code[code_words];
+            residual_sign_code_default(query_lowrank_projection, center_projection, query_center_projection_coefficient, code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
+
+            for (int i = 0; i < rounds; i++) {
+                const float* neighbor_res_norm = reinterpret_cast<const float*>(stored_info);
+                const float* neighbor_center_projection_coefficient = neighbor_res_norm + 16;
+                const uint64_t* neighbor_codes = reinterpret_cast<const uint64_t*>(neighbor_center_projection_coefficient + 16);
+                for (int j = 0; j < 16; j++) {
+                    float neighbor_res_squared_norm_plus_qres_squared_norm = std::fma(neighbor_res_norm[j], neighbor_res_norm[j], qres_squared_norm);
+                    float qproj_dproj_diff = query_center_projection_coefficient - neighbor_center_projection_coefficient[j];
+                    float qproj_dproj_diff_squared = qproj_dproj_diff * qproj_dproj_diff;
+                    float exact_l2_distance = std::fma(qproj_dproj_diff_squared, center_node_squared_norm, neighbor_res_squared_norm_plus_qres_squared_norm);
+                    int hamming = hamming_distance_default(neighbor_codes, j, code);
+                    float qres_dres_ip = cos_table[hamming_cos_index(hamming)] * (qres_norm * neighbor_res_norm[j]);
+                    float appx_l2 = std::fma(-2.0f, qres_dres_ip, exact_l2_distance);
+                    appx_result[i * 16 + j] = (appx_l2 < topk_ub_dist) ? 1.0f : 0.0f;
+                }
+                stored_info += neighbor_group_size;
+            }
+        }
 
-                //stored_info += neighboring_index_size;
-                appx_result_ptr += 16;
+        // popcount of each 64-bit lane
+        __attribute__((__target__("avx2,fma")))
+        static inline __m256i popcount_epi64_avx2(__m256i x) {
+            const __m256i lookup = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+            );
+            const __m256i mask = _mm256_set1_epi8(0x0f);
+            __m256i low = _mm256_and_si256(x, mask);
+            __m256i high = _mm256_and_si256(_mm256_srli_epi16(x, 4), mask);
+            __m256i s = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+            return _mm256_sad_epu8(s, _mm256_setzero_si256());
+        }
+
+        // hamming distances between the 8 consecutive 64-bit codes at neighbor_codes and code, as 8 int32
+        __attribute__((__target__("avx2,fma")))
+        static inline __m256i hamming_distance_avx2(const char* neighbor_codes, __m256i code) {
+            __m256i a = popcount_epi64_avx2(_mm256_xor_si256(_mm256_loadu_si256((__m256i const*)neighbor_codes), code));
+            __m256i b = popcount_epi64_avx2(_mm256_xor_si256(_mm256_loadu_si256((__m256i const*)(neighbor_codes + 32)), code));
+            // gather the low 32 bits of the 64-bit lanes of a and b in order
+            __m256i s = _mm256_blend_epi32(_mm256_shuffle_epi32(a, 0x88), _mm256_shuffle_epi32(b, 0x88), 0xcc);
+            return _mm256_permute4x64_epi64(s, 0xd8);
+        }
 
+        // residual_sign_code_default on 8 components at a time, one word per entry of _code, broadcast to every lane
+        __attribute__((__target__("avx2,fma")))
+        static inline void residual_sign_code_avx2(const float* query_projection, const float* center_projection, __m256 _coef, __m256i* _code) {
+            for (int w = 0; w < code_words; w++) {
+                uint64_t code = 0;
+                for (int i = 0; i < 8 && 64 * w + 8 * i < Rank; i++) {
+                    int r = 64 * w + 8 * i;
+                    __m256 _residual = _mm256_fmsub_ps(_coef, _mm256_loadu_ps(center_projection + r), _mm256_loadu_ps(query_projection + r));
+                    uint64_t bits = _mm256_movemask_ps(_mm256_cmp_ps(_residual, _mm256_setzero_ps(), _CMP_NGE_UQ));
+                    code |= bits << (48 - 16 * (i / 2) + 8 * (i % 2));
+                }
+                _code[w] = _mm256_set1_epi64x(code);
             }
-/*
-            if (num_left_index > 0) {
-                // compute |dres|^2 
-                __m512 _neighbor_res_norm = _mm512_loadu_ps(stored_info);
-                stored_info += neighboring_float_size;
-                //__m512 _neighbor_res_squared_norm = _mm512_loadu_ps(stored_info);
-                //__m512 _neighbor_res_norm = _mm512_sqrt_ps(_neighbor_res_squared_norm);
-                //__m512 _neighbor_res_squared_norm = _mm512_mul_ps(_neighbor_res_norm, _neighbor_res_norm);
-    //           for (int r = 0; r < num_left_index; r++) { std::cout<<reinterpret_cast<const float*>(stored_info)[r]<<" ";} std::cout<<std::endl;
-                // compute |dres|^2 
-                __m512 _neighbor_center_projection_coefficient = _mm512_loadu_ps(stored_info);
-    //            for (int r = 0; r < num_left_index; r++) { std::cout<<reinterpret_cast<const float*>(stored_info)[r]<<" ";} std::cout<<std::endl;
-                stored_info += neighboring_float_size;
-                //const auto codebook_index_ptr = reinterpret_cast<const index_type*>(stored_info);     
-                //for (int r = 0; r < num_left_index; r++) { 
-                //    _mm_prefetch(&codebook[codebook_index_ptr[r] * low_rank], _MM_HINT_T0);
-               // }
-                __m512 _neighbor_res_squared_norm = _mm512_mul_ps(_neighbor_res_norm, _neighbor_res_norm);
-                // compute |qproj - dproj|^2
-                __m512 _qproj_dproj_diff = _mm512_sub_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient);
-                __m512 _qproj_dproj_l2 = _mm512_mul_ps(_mm512_mul_ps(_qproj_dproj_diff, _qproj_dproj_diff), _center_node_squared_norm); 
-                // combine exact distances
-                __m512 _exact_l2_distance = _qproj_dproj_l2 + _qres_squared_norm + _neighbor_res_squared_norm;
-                //_mm512_storeu_ps(&appx_result_ptr[0], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_exact_l2_distance, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
-                //_mm512_storeu_ps(&appx_result_ptr[0], _exact_l2_distance);
-                //std::cout<<num_left_index<<"   "<<neighbor_size<<std::endl;
-                //for (int r = 0; r < num_left_index; r++) { std::cout<<r<<" : "<<appx_result_ptr[r]<<" ";} std::cout<<std::endl;
-                // compute Projected Qres Dres IP, save the exact_distance - query_projection_coefficient * neighbor_center_dot_product into results first
-                //__m512 _neighbor_residual_center_negative_dot_product = _mm512_loadu_ps(stored_info);
-                //for (int r = 0; r < num_left_index; r++) { std::cout<<reinterpret_cast<const float*>(stored_info)[r]<<" ";} std::cout<<std::endl;
-                //stored_info += (16 * sizeof(float));
-                //_mm512_storeu_ps(&appx_result_ptr[0], _mm512_add_ps(_exact_l2_distance, _mm512_mul_ps(_query_center_projection_coefficient, _neighbor_residual_center_negative_dot_product)));
-                //std::cout<<num_left_index<<"  "<<rounds<<" "<<low_rank<<std::endl; 
-                //_mm_prefetch(&codebook[codebook_index_ptr[0] * low_rank], _MM_HINT_T0);
-
-                //for (int r = 0; r < num_left_index; r++) { 
-                    //_mm_prefetch(&codebook[codebook_index_ptr[std::min(r + 1, num_left_index - 1)] * low_rank], _MM_HINT_T0);
-                //    appx_result_ptr[r] = (do_dot_product_simd(query_residual_vector.data(), &codebook[codebook_index_ptr[r] * low_rank], low_rank));
-    //                std::cout<<r<<" : "<<appx_result_ptr[r]<<" : "<<codebook_index_ptr[r]<<"  "<<do_dot_product_simd(query_residual_vector.data(), &codebook[codebook_index_ptr[r] * low_rank], low_rank)<<std::endl;
-//                    std::cout<<appx_result_ptr[r]<<",";
-                //}
-                //std::cout<<std::endl;
-                __m512 _qres_dres_cos_value = _mm512_loadu_ps(appx_result_ptr);
-                //_qres_dres_cos_value = _mm512_add_ps(_mm512_mul_ps(_correct_scale, _qres_dres_cos_value), _correct_bias);
-                __m512 _qres_dres_ip = _mm512_mul_ps(_qres_dres_cos_value, _mm512_mul_ps(_qres_norm, _neighbor_res_norm));
-                __m512 _appx_l2 = _mm512_add_ps(_exact_l2_distance, _mm512_mul_ps(_minus2, _qres_dres_ip));
-                
-    
-    
-                _mm512_storeu_ps(&appx_result_ptr[0], _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_appx_l2, _topk_ub_dist, _CMP_LT_OQ), _falseValue, _trueValue));
-                //_mm512_storeu_ps(&appx_result_ptr[0], _appx_l2);
-//                for (int r = 0; r <=  num_left_index - 1; r++) { std::cout<<appx_result_ptr[r]<<",";  } std::cout<<std::endl;
-                
-                // if the appx distance is larger than current bound
-      //          for (int r = 0; r <=  num_left_index - 1; r++) { 
-       //             std::cout<<r<<" : "<<appx_result_ptr[r]<<" : "<<codebook_index_ptr[r]<<"  "<<do_dot_product_simd(query_residual_vector.data(), &codebook[codebook_index_ptr[r] * low_rank], low_rank)<<std::endl;
-        //        }
-      
-            }            
-           */ 
+        }
+
+        // hamming distances between the query code and the codes of 8 consecutive neighbors of a group, as 8 int32
+        __attribute__((__target__("avx2,fma")))
+        static inline __m256i group_hamming_distance_avx2(const char* neighbor_codes, const __m256i* _code) {
+            __m256i _hamming = hamming_distance_avx2(neighbor_codes, _code[0]);
+            for (int w = 1; w < code_words; w++) {
+                _hamming = _mm256_add_epi32(_hamming, hamming_distance_avx2(neighbor_codes + w * 16 * sizeof(uint64_t), _code[w]));
+            }
+            return _hamming;
+        }
+
+        // hamming_cos_index on 8 lanes
+        __attribute__((__target__("avx2,fma")))
+        static inline __m256i hamming_cos_index_avx2(__m256i h) {
+            __m256i base = _mm256_andnot_si256(_mm256_set1_epi32(15), h);
+            base = _mm256_min_epi32(_mm256_max_epi32(base, _mm256_set1_epi32(cos_first)), _mm256_set1_epi32(cos_last));
+            return _mm256_add_epi32(base, _mm256_and_si256(h, _mm256_set1_epi32(15)));
+        }
+
+        __attribute__((__target__("avx2,fma")))
+        inline void approximate_angular_distance_avx2(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& query_center_projection_coefficient,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            const float* cos_table = finger_cos_table<Rank>();
+            int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
+            float qres_norm = compute_angular_qres_norm(query_center_projection_coefficient);
+            __m256 _trueValue = _mm256_set1_ps(1.0f);
+            __m256 _topk_ub_dist = _mm256_set1_ps(topk_ub_dist);
+            __m256 _query_center_projection_coefficient = _mm256_set1_ps(query_center_projection_coefficient);
+            __m256 _qres_norm = _mm256_set1_ps(qres_norm);
+            const float* center_projection = reinterpret_cast<const float*>(stored_info + 2 * sizeof(float));
+            __m256i _code[code_words];
+            residual_sign_code_avx2(query_lowrank_projection, center_projection, _query_center_projection_coefficient, _code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
+
+            for (int i = 0; i < rounds; i++) {
+                const float* neighbor_res_norm = reinterpret_cast<const float*>(stored_info);
+                const float* neighbor_center_projection_coefficient = neighbor_res_norm + 16;
+                const char* neighbor_codes = stored_info + 32 * sizeof(float);
+                for (int j = 0; j < 16; j += 8) {
+                    __m256 _neighbor_res_norm = _mm256_loadu_ps(neighbor_res_norm + j);
+                    __m256 _neighbor_center_projection_coefficient = _mm256_loadu_ps(neighbor_center_projection_coefficient + j);
+                    __m256i _hamming = group_hamming_distance_avx2(neighbor_codes + j * sizeof(uint64_t), _code);
+                    __m256 _qres_dres_cos_value = _mm256_i32gather_ps(cos_table, hamming_cos_index_avx2(_hamming), 4);
+                    __m256 _qproj_dproj_ip = _mm256_mul_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient);
+                    __m256 _appx_ip_dist = _mm256_sub_ps(_trueValue, _mm256_fmadd_ps(_qres_dres_cos_value, _mm256_mul_ps(_qres_norm, _neighbor_res_norm), _qproj_dproj_ip));
+                    _mm256_storeu_ps(appx_result + i * 16 + j, _mm256_and_ps(_mm256_cmp_ps(_appx_ip_dist, _topk_ub_dist, _CMP_LT_OQ), _trueValue));
+                }
+                stored_info += neighbor_group_size;
+            }
+        }
+
+        __attribute__((__target__("avx2,fma")))
+        inline void approximate_ip_distance_avx2(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_ip,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            const float* cos_table = finger_cos_table<Rank>();
+            int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
+            float center_node_squared_norm, query_center_projection_coefficient, qres_norm;
+            compute_ip_center_terms(stored_info, query_norm, center_query_ip, center_node_squared_norm, query_center_projection_coefficient, qres_norm);
+            __m256 _trueValue = _mm256_set1_ps(1.0f);
+            __m256 _topk_ub_dist = _mm256_set1_ps(topk_ub_dist);
+            __m256 _center_node_squared_norm = _mm256_set1_ps(center_node_squared_norm);
+            __m256 _query_center_projection_coefficient = _mm256_set1_ps(query_center_projection_coefficient);
+            __m256 _qres_norm = _mm256_set1_ps(qres_norm);
+            const float* center_projection = reinterpret_cast<const float*>(stored_info + 2 * sizeof(float));
+            __m256i _code[code_words];
+            residual_sign_code_avx2(query_lowrank_projection, center_projection, _query_center_projection_coefficient, _code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
+
+            for (int i = 0; i < rounds; i++) {
+                const float* neighbor_res_norm = reinterpret_cast<const float*>(stored_info);
+                const float* neighbor_center_projection_coefficient = neighbor_res_norm + 16;
+                const char* neighbor_codes = stored_info + 32 * sizeof(float);
+                for (int j = 0; j < 16; j += 8) {
+                    __m256 _neighbor_res_norm = _mm256_loadu_ps(neighbor_res_norm + j);
+                    __m256 _neighbor_center_projection_coefficient = _mm256_loadu_ps(neighbor_center_projection_coefficient + j);
+                    __m256i _hamming = group_hamming_distance_avx2(neighbor_codes + j * sizeof(uint64_t), _code);
+                    __m256 _qres_dres_cos_value = _mm256_i32gather_ps(cos_table, hamming_cos_index_avx2(_hamming), 4);
+                    __m256 _qproj_dproj_ip = _mm256_mul_ps(_mm256_mul_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient), _center_node_squared_norm);
+                    __m256 _appx_ip_dist = _mm256_sub_ps(_trueValue, _mm256_fmadd_ps(_qres_dres_cos_value, _mm256_mul_ps(_qres_norm, _neighbor_res_norm), _qproj_dproj_ip));
+                    _mm256_storeu_ps(appx_result + i * 16 + j, _mm256_and_ps(_mm256_cmp_ps(_appx_ip_dist, _topk_ub_dist, _CMP_LT_OQ), _trueValue));
+                }
+                stored_info += neighbor_group_size;
+            }
+        }
+
+        __attribute__((__target__("avx2,fma")))
+        inline void approximate_distance_avx2(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_l2_distance,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            const float* cos_table = finger_cos_table<Rank>();
+            int rounds = neighbor_size % 16 == 0 ? neighbor_size / 16 : neighbor_size / 16 + 1;
+            float center_node_squared_norm, query_center_projection_coefficient, qres_norm, qres_squared_norm;
+            compute_l2_center_terms(stored_info, query_norm, query_squared_norm, center_query_l2_distance, center_node_squared_norm, query_center_projection_coefficient, qres_norm, qres_squared_norm);
+            __m256 _minus2 = _mm256_set1_ps(-2);
+            __m256 _trueValue = _mm256_set1_ps(1.0f);
+            __m256 _topk_ub_dist = _mm256_set1_ps(topk_ub_dist);
+            __m256 _center_node_squared_norm = _mm256_set1_ps(center_node_squared_norm);
+            __m256 _query_center_projection_coefficient = _mm256_set1_ps(query_center_projection_coefficient);
+            __m256 _qres_squared_norm = _mm256_set1_ps(qres_squared_norm);
+            __m256 _qres_norm = _mm256_set1_ps(qres_norm);
+            const float* center_projection = reinterpret_cast<const float*>(stored_info + 2 * sizeof(float));
+            __m256i _code[code_words];
+            residual_sign_code_avx2(query_lowrank_projection, center_projection, _query_center_projection_coefficient, _code);
+            stored_info += 2 * sizeof(float) + Rank * sizeof(float);
+
+            for (int i = 0; i < rounds; i++) {
+                const float* neighbor_res_norm = reinterpret_cast<const float*>(stored_info);
+                const float* neighbor_center_projection_coefficient = neighbor_res_norm + 16;
+                const char* neighbor_codes = stored_info + 32 * sizeof(float);
+                for (int j = 0; j < 16; j += 8) {
+                    __m256 _neighbor_res_norm = _mm256_loadu_ps(neighbor_res_norm + j);
+                    __m256 _neighbor_center_projection_coefficient = _mm256_loadu_ps(neighbor_center_projection_coefficient + j);
+                    __m256 _neighbor_res_squared_norm_plus_qres_squared_norm = _mm256_fmadd_ps(_neighbor_res_norm, _neighbor_res_norm, _qres_squared_norm);
+                    __m256 _qproj_dproj_diff = _mm256_sub_ps(_query_center_projection_coefficient, _neighbor_center_projection_coefficient);
+                    __m256 _exact_l2_distance = _mm256_fmadd_ps(_mm256_mul_ps(_qproj_dproj_diff, _qproj_dproj_diff), _center_node_squared_norm, _neighbor_res_squared_norm_plus_qres_squared_norm);
+                    __m256i _hamming = group_hamming_distance_avx2(neighbor_codes + j * sizeof(uint64_t), _code);
+                    __m256 _qres_dres_cos_value = _mm256_i32gather_ps(cos_table, hamming_cos_index_avx2(_hamming), 4);
+                    __m256 _qres_dres_ip = _mm256_mul_ps(_qres_dres_cos_value, _mm256_mul_ps(_qres_norm, _neighbor_res_norm));
+                    __m256 _appx_l2 = _mm256_fmadd_ps(_minus2, _qres_dres_ip, _exact_l2_distance);
+                    _mm256_storeu_ps(appx_result + i * 16 + j, _mm256_and_ps(_mm256_cmp_ps(_appx_l2, _topk_ub_dist, _CMP_LT_OQ), _trueValue));
+                }
+                stored_info += neighbor_group_size;
+            }
+        }
+
+        // Runtime dispatch. Function multiversioning only accepts avx512f among the AVX-512 extensions, so the
+        // avx512f versions pick the AVX-512 kernels when the CPU also has AVX512BW and AVX512DQ, which they use (with
+        // native popcount when it also has AVX512-VPOPCNTDQ), and the AVX2 kernels otherwise (every AVX-512 CPU has AVX2 and FMA). Every AVX2 CPU we target also has FMA, but the
+        // avx2 versions check it since the AVX2 kernels depend on it for identical results.
+        __attribute__((__target__("avx512f")))
+        inline void approximate_angular_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& query_center_projection_coefficient,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vpopcntdq")) {
+                approximate_angular_distance_avx512_vpopcntdq(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
+            } else if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) {
+                approximate_angular_distance_avx512(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
+            } else {
+                approximate_angular_distance_avx2(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
+            }
+        }
+
+        __attribute__((__target__("avx512f")))
+        inline void approximate_ip_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_ip,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vpopcntdq")) {
+                approximate_ip_distance_avx512_vpopcntdq(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_ip, stored_info, ss, bb);
+            } else if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) {
+                approximate_ip_distance_avx512(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_ip, stored_info, ss, bb);
+            } else {
+                approximate_ip_distance_avx2(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_ip, stored_info, ss, bb);
+            }
+        }
+
+        __attribute__((__target__("avx512f")))
+        inline void approximate_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_l2_distance,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vpopcntdq")) {
+                approximate_distance_avx512_vpopcntdq(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
+            } else if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) {
+                approximate_distance_avx512(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
+            } else {
+                approximate_distance_avx2(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
+            }
+        }
+
+        __attribute__((__target__("avx2")))
+        inline void approximate_angular_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& query_center_projection_coefficient,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            if (__builtin_cpu_supports("fma")) {
+                approximate_angular_distance_avx2(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
+            } else {
+                approximate_angular_distance_default(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
+            }
+        }
+
+        __attribute__((__target__("default")))
+        inline void approximate_angular_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& query_center_projection_coefficient,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_angular_distance_default(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, query_center_projection_coefficient, stored_info, ss, bb);
+        }
+
+        __attribute__((__target__("avx2")))
+        inline void approximate_ip_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_ip,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            if (__builtin_cpu_supports("fma")) {
+                approximate_ip_distance_avx2(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_ip, stored_info, ss, bb);
+            } else {
+                approximate_ip_distance_default(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_ip, stored_info, ss, bb);
+            }
+        }
+
+        __attribute__((__target__("default")))
+        inline void approximate_ip_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_ip,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_ip_distance_default(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, center_query_ip, stored_info, ss, bb);
+        }
+
+        __attribute__((__target__("avx2")))
+        inline void approximate_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_l2_distance,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            if (__builtin_cpu_supports("fma")) {
+                approximate_distance_avx2(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
+            } else {
+                approximate_distance_default(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                    query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
+            }
+        }
+
+        __attribute__((__target__("default")))
+        inline void approximate_distance(
+            float* appx_result,
+            const index_type& max_degree,
+            const float& topk_ub_dist,
+            const size_t neighbor_size,
+            const float& query_norm,
+            const float& query_squared_norm,
+            const float* query_lowrank_projection,
+            const float& center_query_l2_distance,
+            const char* stored_info,
+            const float& ss=1,
+            const float& bb=0
+        ) const {
+            approximate_distance_default(appx_result, max_degree, topk_ub_dist, neighbor_size, query_norm, query_squared_norm,
+                query_lowrank_projection, center_query_l2_distance, stored_info, ss, bb);
         }
 
         inline void compute_centroids(pecos::drm_t& X, int dsub, size_t ksub, index_type *assign, float *centroids, int threads=1) {
@@ -7,8 +7,10 @@
         typedef heap_t<pair_t, std::less<pair_t>> max_heap_t;
         typedef heap_t<pair_t, std::greater<pair_t>> min_heap_t;
 
-        struct Searcher : SetOfVistedNodes<unsigned short int> {
-            typedef SetOfVistedNodes<unsigned short int> set_of_visited_nodes_t;
+        // a Searcher with VisitedSet_T as its visited set, see VisitedSetKind
+        template<class VisitedSet_T = SetOfVistedNodes<unsigned short int>>
+        struct BasicSearcher : VisitedSet_T {
+            typedef VisitedSet_T set_of_visited_nodes_t;
             typedef HNSW<dist_t, FeatVec_T> hnsw_t;
             typedef heap_t<pair_t, std::less<pair_t>> max_heap_t;
             typedef heap_t<pair_t, std::greater<pair_t>> min_heap_t;
@@ -16,9 +18,10 @@
             const hnsw_t* hnsw;
             max_heap_t topk_queue;
             min_heap_t cand_queue;
+            LinearPool<dist_t> cand_pool;  // in place of both queues with CandidateQueueKind::linear_pool
 
-            Searcher(const hnsw_t* _hnsw=nullptr):
-                SetOfVistedNodes<unsigned short int>(_hnsw? _hnsw->num_node : 0),
+            BasicSearcher(const hnsw_t* _hnsw=nullptr):
+                VisitedSet_T(_hnsw? _hnsw->num_node : 0),
                 hnsw(_hnsw)
             {}
 
@@ -35,10 +38,34 @@
             max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk) {
                 return hnsw->predict_single(query, efS, topk, *this);
             }
+
+            max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, const SearchFilter& filter) {
+                return hnsw->predict_single(query, efS, topk, *this, filter);
+            }
+
+            max_heap_t& predict_range(const feat_vec_t& query, dist_t radius, index_type max_results, index_type efS=40) {
+                return hnsw->predict_range(query, radius, max_results, *this, efS);
+            }
         };
 
-        Searcher create_searcher() const {
-            return Searcher(this);
+        typedef BasicSearcher<> Searcher;
+
+        template<class VisitedSet_T = SetOfVistedNodes<unsigned short int>>
+        BasicSearcher<VisitedSet_T> create_searcher() const {
+            return BasicSearcher<VisitedSet_T>(this);
+        }
+
+        // selects the visited set of the Searchers of predict_batch, see VisitedSetKind; other Searchers get
+        // theirs from create_searcher
+        void set_visited_set_kind(VisitedSetKind kind) {
+            visited_set_kind = kind;
+            searcher_pools.clear();
+        }
+
+        // selects the candidate queues of the level-0 search of predict_single and predict_batch; training
+        // always uses the heaps
+        void set_candidate_queue_kind(CandidateQueueKind kind) {
+            candidate_queue_kind = kind;
         }
 
         // scalar variables
@@ -52,6 +79,10 @@
         // data structures for multi-level graph
         GraphL0<feat_vec_t> graph_l0;   // neighborhood graph along with feature vectors at level 0
         GraphL1 graph_l1;               // neighborhood graphs from level 1 and above
+        mutable VisitedSetSearcherPools<BasicSearcher> searcher_pools;  // reused by predict_batch
+        std::vector<std::string> skipped_sections;  // left empty by load(), see check_sections_loaded
+        VisitedSetKind visited_set_kind = VisitedSetKind::dense;  // of the Searchers of predict_batch
+        CandidateQueueKind candidate_queue_kind = CandidateQueueKind::heap;  // of predict_single and predict_batch
 
         // destructor
         ~HNSW() {}
@@ -79,7 +110,7 @@
         void save_config(const std::string& filepath) const {
             nlohmann::json j_params = {
                 {"hnsw_t", pecos::type_util::full_name<HNSW>()},
-                {"version", "v1.0"},
+                {"version", "v2.0"},
                 {"train_params", {
                     {"num_node", this->num_node},
                     {"maxM", this->maxM},
@@ -106,37 +137,66 @@
                 }
             }
             save_config(model_dir + "/config.json");
-            std::string index_path = model_dir + "/index.bin";
-            FILE *fp = fopen(index_path.c_str(), "wb");
-            pecos::file_util::fput_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&maxM, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&maxM0, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&efC, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&max_level, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&init_node, 1, fp);
-            graph_l0.save(fp);
-            graph_l1.save(fp);
-            fclose(fp);
+            save_index_file(model_dir + "/index.bin", section_names(), [&](const std::string& name, pecos::mmap_util::BinaryWriter& writer) {
+                save_section(name, writer);
+            });
+        }
+
+        // sections of index.bin, in the order of the single stream of indexes older than v2.0
+        static const std::vector<std::string>& section_names() {
+            static const std::vector<std::string> names = {"header", "graph_l0", "graph_l1"};
+            return names;
+        }
+
+        void save_section(const std::string& name, pecos::mmap_util::BinaryWriter& writer) const {
+            if (name == "header") {
+                writer.fput_one<index_type>(num_node);
+                writer.fput_one<index_type>(maxM);
+                writer.fput_one<index_type>(maxM0);
+                writer.fput_one<index_type>(efC);
+                writer.fput_one<index_type>(max_level);
+                writer.fput_one<index_type>(init_node);
+            } else if (name == "graph_l0") {
+                graph_l0.save(writer);
+            } else if (name == "graph_l1") {
+                graph_l1.save(writer);
+            }
+        }
+
+        void load_section(const std::string& name, pecos::mmap_util::BinaryReader& reader) {
+            if (name == "header") {
+                reader.fget_multiple<index_type>(&num_node, 1);
+                reader.fget_multiple<index_type>(&maxM, 1);
+                reader.fget_multiple<index_type>(&maxM0, 1);
+                reader.fget_multiple<index_type>(&efC, 1);
+                reader.fget_multiple<index_type>(&max_level, 1);
+                reader.fget_multiple<index_type>(&init_node, 1);
+            } else if (name == "graph_l0") {
+                graph_l0.load(reader);
+            } else if (name == "graph_l1") {
+                graph_l1.load(reader);
+            }
         }
 
-        void load(const std::string& model_dir) {
+        // lazy_load memory-maps index.bin instead of reading it, see load_index_file()
+        void load(const std::string& model_dir, bool lazy_load=false, pecos::mmap_util::MmapAdvice advice=pecos::mmap_util::MmapAdvice::normal) {
+            IndexLoadOptions options;
+            options.lazy_load = lazy_load;
+            options.advice = advice;
+            load(model_dir, options);
+        }
+
+        // sections skipped by options are left empty; every search reads both graphs, so the predict functions
+        // throw on an index loaded without either of them
+        void load(const std::string& model_dir, const IndexLoadOptions& options) {
             auto config = load_config(model_dir + "/config.json");
             std::string version = config.find("version") != config.end() ? config["version"] : "not found";
-            std::string index_path = model_dir + "/index.bin";
-            FILE *fp = fopen(index_path.c_str(), "rb");
-            if (version == "v1.0") {
-                pecos::file_util::fget_multiple<index_type>(&num_node, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&maxM, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&maxM0, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&efC, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&max_level, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&init_node, 1, fp);
-                graph_l0.load(fp);
-                graph_l1.load(fp);
-            } else {
-                throw std::runtime_error("Unable to load this binary with version = " + version);
-            }
-            fclose(fp);
+            graph_l0 = GraphL0<feat_vec_t>();
+            graph_l1 = GraphL1();
+            skipped_sections = load_index_file(model_dir + "/index.bin", version, options, section_names(), [&](const std::string& name, pecos::mmap_util::BinaryReader& reader) {
+                load_section(name, reader);
+            });
+            searcher_pools.clear();
         }
 
         // Algorithm 4 of HNSW paper
@@ -204,9 +264,9 @@
             }
 
             auto add_link = [&](index_type src, index_type dst) {
-                std::unique_lock<std::mutex>* lock_src = nullptr;
+                std::unique_lock<std::mutex> lock_src;
                 if (!lock_free) {
-                    lock_src = new std::unique_lock<std::mutex>(mtx_nodes->at(src));
+                    lock_src = std::unique_lock<std::mutex>((*mtx_nodes)[src]);
                 }
 
                 auto neighbors = G->get_neighborhood(src, level);
@@ -244,10 +304,6 @@
                         indx++;
                     }
                 }
-
-                if (!lock_free) {
-                    delete lock_src;
-                }
             };
 
             for (auto& dst : selected_neighbors) {
@@ -271,12 +327,21 @@
                 std::vector<std::mutex> mtx_nodes;
                 std::vector<index_type> node2level;
                 std::vector<Searcher> searchers;
+                // (max_level << 32 | init_node), published under mtx_global so that
+                // readers always observe a consistent pair without taking the lock
+                std::atomic<uint64_t> entry_point;
                 workspace_t(HNSW<dist_t, FeatVec_T>& hnsw, int threads=1):
-                    hnsw(hnsw), mtx_nodes(hnsw.num_node), node2level(hnsw.num_node) {
+                    hnsw(hnsw), mtx_nodes(hnsw.num_node), node2level(hnsw.num_node), entry_point(0) {
                     for (int i = 0; i < threads; i++) {
                         searchers.emplace_back(Searcher(&hnsw));
                     }
                 }
+
+                void publish_entry_point(index_type max_level, index_type init_node) {
+                    hnsw.max_level = max_level;
+                    hnsw.init_node = init_node;
+                    entry_point.store(((uint64_t) max_level << 32) | init_node, std::memory_order_release);
+                }
             };
 
             // a thread-safe functor to add point
@@ -289,22 +354,29 @@
                 // sample the query node's level
                 auto query_level = ws.node2level[query_id];
 
-                // obtain the global lock as we might need to change max_level and init_node
-                std::unique_lock<std::mutex>* lock_global = nullptr;
-                if (query_level > hnsw.max_level) {
-                    lock_global = new std::unique_lock<std::mutex>(ws.mtx_global);
-                }
-
                 // make a copy about the current max_level and enterpoint_id
-                auto max_level = hnsw.max_level;
-                auto curr_node = hnsw.init_node;
+                uint64_t entry_point = ws.entry_point.load(std::memory_order_acquire);
+                index_type max_level = (index_type) (entry_point >> 32);
+                index_type curr_node = (index_type) entry_point;
+
+                // obtain the global lock only if this node might raise max_level and change init_node.
+                // the entry point is re-read under the lock since another thread may have raised it meanwhile.
+                std::unique_lock<std::mutex> lock_global;
+                if (query_level > max_level) {
+                    lock_global = std::unique_lock<std::mutex>(ws.mtx_global);
+                    entry_point = ws.entry_point.load(std::memory_order_acquire);
+                    max_level = (index_type) (entry_point >> 32);
+                    curr_node = (index_type) entry_point;
+                    if (query_level <= max_level) {
+                        lock_global.unlock();
+                    }
+                }
 
                 const feat_vec_t& query_feat = graph_l0.get_node_feat(query_id);
 
                 bool is_first_node = (query_id == 0);
                 if (is_first_node) {
-                    hnsw.init_node = query_id;
-                    hnsw.max_level = query_level;
+                    ws.publish_entry_point(query_level, query_id);
                 } else {
                     // find entrypoint with efS = 1 from level = local max_level to 1.
                     if (query_level < max_level) {
@@ -348,17 +420,14 @@
                     }
 
                     // if(query_level > ws.node2level[hnsw.enterpoint_id])  // used in nmslib.
-                    if (query_level > hnsw.max_level) {  // used in hnswlib.
-                        hnsw.max_level = query_level;
-                        hnsw.init_node = query_id;
+                    if (query_level > max_level) {  // used in hnswlib.
+                        ws.publish_entry_point(query_level, query_id);
                     }
                 }
-
-                if (lock_global != nullptr) {
-                    delete lock_global;
-                }
             };  // end of add_point
 
+            searcher_pools.clear();
+            skipped_sections.clear();
             this->num_node = X_trn.rows;
             this->maxM = M;
             this->maxM0 = 2 * M;
@@ -387,17 +456,21 @@
             std::cout<< "step 23" <<std::endl;
             graph_l0.init(X_trn, this->maxM0);
             std::cout<< "step 24" <<std::endl;
-            graph_l1.init(X_trn, this->maxM, max_level_upper_bound);
+            graph_l1.init(X_trn, this->maxM, max_level_upper_bound, node2level);
             std::cout<< "step 25" <<std::endl;
 
-            this->max_level = 0;
-            this->init_node = 0;
+            ws.publish_entry_point(0, 0);
 
             bool lock_free = (threads == 1);
 
             std::cout<< "step 26" <<std::endl;
-// #pragma omp parallel for schedule(dynamic, 1)
-            for (index_type node_id = 0; node_id < num_node; node_id++) {
+            // the first node becomes the initial entry point, so it has to be in the graph
+            // before any other node starts its search from it.
+            if (num_node > 0) {
+                add_point(0, ws, 0, lock_free);
+            }
+#pragma omp parallel for schedule(dynamic, 1)
+            for (index_type node_id = 1; node_id < num_node; node_id++) {
                 int thread_id = omp_get_thread_num();
                 add_point(node_id, ws, thread_id, lock_free);
             }
@@ -434,7 +507,7 @@
             };
 
             std::cout<< "step 28" <<std::endl;
-// #pragma omp parallel for schedule(dynamic, 1)
+#pragma omp parallel for schedule(dynamic, 1)
             for (index_type node_id = 0; node_id < num_node; node_id++) {
                 int thread_id = omp_get_thread_num();
                 sort_neighbors_for_node(node_id, ws, thread_id);
@@ -444,13 +517,13 @@
         }
 
         // Algorithm 2 of HNSW paper
-        template<bool lock_free=true>
+        template<bool lock_free=true, class Searcher_T>
         max_heap_t& search_level(
             const feat_vec_t& query,
             index_type init_node,
             index_type efS,
             index_type level,
-            Searcher& searcher,
+            Searcher_T& searcher,
             std::vector<std::mutex>* mtx_nodes=nullptr
         ) const {
             searcher.reset();
@@ -480,9 +553,9 @@
                 cand_queue.pop();
 
                 index_type cand_node = cand_pair.node_id;
-                std::unique_lock<std::mutex>* lock_node = nullptr;
+                std::unique_lock<std::mutex> lock_node;
                 if (!lock_free) {
-                    lock_node = new std::unique_lock<std::mutex>(mtx_nodes->at(cand_node));
+                    lock_node = std::unique_lock<std::mutex>((*mtx_nodes)[cand_node]);
                 }
                 // visiting neighbors of candidate node
                 const auto neighbors = G->get_neighborhood(cand_node, level);
@@ -513,16 +586,49 @@
                         }
                     }
                 }
+            }
+            return topk_queue;
+        }
 
-                if (!lock_free) {
-                    delete lock_node;
+        // search_level at level 0 with searcher.cand_pool in place of the two heaps, see CandidateQueueKind.
+        // The result is returned in searcher.topk_queue as a max-heap, like that of search_level.
+        template<class Searcher_T>
+        max_heap_t& search_level_linear_pool(const feat_vec_t& query, index_type init_node, index_type efS, Searcher_T& searcher) const {
+            searcher.reset();
+            auto& pool = searcher.cand_pool;
+            pool.reset(efS);
+            pool.insert(feat_vec_t::distance(query, graph_l0.get_node_feat(init_node)), init_node);
+            searcher.mark_visited(init_node);
+
+            while (pool.has_next()) {
+                index_type cand_node = pool.next().node_id;
+                const auto neighbors = graph_l0.get_neighborhood(cand_node, 0);
+                if (neighbors.degree() != 0) {
+                    graph_l0.prefetch_node_feat(neighbors[0]);
+                    index_type max_j = neighbors.degree() - 1;
+                    for (index_type j = 0; j <= max_j; j++) {
+                        graph_l0.prefetch_node_feat(neighbors[std::min(j + 1, max_j)]);
+                        auto next_node = neighbors[j];
+                        if (!searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            dist_t next_lb_dist = feat_vec_t::distance(
+                                query,
+                                graph_l0.get_node_feat(next_node)
+                            );
+                            pool.insert(next_lb_dist, next_node);
+                        }
+                    }
+                    if (pool.has_next()) {
+                        graph_l0.prefetch_node_feat(pool.peek_next().node_id);
+                    }
                 }
             }
-            return topk_queue;
+            pool.copy_to(searcher.topk_queue);
+            return searcher.topk_queue;
         }
 
-        // Algorithm 5 of HNSW paper, thread-safe inference
-        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher& searcher) const {
+        // greedy search of the levels l=1,...,L, returns the entry node of the level-0 search
+        index_type search_upper_levels(const feat_vec_t& query) const {
             index_type curr_node = this->init_node;
             auto &G1 = graph_l1;
             auto &G0 = graph_l0;
@@ -555,8 +661,20 @@
                     }
                 }
             }
+            return curr_node;
+        }
+
+        // Algorithm 5 of HNSW paper, thread-safe inference
+        template<class Searcher_T>
+        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher_T& searcher) const {
+            check_sections_loaded(skipped_sections, {"graph_l0", "graph_l1"});
+            index_type curr_node = search_upper_levels(query);
             // generalized search_level for level=0 for efS >= 1
-            searcher.search_level(query, curr_node, std::max(efS, topk), 0);
+            if (candidate_queue_kind == CandidateQueueKind::linear_pool) {
+                search_level_linear_pool(query, curr_node, std::max(efS, topk), searcher);
+            } else {
+                searcher.search_level(query, curr_node, std::max(efS, topk), 0);
+            }
             auto& topk_queue = searcher.topk_queue;
             if (topk < efS) {
                 // remove extra when efS > topk
@@ -567,4 +685,180 @@
             std::sort_heap(topk_queue.begin(), topk_queue.end());
             return topk_queue;
         }
+
+        // search_level at level 0 for a filtered search. Only nodes allowed by filter enter searcher.topk_queue,
+        // but every node closer than its worst one is a candidate to expand, and the search does not stop
+        // before it holds efS nodes, so the filtered-out nodes still lead to the allowed ones.
+        template<class Searcher_T>
+        max_heap_t& search_level_filtered(const feat_vec_t& query, index_type init_node, index_type efS, const SearchFilter& filter, Searcher_T& searcher) const {
+            searcher.reset();
+            max_heap_t& topk_queue = searcher.topk_queue;
+            min_heap_t& cand_queue = searcher.cand_queue;
+            auto add_node = [&](dist_t dist, index_type node_id) {
+                if (topk_queue.size() < efS || dist < topk_queue.top().dist) {
+                    cand_queue.emplace(dist, node_id);
+                    if (filter.allows(node_id)) {
+                        topk_queue.emplace(dist, node_id);
+                        if (topk_queue.size() > efS) {
+                            topk_queue.pop();
+                        }
+                    }
+                }
+            };
+            add_node(feat_vec_t::distance(query, graph_l0.get_node_feat(init_node)), init_node);
+            searcher.mark_visited(init_node);
+
+            while (!cand_queue.empty()) {
+                pair_t cand_pair = cand_queue.top();
+                if (topk_queue.size() >= efS && cand_pair.dist > topk_queue.top().dist) {
+                    break;
+                }
+                cand_queue.pop();
+
+                const auto neighbors = graph_l0.get_neighborhood(cand_pair.node_id, 0);
+                if (neighbors.degree() != 0) {
+                    graph_l0.prefetch_node_feat(neighbors[0]);
+                    index_type max_j = neighbors.degree() - 1;
+                    for (index_type j = 0; j <= max_j; j++) {
+                        graph_l0.prefetch_node_feat(neighbors[std::min(j + 1, max_j)]);
+                        auto next_node = neighbors[j];
+                        if (!searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            add_node(feat_vec_t::distance(query, graph_l0.get_node_feat(next_node)), next_node);
+                        }
+                    }
+                }
+            }
+            return topk_queue;
+        }
+
+        // the topk nodes allowed by filter by their distances to query, into searcher.topk_queue as a max-heap
+        template<class Searcher_T>
+        max_heap_t& search_allowed_nodes(const feat_vec_t& query, index_type topk, const SearchFilter& filter, Searcher_T& searcher) const {
+            max_heap_t& topk_queue = searcher.topk_queue;
+            topk_queue.clear();
+            filter.for_each_allowed(num_node, [&](index_type node_id) {
+                dist_t dist = feat_vec_t::distance(query, graph_l0.get_node_feat(node_id));
+                if (topk_queue.size() < topk || dist < topk_queue.top().dist) {
+                    topk_queue.emplace(dist, node_id);
+                    if (topk_queue.size() > topk) {
+                        topk_queue.pop();
+                    }
+                }
+            });
+            return topk_queue;
+        }
+
+        // predict_single among the nodes allowed by filter. If they are fewer than the efS * maxM0 distances
+        // a graph search may compute, their distances are computed directly instead.
+        template<class Searcher_T>
+        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher_T& searcher, const SearchFilter& filter) const {
+            check_sections_loaded(skipped_sections, {"graph_l0", "graph_l1"});
+            efS = std::max(efS, topk);
+            auto& topk_queue = searcher.topk_queue;
+            if (filter.num_allowed <= (mem_index_type) efS * maxM0) {
+                search_allowed_nodes(query, topk, filter, searcher);
+            } else {
+                search_level_filtered(query, search_upper_levels(query), efS, filter, searcher);
+                while (topk_queue.size() > topk) {
+                    topk_queue.pop();
+                }
+            }
+            std::sort_heap(topk_queue.begin(), topk_queue.end());
+            return topk_queue;
+        }
+
+        // search_level at level 0 for predict_range. A beam of the efS closest nodes, kept in searcher.cand_pool,
+        // leads the search towards query; every node closer than the beam or within the radius is a candidate,
+        // and the search expands them until none is left that is within either. The nodes within radius go to
+        // searcher.topk_queue, a max-heap of at most max_results nodes; once it is full, its farthest node
+        // bounds the radius.
+        template<class Searcher_T>
+        max_heap_t& search_level_range(const feat_vec_t& query, index_type init_node, dist_t radius, index_type max_results, index_type efS, Searcher_T& searcher) const {
+            searcher.reset();
+            max_heap_t& topk_queue = searcher.topk_queue;
+            min_heap_t& cand_queue = searcher.cand_queue;
+            auto& beam = searcher.cand_pool;
+            beam.reset(efS);
+            auto range_bound = [&]() {
+                return topk_queue.size() < max_results ? radius : std::min(radius, topk_queue.top().dist);
+            };
+            auto add_node = [&](dist_t dist, index_type node_id) {
+                bool in_range = dist < range_bound();
+                if (in_range) {
+                    topk_queue.emplace(dist, node_id);
+                    if (topk_queue.size() > max_results) {
+                        topk_queue.pop();
+                    }
+                }
+                if (beam.insert(dist, node_id) != beam.capacity || in_range) {
+                    cand_queue.emplace(dist, node_id);
+                }
+            };
+            add_node(feat_vec_t::distance(query, graph_l0.get_node_feat(init_node)), init_node);
+            searcher.mark_visited(init_node);
+
+            while (!cand_queue.empty()) {
+                pair_t cand_pair = cand_queue.top();
+                if (beam.full() && cand_pair.dist > beam.bound() && cand_pair.dist >= range_bound()) {
+                    break;
+                }
+                cand_queue.pop();
+
+                const auto neighbors = graph_l0.get_neighborhood(cand_pair.node_id, 0);
+                if (neighbors.degree() != 0) {
+                    graph_l0.prefetch_node_feat(neighbors[0]);
+                    index_type max_j = neighbors.degree() - 1;
+                    for (index_type j = 0; j <= max_j; j++) {
+                        graph_l0.prefetch_node_feat(neighbors[std::min(j + 1, max_j)]);
+                        auto next_node = neighbors[j];
+                        if (!searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            add_node(feat_vec_t::distance(query, graph_l0.get_node_feat(next_node)), next_node);
+                        }
+                    }
+                }
+            }
+            return topk_queue;
+        }
+
+        // All nodes within distance radius of query, up to the max_results closest of them, sorted by increasing
+        // distance. efS is the size of the beam that finds the first ones, see search_level_range.
+        template<class Searcher_T>
+        max_heap_t& predict_range(const feat_vec_t& query, dist_t radius, index_type max_results, Searcher_T& searcher, index_type efS=40) const {
+            check_sections_loaded(skipped_sections, {"graph_l0", "graph_l1"});
+            auto& topk_queue = searcher.topk_queue;
+            if (max_results == 0) {
+                topk_queue.clear();
+                return topk_queue;
+            }
+            search_level_range(query, search_upper_levels(query), radius, max_results, efS, searcher);
+            std::sort_heap(topk_queue.begin(), topk_queue.end());
+            return topk_queue;
+        }
+
+        // Batch inference over the rows of queries with at most threads threads (<= 0 for all cores).
+        // Each thread takes a Searcher from searcher_pools, so no per-query allocation happens once
+        // the pool is warm. ret_ids and ret_dists hold queries.rows x topk entries in row-major order;
+        // see write_topk_result for how missing entries are filled.
+        template<class MAT_T>
+        void predict_batch(const MAT_T& queries, index_type efS, index_type topk, int threads, index_type* ret_ids, dist_t* ret_dists) const {
+            // before the parallel region, as an exception must not escape it
+            check_sections_loaded(skipped_sections, {"graph_l0", "graph_l1"});
+            threads = (threads <= 0) ? omp_get_num_procs() : threads;
+            dispatch_visited_set_kind(visited_set_kind, [&](auto visited_set) {
+                typedef typename decltype(visited_set)::type visited_set_t;
+                auto& searcher_pool = searcher_pools.template get<visited_set_t>();
+#pragma omp parallel num_threads(threads)
+                {
+                    auto searcher = searcher_pool.acquire([this]() { return this->template create_searcher<visited_set_t>(); });
+#pragma omp for schedule(dynamic, 16)
+                    for (index_type i = 0; i < queries.rows; i++) {
+                        const auto& ret_pairs = predict_single(queries.get_row(i), efS, topk, *searcher);
+                        write_topk_result(ret_pairs, topk, num_node, &ret_ids[i * (mem_index_type) topk], &ret_dists[i * (mem_index_type) topk]);
+                    }
+                    searcher_pool.release(std::move(searcher));
+                }
+            });
+        }
     };
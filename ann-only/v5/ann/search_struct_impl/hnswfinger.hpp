@@ -1,6 +1,9 @@
     float sss;
     float bbb; 
-    template<typename dist_t, class FeatVec_T>
+    // Rank is the number of bits of the Finger residual sign codes (32, 64, 128 or 256). An index records its
+    // rank in config.json; finger_rank() reads it back and dispatch_finger_rank() instantiates the matching
+    // HNSWFinger, so one binary serves indexes of every rank.
+    template<typename dist_t, class FeatVec_T, int Rank = 128>
     struct HNSWFinger {
         typedef FeatVec_T feat_vec_t;
         typedef Pair<dist_t, index_type> pair_t;
@@ -16,11 +19,11 @@
         index_type max_level;
         index_type init_node;
         index_type subspace_dimension;  // dimension of each subspace in Product Quantization
-        index_type sub_sample_points;   // number of sub-sampled points used to build quantizer subspace centors. 
+        index_type sub_sample_points;   // number of nodes whose edge residuals learn the Finger basis, 0 for all
 
         GraphL0<feat_vec_t> feature_vec;           // feature vectors only
         GraphL1 graph_l1;                       // neighborhood graphs from level 1 and above
-        GraphFinger<dist_t, feat_vec_t> graph_l0_finger;   // Productquantized4Bits neighborhood graph built from graph_l0
+        GraphFinger<dist_t, feat_vec_t, Rank> graph_l0_finger;   // Productquantized4Bits neighborhood graph built from graph_l0
         HNSWFinger() {
             std::string space_type = pecos::type_util::full_name<feat_vec_t>();
             //if (space_type != "pecos::ann::FeatVecDenseL2Simd<float>") {
@@ -28,26 +31,31 @@
             //} 
         }
         ~HNSWFinger() {}
-        struct Searcher : SetOfVistedNodes<unsigned short int> {
-            typedef SetOfVistedNodes<unsigned short int> set_of_visited_nodes_t;
-            typedef HNSWFinger<dist_t, FeatVec_T> hnswfinger_t;
+        // a Searcher with VisitedSet_T as its visited set, see VisitedSetKind
+        template<class VisitedSet_T = SetOfVistedNodes<unsigned short int>>
+        struct BasicSearcher : VisitedSet_T {
+            typedef VisitedSet_T set_of_visited_nodes_t;
+            typedef HNSWFinger<dist_t, FeatVec_T, Rank> hnswfinger_t;
             typedef heap_t<pair_t, std::less<pair_t>> max_heap_t;
             typedef heap_t<pair_t, std::greater<pair_t>> min_heap_t;
 
             const hnswfinger_t* hnsw;
             max_heap_t topk_queue;
             min_heap_t cand_queue;
-            alignas(64) std::vector<float> query_projection;
+            LinearPool<dist_t> cand_pool;  // in place of both queues with CandidateQueueKind::linear_pool
+            std::vector<float> query_projection;
             uint64_t query_rplsh_code;
 
-            __m512i _lookup_table;// = _mm512_set1_epi64(talk2);
-            alignas(64) std::vector<float> appx_dist;
+            std::vector<float> appx_dist;
             float query_norm;
             float query_squared_norm;
             //void (*approximate_distance)(size_t, const float&, const float&, const char*);
-            bool which;
-            Searcher(const hnswfinger_t* _hnsw=nullptr):
-                SetOfVistedNodes<unsigned short int>(_hnsw? _hnsw->num_node : 0),
+            bool which;  // true for L2, false for inner product, see approximate_distance
+            const float* given_projection = nullptr;  // projection of the next query, see use_query_projection
+            SearchStats stats;  // only counted with -DPECOS_ANN_SEARCH_STATS
+            SearchTiming timing;  // only kept with -DPECOS_ANN_SEARCH_TIMING
+            BasicSearcher(const hnswfinger_t* _hnsw=nullptr):
+                VisitedSet_T(_hnsw? _hnsw->num_node : 0),
                 hnsw(_hnsw)
             {}
 
@@ -59,31 +67,6 @@
             void setup_appx_results_containers() {
                 query_projection.resize(hnsw->graph_l0_finger.finger.low_rank, 0);
                 appx_dist.resize(hnsw->graph_l0_finger.max_degree % 16 == 0 ?  hnsw->graph_l0_finger.max_degree : (hnsw->graph_l0_finger.max_degree / 16 + 1) * 16, 0);
-                //std::vector<float> cos_table{ 0.4788641, 0.44455987, 0.4081703, 0.3788809, 0.3529579, 0.3307132, 0.31037903, 0.29017207, 0.27027875, 0.25325617, 0.23492996, 0.21701016, 0.19880502, 0.1806895, 0.16216676, 0.14297655, 0.12419499, 0.104549415, 0.085694425, 0.066262625, 0.046003137, 0.02588392, 0.002810445, -0.01945299, -0.042384192, -0.066297606, -0.08810465, -0.11720696, -0.15735959, -0.19942293, -0.22520278};
-                std::vector<float> cos_table(128);
-                //ultimate_select = 64;// hnsw->graph_l0_finger.finger.select;
-                for (int i = 127; i >= 0; i--) {
-                    cos_table[i] = std::cos(i * ANGLE);
-                    //if (cos_table[i - 16] >= 0 and cos_table[i - 16] < .245) {
-                    //    cos_table[i - 16] *= .8;
-                    //}
-                    //else if (cos_table[i - 16] >= .245) {
-                    //    cos_table[i - 16] *= 0.8;
-                    //}
-                    //else if (cos_table[i-16] < 0){
-                    //    cos_table[i - 16] = 0;
-                    //}
-                }
-
-                //std::vector<float> cos_table{ 0.6785726547241211, 0.6413908123970031, 0.6003756046295166, 0.5646432042121887, 0.5263587355613708, 0.49244638383388517, 0.4627079963684082, 0.4320942759513855, 0.40754836797714233, 0.38866173624992373, 0.3722610503435135, 0.35806763768196104, 0.34381386637687683, 0.32835571467876434, 0.313887482881546, 0.2978456974029541, 0.28028953075408936, 0.26205491423606875, 0.24302436411380768, 0.22394128143787384, 0.20554079115390778, 0.18561340272426602, 0.16209167838096616, 0.14397162199020386, 0.12474564164876933, 0.10150918066501613, 0.08697998523712158, 0.05724991485476494, 0.029584133997559547, 0.006172131001949355, -0.034059077501297};
-                _cos_table0 = _mm512_loadu_ps(&cos_table[0]);
-                _cos_table1 = _mm512_loadu_ps(&cos_table[16]);
-                _cos_table2 = _mm512_loadu_ps(&cos_table[32]);
-                _cos_table3 = _mm512_loadu_ps(&cos_table[48]);
-                _cos_table4 = _mm512_loadu_ps(&cos_table[64]);
-                _cos_table5 = _mm512_loadu_ps(&cos_table[80]);
-                _cos_table6 = _mm512_loadu_ps(&cos_table[96]);
-                _cos_table7 = _mm512_loadu_ps(&cos_table[112]);
 /*                hnsw->graph_l0_finger.finger.neighboring_float_size = 16 * sizeof(float);
                 hnsw->graph_l0_finger.finger.neighboring_index_size = 16 * sizeof(index_type);
                 hnsw->graph_l0_finger.finger.center_size = 2 * sizeof(float);
@@ -98,9 +81,24 @@
                     which = false;
                     //approximate_distance = &approximate_ip_distance;
                 }
+                else {
+                    throw std::runtime_error("HNSWFinger supports FeatVecDenseL2Simd<float> and FeatVecDenseIPSimd<float>, not " + space_type);
+                }
+            }
+            // use projection (Rank floats) for the next query instead of computing it, e.g. when the projections
+            // of a batch of queries come from one GEMM
+            void use_query_projection(const float* projection) {
+                given_projection = projection;
             }
+
             void compute_query_projection(float* query) {
                 //uint32_t tmp;
+                if (given_projection != nullptr) {
+                    std::copy_n(given_projection, Rank, query_projection.data());
+                    hnsw->graph_l0_finger.finger.compute_query_norms(query, query_norm, query_squared_norm);
+                    given_projection = nullptr;
+                    return;
+                }
                 hnsw->graph_l0_finger.finger.compute_projection_information(query, query_projection.data(), query_norm, query_squared_norm);
                 //hnsw->graph_l0_finger.finger.compute_query_rplsh_code(query_rplsh_code, query_projection.data());
                 //_lookup_table = _mm512_set1_epi64(query_rplsh_code);
@@ -120,7 +118,7 @@
                         stored_info
                     );
                 } else {
-                    approximate_angular_distance(
+                    approximate_ip_distance(
                         neighbor_size, 
                         topk_ub_dist,
                         center_query_distance,
@@ -129,14 +127,16 @@
                 } 
 
             }
-            void approximate_angular_distance(
+            // center_query_ip_distance is the FeatVecDenseIPSimd distance 1 - <query, center>; unlike the angular
+            // kernel, the inner product kernel does not assume unit-norm queries and nodes
+            void approximate_ip_distance(
                 size_t neighbor_size, 
                 const float& topk_ub_dist,
                 const float& center_query_ip_distance,
                 const char* stored_info
             ) {
                 // pass searcher to group_distance
-                hnsw->graph_l0_finger.finger.approximate_angular_distance(
+                hnsw->graph_l0_finger.finger.approximate_ip_distance(
                     appx_dist.data(), 
                     hnsw->graph_l0_finger.max_degree,
                     topk_ub_dist,
@@ -180,12 +180,80 @@
             max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, index_type num_rerank) {
                 return hnsw->predict_single(query, efS, topk, *this, num_rerank);
             }
+
+            max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, index_type num_rerank, const SearchFilter& filter) {
+                return hnsw->predict_single(query, efS, topk, *this, num_rerank, filter);
+            }
+
+            max_heap_t& predict_range(const feat_vec_t& query, dist_t radius, index_type max_results, index_type efS=40) {
+                return hnsw->predict_range(query, radius, max_results, *this, efS);
+            }
         };
 
-        Searcher create_searcher() const {
-            return Searcher(this);
+        typedef BasicSearcher<> Searcher;
+
+        template<class VisitedSet_T = SetOfVistedNodes<unsigned short int>>
+        BasicSearcher<VisitedSet_T> create_searcher() const {
+            return BasicSearcher<VisitedSet_T>(this);
+        }
+
+        // selects the visited set of the Searchers of predict_batch, see VisitedSetKind; other Searchers get
+        // theirs from create_searcher
+        void set_visited_set_kind(VisitedSetKind kind) {
+            visited_set_kind = kind;
+            searcher_pools.clear();
+        }
+
+        // selects the candidate queues of the level-0 search of predict_single and predict_batch; training
+        // always uses the heaps
+        void set_candidate_queue_kind(CandidateQueueKind kind) {
+            candidate_queue_kind = kind;
+        }
+
+        mutable VisitedSetSearcherPools<BasicSearcher> searcher_pools;  // reused by predict_batch
+        std::vector<std::string> skipped_sections;  // left empty by load(), see check_sections_loaded
+        VisitedSetKind visited_set_kind = VisitedSetKind::dense;  // of the Searchers of predict_batch
+        CandidateQueueKind candidate_queue_kind = CandidateQueueKind::heap;  // of predict_single and predict_batch
+
+        // SearchStats summed over the Searchers of predict_batch since the last reset_search_stats()
+        SearchStats search_stats() const {
+            SearchStats total;
+            searcher_pools.for_each([&](const auto& searcher) { total.merge(searcher.stats); });
+            return total;
+        }
+
+        void reset_search_stats() const {
+            searcher_pools.for_each([](auto& searcher) { searcher.stats.clear(); });
+        }
+
+        // SearchTiming summed over the Searchers of predict_batch since the last reset_search_timing();
+        // queries of predict_group are not timed
+        SearchTiming search_timing() const {
+            SearchTiming total;
+            searcher_pools.for_each([&](const auto& searcher) { total.merge(searcher.timing); });
+            return total;
         }
 
+        void reset_search_timing() const {
+            searcher_pools.for_each([](auto& searcher) { searcher.timing.clear(); });
+        }
+
+
+        // the same for every rank, which is stored separately, so that indexes saved before ranks were
+        // configurable still load
+        static std::string type_name() {
+            return pecos::type_util::details::name<HNSWFinger>() + "<" + pecos::type_util::full_name<dist_t>() + ", " + pecos::type_util::full_name<feat_vec_t>() + ">";
+        }
+
+        // rank of the index saved in model_dir; indexes without one in their config are of rank 128
+        static int finger_rank(const std::string& model_dir) {
+            std::ifstream loadfile(model_dir + "/config.json");
+            if (!loadfile.is_open()) {
+                throw std::runtime_error("Unable to open config file at " + model_dir + "/config.json");
+            }
+            auto j_param = nlohmann::json::parse(std::string(std::istreambuf_iterator<char>(loadfile), std::istreambuf_iterator<char>()));
+            return j_param.find("finger_rank") != j_param.end() ? j_param["finger_rank"].get<int>() : 128;
+        }
 
         static nlohmann::json load_config(const std::string& filepath) {
             std::ifstream loadfile(filepath);
@@ -198,18 +266,23 @@
                 throw std::runtime_error("Unable to open config file at " + filepath);
             }
             auto j_param = nlohmann::json::parse(json_str);
-            std::string hnsw_t_cur = pecos::type_util::full_name<HNSWFinger>();
+            std::string hnsw_t_cur = type_name();
             std::string hnsw_t_inp = j_param["hnsw_t"];
             if (hnsw_t_cur != hnsw_t_inp) {
                 throw std::invalid_argument("Inconsistent HNSW_T: hnsw_t_cur = " + hnsw_t_cur  + " hnsw_t_cur = " + hnsw_t_inp);
             }
+            int rank_inp = j_param.find("finger_rank") != j_param.end() ? j_param["finger_rank"].get<int>() : 128;
+            if (rank_inp != Rank) {
+                throw std::invalid_argument("Inconsistent finger_rank: rank_cur = " + std::to_string(Rank) + " rank_inp = " + std::to_string(rank_inp));
+            }
             return j_param;
         }
 
         void save_config(const std::string& filepath) const {
             nlohmann::json j_params = {
-                {"hnsw_t", pecos::type_util::full_name<HNSWFinger>()},
-                {"version", "v1.0"},
+                {"hnsw_t", type_name()},
+                {"version", "v2.0"},
+                {"finger_rank", Rank},
                 {"train_params", {
                     {"num_node", this->num_node},
                     {"subspace_dimension", this->subspace_dimension},
@@ -238,43 +311,78 @@
                 }
             }
             save_config(model_dir + "/config.json");
-            std::string index_path = model_dir + "/index.bin";
-            FILE *fp = fopen(index_path.c_str(), "wb");
-            pecos::file_util::fput_multiple<index_type>(&num_node, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&maxM, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&maxM0, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&efC, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&max_level, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&init_node, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&subspace_dimension, 1, fp);
-            pecos::file_util::fput_multiple<index_type>(&sub_sample_points, 1, fp);
-            feature_vec.save(fp);
-            graph_l1.save(fp);
-            graph_l0_finger.save(fp);
-            fclose(fp);
-        }
-
-        void load(const std::string& model_dir) {
+            save_index_file(model_dir + "/index.bin", section_names(), [&](const std::string& name, pecos::mmap_util::BinaryWriter& writer) {
+                save_section(name, writer);
+            });
+        }
+
+        // sections of index.bin, in the order of the single stream of indexes older than v2.0. Routing on the
+        // upper levels only needs graph_l1 (and feature_vec for its distances); graph_l0_finger holds the level-0
+        // neighborhoods with the Finger projections and codes, and the Finger basis.
+        static const std::vector<std::string>& section_names() {
+            static const std::vector<std::string> names = {"header", "feature_vec", "graph_l1", "graph_l0_finger"};
+            return names;
+        }
+
+        void save_section(const std::string& name, pecos::mmap_util::BinaryWriter& writer) const {
+            if (name == "header") {
+                writer.fput_one<index_type>(num_node);
+                writer.fput_one<index_type>(maxM);
+                writer.fput_one<index_type>(maxM0);
+                writer.fput_one<index_type>(efC);
+                writer.fput_one<index_type>(max_level);
+                writer.fput_one<index_type>(init_node);
+                writer.fput_one<index_type>(subspace_dimension);
+                writer.fput_one<index_type>(sub_sample_points);
+            } else if (name == "feature_vec") {
+                feature_vec.save(writer);
+            } else if (name == "graph_l1") {
+                graph_l1.save(writer);
+            } else if (name == "graph_l0_finger") {
+                graph_l0_finger.save(writer);
+            }
+        }
+
+        void load_section(const std::string& name, pecos::mmap_util::BinaryReader& reader) {
+            if (name == "header") {
+                reader.fget_multiple<index_type>(&num_node, 1);
+                reader.fget_multiple<index_type>(&maxM, 1);
+                reader.fget_multiple<index_type>(&maxM0, 1);
+                reader.fget_multiple<index_type>(&efC, 1);
+                reader.fget_multiple<index_type>(&max_level, 1);
+                reader.fget_multiple<index_type>(&init_node, 1);
+                reader.fget_multiple<index_type>(&subspace_dimension, 1);
+                reader.fget_multiple<index_type>(&sub_sample_points, 1);
+            } else if (name == "feature_vec") {
+                feature_vec.load(reader);
+            } else if (name == "graph_l1") {
+                graph_l1.load(reader);
+            } else if (name == "graph_l0_finger") {
+                graph_l0_finger.load(reader);
+            }
+        }
+
+        // lazy_load memory-maps index.bin instead of reading it, see load_index_file()
+        void load(const std::string& model_dir, bool lazy_load=false, pecos::mmap_util::MmapAdvice advice=pecos::mmap_util::MmapAdvice::normal) {
+            IndexLoadOptions options;
+            options.lazy_load = lazy_load;
+            options.advice = advice;
+            load(model_dir, options);
+        }
+
+        // Sections skipped by options are left empty. The predict functions need all of them, since the Finger
+        // approximations are relative to the exact distances to feature_vec, and throw otherwise; route() only
+        // needs feature_vec and graph_l1, so a routing tier can skip graph_l0_finger, the largest section.
+        void load(const std::string& model_dir, const IndexLoadOptions& options) {
             auto config = load_config(model_dir + "/config.json");
             std::string version = config.find("version") != config.end() ? config["version"] : "not found";
-            std::string index_path = model_dir + "/index.bin";
-            FILE *fp = fopen(index_path.c_str(), "rb");
-            if (version == "v1.0") {
-                pecos::file_util::fget_multiple<index_type>(&num_node, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&maxM, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&maxM0, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&efC, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&max_level, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&init_node, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&subspace_dimension, 1, fp);
-                pecos::file_util::fget_multiple<index_type>(&sub_sample_points, 1, fp);
-                feature_vec.load(fp);
-                graph_l1.load(fp);
-                graph_l0_finger.load(fp);
-            } else {
-                throw std::runtime_error("Unable to load this binary with version = " + version);
-            }
-            fclose(fp);
+            feature_vec = GraphL0<feat_vec_t>();
+            graph_l1 = GraphL1();
+            graph_l0_finger = GraphFinger<dist_t, feat_vec_t, Rank>();
+            skipped_sections = load_index_file(model_dir + "/index.bin", version, options, section_names(), [&](const std::string& name, pecos::mmap_util::BinaryReader& reader) {
+                load_section(name, reader);
+            });
+            searcher_pools.clear();
         }
 
         template<class MAT_T>
@@ -283,13 +391,18 @@
             index_type M,
             index_type efC,
             index_type subspace_dimension=0,
-            index_type sub_sample_points=0,
+            index_type basis_samples=0,
             int threads=1,
-            int max_level_upper_bound=-1
+            int max_level_upper_bound=-1,
+            bool gram_basis=false
         ) {
             std::cout<< "step 8" <<std::endl;
+            pecos::mem_util::reset_peak_rss();
             HNSW<dist_t, feat_vec_t>* hnsw = new HNSW<dist_t, feat_vec_t>();
             hnsw->train(X_trn, M, efC, threads, max_level_upper_bound);
+            pecos::mem_util::report_stage("hnsw graph construction");
+            searcher_pools.clear();
+            skipped_sections.clear();
             this->num_node = hnsw->num_node;
             this->maxM = hnsw->maxM;
             this->maxM0 = hnsw->maxM0;
@@ -297,28 +410,28 @@
             this->max_level = hnsw->max_level;
             this->init_node = hnsw->init_node;
             this->subspace_dimension = subspace_dimension;
-            this->sub_sample_points = sub_sample_points;
-
-            graph_l1.num_node = hnsw->graph_l1.num_node;
-            graph_l1.max_level = hnsw->graph_l1.max_level;
-            graph_l1.max_degree = hnsw->graph_l1.max_degree;
-            graph_l1.node_mem_size = hnsw->graph_l1.node_mem_size;
-            graph_l1.level_mem_size = hnsw->graph_l1.level_mem_size;
-            graph_l1.buffer.resize(hnsw->graph_l1.buffer.size());
+            this->sub_sample_points = basis_samples;
+
             std::cout<< "step 30" <<std::endl;
-            memcpy(graph_l1.buffer.data(), hnsw->graph_l1.buffer.data(), hnsw->graph_l1.buffer.size() * sizeof(index_type));
+            // hand the upper-level graph over instead of copying it
+            graph_l1 = std::move(hnsw->graph_l1);
             std::cout<< "step 31" <<std::endl;
             //graph_l0_finger.build_quantizer(X_trn, subspace_dimension, sub_sample_points);
-            graph_l0_finger.build_graph(hnsw->graph_l0);
+            graph_l0_finger.build_graph(hnsw->graph_l0, threads, true, basis_samples, gram_basis);
+            pecos::mem_util::report_stage("finger graph construction");
             std::cout<< "step 32" <<std::endl;
+            // release the level-0 graph (features + neighbors) before the features are copied again
             delete hnsw;
             std::cout<< "step 33" <<std::endl;
             feature_vec.init(X_trn, -1);
+            pecos::mem_util::report_stage("feature vectors");
             std::cout<< "step 24" <<std::endl;
         }
 
 
-        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher& searcher, index_type num_rerank) const {
+        // greedy search of the levels l=1,...,L, returns the entry node of the level-0 search
+        template<class Searcher_T>
+        index_type search_upper_levels(const feat_vec_t& query, Searcher_T& searcher) const {
             index_type curr_node = this->init_node;
             auto &G1 = graph_l1;
             auto &G0 = feature_vec;
@@ -348,14 +461,87 @@
                                 changed = true;
                             }
                         }
+                        ANN_SEARCH_STAT(searcher, upper_distances, neighbors.degree());
+                        ANN_SEARCH_STAT(searcher, upper_hops, changed);
                     }
                 }
             }
+            return curr_node;
+        }
+
+        // The entry node of the level-0 search of query, found by the greedy search of the upper levels alone.
+        // Unlike the predict functions it reads neither graph_l0_finger nor the Finger basis, so searcher needs
+        // no setup_appx_results_containers().
+        template<class Searcher_T>
+        index_type route(const feat_vec_t& query, Searcher_T& searcher) const {
+            check_sections_loaded(skipped_sections, {"feature_vec", "graph_l1"});
+            return search_upper_levels(query, searcher);
+        }
+
+        template<class Searcher_T>
+        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher_T& searcher, index_type num_rerank) const {
+            check_sections_loaded(skipped_sections, {"feature_vec", "graph_l1", "graph_l0_finger"});
+            ANN_SEARCH_TIMER_START(searcher);
+            index_type curr_node = search_upper_levels(query, searcher);
+            ANN_SEARCH_TIMER_LAP(searcher, DESCEND);
             // generalized search_level for level=0 for efS >= 1
-            searcher.search_level(query, curr_node, std::max(efS, topk), 0);
-            auto& topk_queue = searcher.topk_queue;
+            if (candidate_queue_kind == CandidateQueueKind::linear_pool) {
+                search_level_linear_pool(query, curr_node, std::max(efS, topk), searcher);
+            } else {
+                searcher.search_level(query, curr_node, std::max(efS, topk), 0);
+            }
+            auto& ret = finalize_topk(query, efS, topk, searcher, num_rerank);
+            ANN_SEARCH_TIMER_LAP(searcher, RERANK);
+            return ret;
+        }
 
+        // predict_single among the nodes allowed by filter. If they are fewer than the efS * maxM0 distances
+        // a graph search may compute, their distances are computed directly instead, which are exact, so
+        // there is nothing to rerank.
+        template<class Searcher_T>
+        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher_T& searcher, index_type num_rerank, const SearchFilter& filter) const {
+            check_sections_loaded(skipped_sections, {"feature_vec", "graph_l1", "graph_l0_finger"});
+            efS = std::max(efS, topk);
+            if (filter.num_allowed <= (mem_index_type) efS * maxM0) {
+                auto& topk_queue = search_allowed_nodes(query, topk, filter, searcher);
+                std::sort_heap(topk_queue.begin(), topk_queue.end());
+                return topk_queue;
+            }
+            ANN_SEARCH_TIMER_START(searcher);
+            index_type curr_node = search_upper_levels(query, searcher);
+            ANN_SEARCH_TIMER_LAP(searcher, DESCEND);
+            search_level_filtered(query, curr_node, efS, filter, searcher);
+            auto& ret = finalize_topk(query, efS, topk, searcher, num_rerank);
+            ANN_SEARCH_TIMER_LAP(searcher, RERANK);
+            return ret;
+        }
+
+        // All nodes within distance radius of query, up to the max_results closest of them, sorted by increasing
+        // distance. efS is the size of the beam that finds the first ones, see search_level_range.
+        template<class Searcher_T>
+        max_heap_t& predict_range(const feat_vec_t& query, dist_t radius, index_type max_results, Searcher_T& searcher, index_type efS=40) const {
+            check_sections_loaded(skipped_sections, {"feature_vec", "graph_l1", "graph_l0_finger"});
+            auto& topk_queue = searcher.topk_queue;
+            if (max_results == 0) {
+                topk_queue.clear();
+                return topk_queue;
+            }
+            ANN_SEARCH_TIMER_START(searcher);
+            index_type curr_node = search_upper_levels(query, searcher);
+            ANN_SEARCH_TIMER_LAP(searcher, DESCEND);
+            search_level_range(query, curr_node, radius, max_results, efS, searcher);
+            std::sort_heap(topk_queue.begin(), topk_queue.end());
+            ANN_SEARCH_TIMER_LAP(searcher, RERANK);
+            return topk_queue;
+        }
 
+        // rerank (if num_rerank > 0) or trim the level-0 search result in searcher.topk_queue,
+        // and sort it by increasing distance
+        template<class Searcher_T>
+        max_heap_t& finalize_topk(const feat_vec_t& query, index_type efS, index_type topk, Searcher_T& searcher, index_type num_rerank) const {
+            auto &G0 = feature_vec;
+            auto& topk_queue = searcher.topk_queue;
+            ANN_SEARCH_STAT(searcher, num_queries, 1);
             if (num_rerank > 0) {
                 index_type t_size = topk_queue.size() > num_rerank ? topk_queue.size() - num_rerank : 0;
                 for (index_type i = 0; i < t_size; i++) {
@@ -369,6 +555,7 @@
                         G0.get_node_feat(cand_pair.node_id)
                     );
                     (*i).dist = next_dist;
+                    ANN_SEARCH_STAT(searcher, rerank_distances, 1);
                 }
                 std::sort(topk_queue.begin(), topk_queue.end());
                 if (topk_queue.size() > topk) {
@@ -389,12 +576,349 @@
             return topk_queue;
         }
 
+        // Resumable state of one query in predict_group. Every step ends right after issuing prefetches
+        // for the memory the next step of the same query touches.
+        template<class Searcher_T>
+        struct InterleavedQuery {
+            enum phase_t {
+                DESCEND_FETCH,  // prefetch the upper-level neighbors of curr_node
+                DESCEND_SCAN,   // one greedy pass over them
+                EXACT_FETCH,    // first stage of search_level: pop a candidate, prefetch its neighbors
+                EXACT_SCAN,     // first stage of search_level: exact distances to the neighbors
+                APPX_FETCH,     // second stage of search_level: pop a candidate, approximate distances
+                APPX_SCAN,      // second stage of search_level: exact distances to the promising neighbors
+                DONE
+            };
+            const feat_vec_t* query;
+            Searcher_T* searcher;
+            phase_t phase;
+            index_type level;
+            index_type curr_node;
+            dist_t curr_dist;
+            dist_t topk_ub_dist;
+            index_type cand_node;
+        };
+
+        static inline void prefetch_range(const void* ptr, size_t num_bytes) {
+            const char* addr = reinterpret_cast<const char*>(ptr);
+            for (size_t offset = 0; offset < num_bytes; offset += 64) {
+                __builtin_prefetch(addr + offset, 0, 3);
+            }
+        }
+
+        inline void prefetch_feature(index_type node_id) const {
+            prefetch_range(feature_vec.get_node_feat_ptr(node_id), feature_vec.node_mem_size);
+        }
+
+        inline void prefetch_finger_node(index_type node_id) const {
+            prefetch_range(graph_l0_finger.get_node_feat_ptr(node_id), graph_l0_finger.node_mem_size);
+        }
+
+        // start the level-0 search from curr_node, as search_level does before its loops
+        template<class Searcher_T>
+        void start_interleaved_level0(InterleavedQuery<Searcher_T>& q) const {
+            typedef InterleavedQuery<Searcher_T> query_t;
+            Searcher_T& searcher = *q.searcher;
+            searcher.reset();
+            q.topk_ub_dist = feat_vec_t::distance(*q.query, feature_vec.get_node_feat(q.curr_node));
+            searcher.compute_query_projection(q.query->val);
+            searcher.topk_queue.emplace(q.topk_ub_dist, q.curr_node);
+            searcher.cand_queue.emplace(q.topk_ub_dist, q.curr_node);
+            searcher.mark_visited(q.curr_node);
+            ANN_SEARCH_STAT(searcher, visited, 1);
+            prefetch_finger_node(q.curr_node);
+            q.phase = query_t::EXACT_FETCH;
+        }
+
+        // run one step of q, which follows exactly the computation of predict_single
+        template<class Searcher_T>
+        void interleaved_step(InterleavedQuery<Searcher_T>& q, index_type efS) const {
+            typedef InterleavedQuery<Searcher_T> query_t;
+            Searcher_T& searcher = *q.searcher;
+            max_heap_t& topk_queue = searcher.topk_queue;
+            min_heap_t& cand_queue = searcher.cand_queue;
+            switch (q.phase) {
+                case query_t::DESCEND_FETCH: {
+                    const auto neighbors = graph_l1.get_neighborhood(q.curr_node, q.level);
+                    for (index_type j = 0; j < neighbors.degree(); j++) {
+                        prefetch_feature(neighbors[j]);
+                    }
+                    q.phase = query_t::DESCEND_SCAN;
+                    break;
+                }
+                case query_t::DESCEND_SCAN: {
+                    bool changed = false;
+                    const auto neighbors = graph_l1.get_neighborhood(q.curr_node, q.level);
+                    for (index_type j = 0; j < neighbors.degree(); j++) {
+                        auto next_node = neighbors[j];
+                        dist_t next_dist = feat_vec_t::distance(*q.query, feature_vec.get_node_feat(next_node));
+                        if (next_dist < q.curr_dist) {
+                            q.curr_dist = next_dist;
+                            q.curr_node = next_node;
+                            changed = true;
+                        }
+                    }
+                    ANN_SEARCH_STAT(searcher, upper_distances, neighbors.degree());
+                    ANN_SEARCH_STAT(searcher, upper_hops, changed);
+                    if (!changed) {
+                        q.level -= 1;
+                    }
+                    if (q.level >= 1) {
+                        prefetch_range(graph_l1.get_neighborhood(q.curr_node, q.level).degree_ptr, graph_l1.level_mem_size * sizeof(index_type));
+                        q.phase = query_t::DESCEND_FETCH;
+                    } else {
+                        start_interleaved_level0(q);
+                    }
+                    break;
+                }
+                case query_t::EXACT_FETCH: {
+                    if (cand_queue.empty() || cand_queue.top().dist > q.topk_ub_dist) {
+                        // both stages of search_level stop here
+                        q.phase = query_t::DONE;
+                        break;
+                    }
+                    q.cand_node = cand_queue.top().node_id;
+                    cand_queue.pop();
+                    ANN_SEARCH_STAT(searcher, exact_hops, 1);
+                    const auto neighbors = graph_l0_finger.get_neighborhood(q.cand_node, 0);
+                    for (index_type j = 0; j < neighbors.degree(); j++) {
+                        if (!searcher.is_visited(neighbors[j])) {
+                            prefetch_feature(neighbors[j]);
+                        }
+                    }
+                    q.phase = query_t::EXACT_SCAN;
+                    break;
+                }
+                case query_t::EXACT_SCAN: {
+                    const auto neighbors = graph_l0_finger.get_neighborhood(q.cand_node, 0);
+                    for (index_type j = 0; j < neighbors.degree(); j++) {
+                        auto next_node = neighbors[j];
+                        if (!searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, exact_distances, 1);
+                            dist_t next_lb_dist = feat_vec_t::distance(*q.query, feature_vec.get_node_feat(next_node));
+                            if (topk_queue.size() < efS || next_lb_dist < q.topk_ub_dist) {
+                                cand_queue.emplace(next_lb_dist, next_node);
+                                topk_queue.emplace(next_lb_dist, next_node);
+                                if (topk_queue.size() > efS) {
+                                    topk_queue.pop();
+                                }
+                                if (!topk_queue.empty()) {
+                                    q.topk_ub_dist = topk_queue.top().dist;
+                                }
+                            }
+                        }
+                    }
+                    if (!cand_queue.empty()) {
+                        prefetch_finger_node(cand_queue.top().node_id);
+                    }
+                    bool enough = (neighbors.degree() != 0 && topk_queue.size() >= efS);
+                    q.phase = enough ? query_t::APPX_FETCH : query_t::EXACT_FETCH;
+                    break;
+                }
+                case query_t::APPX_FETCH: {
+                    if (cand_queue.empty() || cand_queue.top().dist > q.topk_ub_dist) {
+                        q.phase = query_t::DONE;
+                        break;
+                    }
+                    pair_t cand_pair = cand_queue.top();
+                    cand_queue.pop();
+                    q.cand_node = cand_pair.node_id;
+                    const auto neighbors = graph_l0_finger.get_neighborhood(q.cand_node, 0);
+                    ANN_SEARCH_STAT(searcher, appx_hops, 1);
+                    ANN_SEARCH_STAT(searcher, appx_scanned, neighbors.degree());
+                    searcher.approximate_distance(
+                        neighbors.degree(),
+                        q.topk_ub_dist,
+                        cand_pair.dist,
+                        graph_l0_finger.get_stored_info(q.cand_node)
+                    );
+                    for (index_type j = 0; j < neighbors.degree(); j++) {
+                        auto next_node = neighbors[j];
+                        if (searcher.appx_dist[j] and !searcher.is_visited(next_node)) {
+                            prefetch_feature(next_node);
+                            searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, appx_passed, 1);
+                        } else {
+                            searcher.appx_dist[j] = 0;
+                        }
+                    }
+                    q.phase = query_t::APPX_SCAN;
+                    break;
+                }
+                case query_t::APPX_SCAN: {
+                    const auto neighbors = graph_l0_finger.get_neighborhood(q.cand_node, 0);
+                    if (neighbors.degree() != 0) {
+                        for (index_type j = 0; j < neighbors.degree(); j++) {
+                            if (searcher.appx_dist[j]) {
+                                auto next_node = neighbors[j];
+                                dist_t next_lb_dist = feat_vec_t::distance(*q.query, feature_vec.get_node_feat(next_node));
+                                cand_queue.emplace(next_lb_dist, next_node);
+                                topk_queue.emplace(next_lb_dist, next_node);
+                            }
+                        }
+                        if (!cand_queue.empty()) {
+                            prefetch_finger_node(cand_queue.top().node_id);
+                        }
+                        while (topk_queue.size() > efS) {
+                            topk_queue.pop();
+                        }
+                        q.topk_ub_dist = topk_queue.top().dist;
+                    }
+                    q.phase = query_t::APPX_FETCH;
+                    break;
+                }
+                case query_t::DONE:
+                    break;
+            }
+        }
+
+        // Interleaved inference of group_size queries on the calling thread. Each query advances as a
+        // resumable state machine; after one step issues the prefetches for its next memory accesses, the
+        // thread moves on to the next query of the group, so the memory latency of one query overlaps with
+        // the computation of the others. The result of queries[g] is returned in searchers[g]->topk_queue
+        // and is identical to predict_single(queries[g], efS, topk, *searchers[g], num_rerank).
+        template<class Searcher_T>
+        void predict_group(
+            const feat_vec_t* queries,
+            index_type group_size,
+            index_type efS,
+            index_type topk,
+            Searcher_T** searchers,
+            index_type num_rerank=0
+        ) const {
+            check_sections_loaded(skipped_sections, {"feature_vec", "graph_l1", "graph_l0_finger"});
+            const index_type max_group_size = 32;
+            if (group_size > max_group_size) {
+                throw std::invalid_argument("predict_group supports at most 32 queries per group.");
+            }
+            typedef InterleavedQuery<Searcher_T> query_t;
+            query_t states[max_group_size];
+            for (index_type g = 0; g < group_size; g++) {
+                query_t& q = states[g];
+                q.query = &queries[g];
+                q.searcher = searchers[g];
+                q.curr_node = this->init_node;
+                q.curr_dist = feat_vec_t::distance(*q.query, feature_vec.get_node_feat(init_node));
+                q.level = this->max_level;
+                if (q.level >= 1) {
+                    q.phase = query_t::DESCEND_FETCH;
+                } else {
+                    start_interleaved_level0(q);
+                }
+            }
+            index_type num_active = group_size;
+            while (num_active > 0) {
+                for (index_type g = 0; g < group_size; g++) {
+                    if (states[g].phase != query_t::DONE) {
+                        interleaved_step(states[g], std::max(efS, topk));
+                        if (states[g].phase == query_t::DONE) {
+                            finalize_topk(*states[g].query, efS, topk, *states[g].searcher, num_rerank);
+                            num_active -= 1;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Batch inference over the rows of queries with at most threads threads (<= 0 for all cores).
+        // Each thread takes prepared Searchers from searcher_pools, so no per-query allocation happens
+        // once the pool is warm. ret_ids and ret_dists hold queries.rows x topk entries in row-major order;
+        // see write_topk_result for how missing entries are filled.
+        // If group_size > 1 (at most 32), every thread interleaves groups of group_size queries with
+        // predict_group; the results do not change.
+        // The queries are searched in blocks, and the Finger projections of a block are computed up front by
+        // one GEMM, which may differ from the GEMV of predict_single in the last bits.
+        template<class MAT_T>
+        void predict_batch(
+            const MAT_T& queries,
+            index_type efS,
+            index_type topk,
+            int threads,
+            index_type* ret_ids,
+            dist_t* ret_dists,
+            index_type num_rerank=0,
+            index_type group_size=1
+        ) const {
+            // before the parallel region, as an exception must not escape it
+            check_sections_loaded(skipped_sections, {"feature_vec", "graph_l1", "graph_l0_finger"});
+            threads = (threads <= 0) ? omp_get_num_procs() : threads;
+            group_size = std::max<index_type>(group_size, 1);
+            if (group_size > 32) {
+                throw std::invalid_argument("predict_batch supports at most 32 queries per group.");
+            }
+            // a multiple of group_size, so that the groups do not change
+            const index_type block_rows = group_size * std::max<index_type>(1, 4096 / group_size);
+            const index_type dimension = graph_l0_finger.finger.dimension;
+            std::vector<float> block_feat((size_t) std::min(block_rows, queries.rows) * dimension);
+            std::vector<float> block_projection((size_t) std::min(block_rows, queries.rows) * Rank);
+            dispatch_visited_set_kind(visited_set_kind, [&](auto visited_set) {
+                typedef typename decltype(visited_set)::type visited_set_t;
+                typedef BasicSearcher<visited_set_t> searcher_t;
+                auto& searcher_pool = searcher_pools.template get<visited_set_t>();
+                for (index_type block_begin = 0; block_begin < queries.rows; block_begin += block_rows) {
+                    index_type block_size = std::min<index_type>(block_rows, queries.rows - block_begin);
+#pragma omp parallel for num_threads(threads) schedule(static)
+                    for (index_type i = 0; i < block_size; i++) {
+                        std::copy_n(queries.get_row(block_begin + i).val, dimension, &block_feat[(size_t) i * dimension]);
+                    }
+                    graph_l0_finger.finger.project_queries(block_feat.data(), block_size, dimension, block_projection.data());
+                    index_type num_groups = (block_size + group_size - 1) / group_size;
+#pragma omp parallel num_threads(threads)
+                    {
+                        std::unique_ptr<searcher_t> searchers[32];
+                        searcher_t* searcher_ptrs[32];
+                        std::vector<feat_vec_t> group_queries;
+                        group_queries.reserve(group_size);
+                        for (index_type g = 0; g < group_size; g++) {
+                            searchers[g] = searcher_pool.acquire([this]() {
+                                searcher_t searcher = this->template create_searcher<visited_set_t>();
+                                searcher.setup_appx_results_containers();
+                                return searcher;
+                            });
+                            searcher_ptrs[g] = searchers[g].get();
+                        }
+#pragma omp for schedule(dynamic, 1)
+                        for (index_type b = 0; b < num_groups; b++) {
+                            index_type i0 = block_begin + b * group_size;
+                            index_type curr_group_size = std::min<index_type>(group_size, queries.rows - i0);
+                            for (index_type g = 0; g < curr_group_size; g++) {
+                                searcher_ptrs[g]->use_query_projection(&block_projection[(size_t) (i0 - block_begin + g) * Rank]);
+                            }
+                            if (curr_group_size > 1 && candidate_queue_kind == CandidateQueueKind::heap) {
+                                group_queries.clear();
+                                for (index_type g = 0; g < curr_group_size; g++) {
+                                    group_queries.emplace_back(queries.get_row(i0 + g));
+                                }
+                                predict_group(group_queries.data(), curr_group_size, efS, topk, searcher_ptrs, num_rerank);
+                            } else {
+                                // predict_group only interleaves the heap-based search
+                                for (index_type g = 0; g < curr_group_size; g++) {
+                                    predict_single(queries.get_row(i0 + g), efS, topk, *searcher_ptrs[g], num_rerank);
+                                }
+                            }
+                            for (index_type g = 0; g < curr_group_size; g++) {
+                                index_type i = i0 + g;
+                                write_topk_result(searcher_ptrs[g]->topk_queue, topk, num_node, &ret_ids[i * (mem_index_type) topk], &ret_dists[i * (mem_index_type) topk]);
+                            }
+                        }
+                        for (index_type g = 0; g < group_size; g++) {
+                            searcher_pool.release(std::move(searchers[g]));
+                        }
+                    }
+                }
+            });
+        }
+
+        template<class Searcher_T>
         max_heap_t& search_level(
             const feat_vec_t& query,
             index_type init_node,
             index_type efS,
             index_type level,
-            Searcher& searcher,
+            Searcher_T& searcher,
             std::vector<std::mutex>* mtx_nodes=nullptr
         ) const {
             const auto *G0_feature = &feature_vec;
@@ -414,10 +938,12 @@
             );
             // compute query projection
             searcher.compute_query_projection(query.val); 
+            ANN_SEARCH_TIMER_LAP(searcher, PROJECTION);
 
             topk_queue.emplace(topk_ub_dist, init_node);
             cand_queue.emplace(topk_ub_dist, init_node);
             searcher.mark_visited(init_node);
+            ANN_SEARCH_STAT(searcher, visited, 1);
             // first stage, use the original exact distance to do inference.
             size_t iteration_cnt = 0;
             while (!cand_queue.empty() ) {
@@ -426,6 +952,7 @@
                     break;
                 }
                 cand_queue.pop();
+                ANN_SEARCH_STAT(searcher, exact_hops, 1);
 
                 index_type cand_node = cand_pair.node_id;
 
@@ -439,6 +966,8 @@
                         auto next_node = neighbors[j];
                         if (!searcher.is_visited(next_node)) {
                             searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, exact_distances, 1);
                             dist_t next_lb_dist;
                             next_lb_dist = feat_vec_t::distance(
                                 query,
@@ -467,6 +996,7 @@
                 //iteration_cnt += 1;
 
             }
+            ANN_SEARCH_TIMER_LAP(searcher, EXACT);
 /*
 //             for(int r = 0; r < GFinger->finger.num_codebooks; r++) {
             for(int i = 0; i < GFinger->finger.low_rank; i++){
@@ -501,6 +1031,8 @@
                 // visiting neighbors of candidate node
                 const auto neighbors = GFinger->get_neighborhood(cand_node, level);
                 auto stored_info = GFinger->get_stored_info(cand_node);
+                ANN_SEARCH_STAT(searcher, appx_hops, 1);
+                ANN_SEARCH_STAT(searcher, appx_scanned, neighbors.degree());
 /*
                 std::cout<<"center node : "<<cand_node<<" size : "<<neighbors.degree()<<" "<<center_query_l2_distance<<std::endl;
                     for (index_type j = 0; j <= neighbors.degree() - 1; j++) {
@@ -637,6 +1169,8 @@
                         if (searcher.appx_dist[j] and !searcher.is_visited(next_node)) {
                             G0_feature->prefetch_node_feat(next_node);
                             searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, appx_passed, 1);
                         } else { 
                             searcher.appx_dist[j] = 0;
                         }
@@ -735,6 +1269,322 @@
 */
 
             }
+            ANN_SEARCH_TIMER_LAP(searcher, APPX);
             return topk_queue;
         }
+
+        // search_level at level 0 for a filtered search. Only nodes allowed by filter enter searcher.topk_queue,
+        // but every node closer than its worst one is a candidate to expand, and the search does not stop
+        // before it holds efS nodes, so the filtered-out nodes still lead to the allowed ones. Once it does,
+        // the neighbors are pruned by their approximate distances as in the second stage of search_level.
+        template<class Searcher_T>
+        max_heap_t& search_level_filtered(const feat_vec_t& query, index_type init_node, index_type efS, const SearchFilter& filter, Searcher_T& searcher) const {
+            const auto *G0_feature = &feature_vec;
+            const auto *GFinger = &graph_l0_finger;
+            searcher.reset();
+            max_heap_t& topk_queue = searcher.topk_queue;
+            min_heap_t& cand_queue = searcher.cand_queue;
+            auto add_node = [&](dist_t dist, index_type node_id) {
+                if (topk_queue.size() < efS || dist < topk_queue.top().dist) {
+                    cand_queue.emplace(dist, node_id);
+                    if (filter.allows(node_id)) {
+                        topk_queue.emplace(dist, node_id);
+                        if (topk_queue.size() > efS) {
+                            topk_queue.pop();
+                        }
+                    }
+                }
+            };
+
+            dist_t init_dist = feat_vec_t::distance(
+                query,
+                G0_feature->get_node_feat(init_node)
+            );
+            searcher.compute_query_projection(query.val);
+            ANN_SEARCH_TIMER_LAP(searcher, PROJECTION);
+            add_node(init_dist, init_node);
+            searcher.mark_visited(init_node);
+            ANN_SEARCH_STAT(searcher, visited, 1);
+
+            while (!cand_queue.empty()) {
+                pair_t cand_pair = cand_queue.top();
+                bool full = topk_queue.size() >= efS;
+                if (full && cand_pair.dist > topk_queue.top().dist) {
+                    break;
+                }
+                cand_queue.pop();
+
+                const auto neighbors = GFinger->get_neighborhood(cand_pair.node_id, 0);
+                if (neighbors.degree() == 0) {
+                    continue;
+                }
+                index_type max_j = neighbors.degree() - 1;
+                if (!full) {
+                    ANN_SEARCH_STAT(searcher, exact_hops, 1);
+                    for (index_type j = 0; j <= max_j; j++) {
+                        feature_vec.prefetch_node_feat(neighbors[std::min(j + 1, max_j)]);
+                        auto next_node = neighbors[j];
+                        if (!searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, exact_distances, 1);
+                            add_node(feat_vec_t::distance(query, G0_feature->get_node_feat(next_node)), next_node);
+                        }
+                    }
+                    continue;
+                }
+                ANN_SEARCH_STAT(searcher, appx_hops, 1);
+                ANN_SEARCH_STAT(searcher, appx_scanned, neighbors.degree());
+                searcher.approximate_distance(
+                    neighbors.degree(),
+                    topk_queue.top().dist,
+                    cand_pair.dist,
+                    GFinger->get_stored_info(cand_pair.node_id)
+                );
+                for (index_type j = 0; j <= max_j; j++) {
+                    auto next_node = neighbors[j];
+                    if (searcher.appx_dist[j] and !searcher.is_visited(next_node)) {
+                        G0_feature->prefetch_node_feat(next_node);
+                        searcher.mark_visited(next_node);
+                        ANN_SEARCH_STAT(searcher, visited, 1);
+                        ANN_SEARCH_STAT(searcher, appx_passed, 1);
+                    } else {
+                        searcher.appx_dist[j] = 0;
+                    }
+                }
+                for (index_type j = 0; j <= max_j; j++) {
+                    if (searcher.appx_dist[j]) {
+                        auto next_node = neighbors[j];
+                        add_node(feat_vec_t::distance(query, G0_feature->get_node_feat(next_node)), next_node);
+                    }
+                }
+            }
+            ANN_SEARCH_TIMER_LAP(searcher, APPX);
+            return topk_queue;
+        }
+
+        // search_level at level 0 for predict_range. A beam of the efS closest nodes, kept in searcher.cand_pool,
+        // leads the search towards query; every node closer than the beam or within the radius is a candidate,
+        // and the search expands them until none is left that is within either. The nodes within radius go to
+        // searcher.topk_queue, a max-heap of at most max_results nodes; once it is full, its farthest node
+        // bounds the radius. Once the beam holds efS nodes, the neighbors are pruned by their approximate
+        // distances against the farther of the beam and the radius.
+        template<class Searcher_T>
+        max_heap_t& search_level_range(const feat_vec_t& query, index_type init_node, dist_t radius, index_type max_results, index_type efS, Searcher_T& searcher) const {
+            const auto *G0_feature = &feature_vec;
+            const auto *GFinger = &graph_l0_finger;
+            searcher.reset();
+            max_heap_t& topk_queue = searcher.topk_queue;
+            min_heap_t& cand_queue = searcher.cand_queue;
+            auto& beam = searcher.cand_pool;
+            beam.reset(efS);
+            auto range_bound = [&]() {
+                return topk_queue.size() < max_results ? radius : std::min(radius, topk_queue.top().dist);
+            };
+            auto add_node = [&](dist_t dist, index_type node_id) {
+                bool in_range = dist < range_bound();
+                if (in_range) {
+                    topk_queue.emplace(dist, node_id);
+                    if (topk_queue.size() > max_results) {
+                        topk_queue.pop();
+                    }
+                }
+                if (beam.insert(dist, node_id) != beam.capacity || in_range) {
+                    cand_queue.emplace(dist, node_id);
+                }
+            };
+
+            dist_t init_dist = feat_vec_t::distance(
+                query,
+                G0_feature->get_node_feat(init_node)
+            );
+            searcher.compute_query_projection(query.val);
+            ANN_SEARCH_TIMER_LAP(searcher, PROJECTION);
+            add_node(init_dist, init_node);
+            searcher.mark_visited(init_node);
+            ANN_SEARCH_STAT(searcher, visited, 1);
+
+            while (!cand_queue.empty()) {
+                pair_t cand_pair = cand_queue.top();
+                if (beam.full() && cand_pair.dist > beam.bound() && cand_pair.dist >= range_bound()) {
+                    break;
+                }
+                cand_queue.pop();
+
+                const auto neighbors = GFinger->get_neighborhood(cand_pair.node_id, 0);
+                if (neighbors.degree() == 0) {
+                    continue;
+                }
+                index_type max_j = neighbors.degree() - 1;
+                if (!beam.full()) {
+                    ANN_SEARCH_STAT(searcher, exact_hops, 1);
+                    for (index_type j = 0; j <= max_j; j++) {
+                        feature_vec.prefetch_node_feat(neighbors[std::min(j + 1, max_j)]);
+                        auto next_node = neighbors[j];
+                        if (!searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, exact_distances, 1);
+                            add_node(feat_vec_t::distance(query, G0_feature->get_node_feat(next_node)), next_node);
+                        }
+                    }
+                    continue;
+                }
+                ANN_SEARCH_STAT(searcher, appx_hops, 1);
+                ANN_SEARCH_STAT(searcher, appx_scanned, neighbors.degree());
+                searcher.approximate_distance(
+                    neighbors.degree(),
+                    std::max(beam.bound(), range_bound()),
+                    cand_pair.dist,
+                    GFinger->get_stored_info(cand_pair.node_id)
+                );
+                for (index_type j = 0; j <= max_j; j++) {
+                    auto next_node = neighbors[j];
+                    if (searcher.appx_dist[j] and !searcher.is_visited(next_node)) {
+                        G0_feature->prefetch_node_feat(next_node);
+                        searcher.mark_visited(next_node);
+                        ANN_SEARCH_STAT(searcher, visited, 1);
+                        ANN_SEARCH_STAT(searcher, appx_passed, 1);
+                    } else {
+                        searcher.appx_dist[j] = 0;
+                    }
+                }
+                for (index_type j = 0; j <= max_j; j++) {
+                    if (searcher.appx_dist[j]) {
+                        auto next_node = neighbors[j];
+                        add_node(feat_vec_t::distance(query, G0_feature->get_node_feat(next_node)), next_node);
+                    }
+                }
+            }
+            // its exact and approximate expansions interleave, so the whole level-0 search is timed as APPX
+            ANN_SEARCH_TIMER_LAP(searcher, APPX);
+            return topk_queue;
+        }
+
+        // the topk nodes allowed by filter by their distances to query, into searcher.topk_queue as a max-heap
+        template<class Searcher_T>
+        max_heap_t& search_allowed_nodes(const feat_vec_t& query, index_type topk, const SearchFilter& filter, Searcher_T& searcher) const {
+            max_heap_t& topk_queue = searcher.topk_queue;
+            topk_queue.clear();
+            searcher.given_projection = nullptr;  // not needed by the scan
+            filter.for_each_allowed(num_node, [&](index_type node_id) {
+                dist_t dist = feat_vec_t::distance(query, feature_vec.get_node_feat(node_id));
+                if (topk_queue.size() < topk || dist < topk_queue.top().dist) {
+                    topk_queue.emplace(dist, node_id);
+                    if (topk_queue.size() > topk) {
+                        topk_queue.pop();
+                    }
+                }
+            });
+            return topk_queue;
+        }
+
+        // search_level at level 0 with searcher.cand_pool in place of the two heaps, see CandidateQueueKind:
+        // the first stage expands with exact distances until the pool holds efS nodes, the second one only
+        // computes the exact distances of the neighbors that pass the approximate distance bound. The result
+        // is returned in searcher.topk_queue as a max-heap, like that of search_level.
+        template<class Searcher_T>
+        max_heap_t& search_level_linear_pool(const feat_vec_t& query, index_type init_node, index_type efS, Searcher_T& searcher) const {
+            const auto *G0_feature = &feature_vec;
+            const auto *GFinger = &graph_l0_finger;
+            searcher.reset();
+            auto& pool = searcher.cand_pool;
+            pool.reset(efS);
+
+            dist_t init_dist = feat_vec_t::distance(
+                query,
+                G0_feature->get_node_feat(init_node)
+            );
+            searcher.compute_query_projection(query.val);
+            ANN_SEARCH_TIMER_LAP(searcher, PROJECTION);
+
+            pool.insert(init_dist, init_node);
+            searcher.mark_visited(init_node);
+            ANN_SEARCH_STAT(searcher, visited, 1);
+            // first stage, use the original exact distance to do inference.
+            while (pool.has_next()) {
+                index_type cand_node = pool.next().node_id;
+                ANN_SEARCH_STAT(searcher, exact_hops, 1);
+
+                const auto neighbors = GFinger->get_neighborhood(cand_node, 0);
+                if (neighbors.degree() != 0) {
+                    index_type max_j = neighbors.degree() - 1;
+                    for (index_type j = 0; j <= max_j; j++) {
+                        feature_vec.prefetch_node_feat(neighbors[std::min(j + 1, max_j)]);
+                        auto next_node = neighbors[j];
+                        if (!searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, exact_distances, 1);
+                            dist_t next_lb_dist = feat_vec_t::distance(
+                                query,
+                                G0_feature->get_node_feat(next_node)
+                            );
+                            pool.insert(next_lb_dist, next_node);
+                        }
+                    }
+                    if (pool.full()) {
+                        break;
+                    }
+                }
+            }
+            ANN_SEARCH_TIMER_LAP(searcher, EXACT);
+
+            // second stage, use approximate distance to scan
+            while (pool.has_next()) {
+                auto cand = pool.next();
+                const auto neighbors = GFinger->get_neighborhood(cand.node_id, 0);
+                ANN_SEARCH_STAT(searcher, appx_hops, 1);
+                ANN_SEARCH_STAT(searcher, appx_scanned, neighbors.degree());
+                searcher.approximate_distance(
+                    neighbors.degree(),
+                    pool.bound(),
+                    cand.dist,
+                    GFinger->get_stored_info(cand.node_id)
+                );
+                if (neighbors.degree() != 0) {
+                    index_type max_j = neighbors.degree() - 1;
+                    for (index_type j = 0; j <= max_j; j++) {
+                        auto next_node = neighbors[j];
+                        if (searcher.appx_dist[j] and !searcher.is_visited(next_node)) {
+                            G0_feature->prefetch_node_feat(next_node);
+                            searcher.mark_visited(next_node);
+                            ANN_SEARCH_STAT(searcher, visited, 1);
+                            ANN_SEARCH_STAT(searcher, appx_passed, 1);
+                        } else {
+                            searcher.appx_dist[j] = 0;
+                        }
+                    }
+                    for (index_type j = 0; j <= max_j; j++) {
+                        if (searcher.appx_dist[j]) {
+                            auto next_node = neighbors[j];
+                            dist_t next_lb_dist = feat_vec_t::distance(
+                                query,
+                                G0_feature->get_node_feat(next_node)
+                            );
+                            pool.insert(next_lb_dist, next_node);
+                        }
+                    }
+                    if (pool.has_next()) {
+                        GFinger->prefetch_node_feat(pool.peek_next().node_id);
+                    }
+                }
+            }
+            ANN_SEARCH_TIMER_LAP(searcher, APPX);
+            pool.copy_to(searcher.topk_queue);
+            return searcher.topk_queue;
+        }
     };
+
+    // Calls fn(std::integral_constant<int, R>()) for R = rank, so that the caller can instantiate
+    // HNSWFinger<dist_t, FeatVec_T, R> for a rank only known at runtime, e.g. from HNSWFinger::finger_rank().
+    template<class Fn>
+    inline void dispatch_finger_rank(int rank, Fn&& fn) {
+        switch (rank) {
+            case 32: fn(std::integral_constant<int, 32>()); break;
+            case 64: fn(std::integral_constant<int, 64>()); break;
+            case 128: fn(std::integral_constant<int, 128>()); break;
+            case 256: fn(std::integral_constant<int, 256>()); break;
+            default: throw std::invalid_argument("Unsupported finger rank " + std::to_string(rank) + ", expected 32, 64, 128 or 256");
+        }
+    }
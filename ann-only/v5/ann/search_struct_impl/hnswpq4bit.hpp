@@ -26,8 +26,10 @@
             } 
         }
         ~HNSWProductQuantizer4Bits() {}
-        struct Searcher : SetOfVistedNodes<unsigned short int> {
-            typedef SetOfVistedNodes<unsigned short int> set_of_visited_nodes_t;
+        // a Searcher with VisitedSet_T as its visited set, see VisitedSetKind
+        template<class VisitedSet_T = SetOfVistedNodes<unsigned short int>>
+        struct BasicSearcher : VisitedSet_T {
+            typedef VisitedSet_T set_of_visited_nodes_t;
             typedef HNSWProductQuantizer4Bits<dist_t, FeatVec_T> hnswpq4_t;
             typedef heap_t<pair_t, std::less<pair_t>> max_heap_t;
             typedef heap_t<pair_t, std::greater<pair_t>> min_heap_t;
@@ -35,13 +37,14 @@
             const hnswpq4_t* hnsw;
             max_heap_t topk_queue;
             min_heap_t cand_queue;
-            alignas(64) std::vector<uint8_t> lut;
-            alignas(64) std::vector<float> appx_dist;
+            LinearPool<dist_t> cand_pool;  // in place of both queues with CandidateQueueKind::linear_pool
+            std::vector<uint8_t> lut;
+            std::vector<float> appx_dist;
             float scale;
             float bias;
 
-            Searcher(const hnswpq4_t* _hnsw=nullptr):
-                SetOfVistedNodes<unsigned short int>(_hnsw? _hnsw->num_node : 0),
+            BasicSearcher(const hnswpq4_t* _hnsw=nullptr):
+                VisitedSet_T(_hnsw? _hnsw->num_node : 0),
                 hnsw(_hnsw)
             {}
 
@@ -85,12 +88,36 @@
             max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, index_type num_rerank) {
                 return hnsw->predict_single(query, efS, topk, *this, num_rerank);
             }
+
+            max_heap_t& predict_range(const feat_vec_t& query, dist_t radius, index_type max_results, index_type efS=40) {
+                return hnsw->predict_range(query, radius, max_results, *this, efS);
+            }
         };
 
-        Searcher create_searcher() const {
-            return Searcher(this);
+        typedef BasicSearcher<> Searcher;
+
+        template<class VisitedSet_T = SetOfVistedNodes<unsigned short int>>
+        BasicSearcher<VisitedSet_T> create_searcher() const {
+            return BasicSearcher<VisitedSet_T>(this);
+        }
+
+        // selects the visited set of the Searchers of predict_batch, see VisitedSetKind; other Searchers get
+        // theirs from create_searcher
+        void set_visited_set_kind(VisitedSetKind kind) {
+            visited_set_kind = kind;
+            searcher_pools.clear();
         }
 
+        // selects the candidate queues of the level-0 search of predict_single and predict_batch; training
+        // always uses the heaps
+        void set_candidate_queue_kind(CandidateQueueKind kind) {
+            candidate_queue_kind = kind;
+        }
+
+        mutable VisitedSetSearcherPools<BasicSearcher> searcher_pools;  // reused by predict_batch
+        VisitedSetKind visited_set_kind = VisitedSetKind::dense;  // of the Searchers of predict_batch
+        CandidateQueueKind candidate_queue_kind = CandidateQueueKind::heap;  // of predict_single and predict_batch
+
 
         static nlohmann::json load_config(const std::string& filepath) {
             std::ifstream loadfile(filepath);
@@ -176,6 +203,7 @@
                 feature_vec.load(fp);
                 graph_l1.load(fp);
                 graph_l0_pq4.load(fp);
+                searcher_pools.clear();
             } else {
                 throw std::runtime_error("Unable to load this binary with version = " + version);
             }
@@ -195,6 +223,7 @@
             std::cout<< "step 9" <<std::endl;
             HNSW<dist_t, feat_vec_t>* hnsw = new HNSW<dist_t, feat_vec_t>();
             hnsw->train(X_trn, M, efC, threads, max_level_upper_bound);
+            searcher_pools.clear();
             this->num_node = hnsw->num_node;
             this->maxM = hnsw->maxM;
             this->maxM0 = hnsw->maxM0;
@@ -204,13 +233,7 @@
             this->subspace_dimension = subspace_dimension;
             this->sub_sample_points = sub_sample_points;
 
-            graph_l1.num_node = hnsw->graph_l1.num_node;
-            graph_l1.max_level = hnsw->graph_l1.max_level;
-            graph_l1.max_degree = hnsw->graph_l1.max_degree;
-            graph_l1.node_mem_size = hnsw->graph_l1.node_mem_size;
-            graph_l1.level_mem_size = hnsw->graph_l1.level_mem_size;
-            graph_l1.buffer.resize(hnsw->graph_l1.buffer.size());
-            memcpy(graph_l1.buffer.data(), hnsw->graph_l1.buffer.data(), hnsw->graph_l1.buffer.size() * sizeof(index_type));
+            graph_l1 = std::move(hnsw->graph_l1);
 
             graph_l0_pq4.build_quantizer(X_trn, subspace_dimension, sub_sample_points);
             graph_l0_pq4.build_graph(hnsw->graph_l0);
@@ -219,7 +242,8 @@
         }
 
 
-        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher& searcher, index_type num_rerank) const {
+        // greedy search of the levels l=1,...,L, returns the entry node of the level-0 search
+        index_type search_upper_levels(const feat_vec_t& query) const {
             index_type curr_node = this->init_node;
             auto &G1 = graph_l1;
             auto &G0 = feature_vec;
@@ -252,8 +276,19 @@
                     }
                 }
             }
+            return curr_node;
+        }
+
+        template<class Searcher_T>
+        max_heap_t& predict_single(const feat_vec_t& query, index_type efS, index_type topk, Searcher_T& searcher, index_type num_rerank) const {
+            auto &G0 = feature_vec;
+            index_type curr_node = search_upper_levels(query);
             // generalized search_level for level=0 for efS >= 1
-            searcher.search_level(query, curr_node, std::max(efS, topk), 0);
+            if (candidate_queue_kind == CandidateQueueKind::linear_pool) {
+                search_level_linear_pool(query, curr_node, std::max(efS, topk), searcher);
+            } else {
+                searcher.search_level(query, curr_node, std::max(efS, topk), 0);
+            }
             auto& topk_queue = searcher.topk_queue;
 
 
@@ -290,12 +325,62 @@
             return topk_queue;
         }
 
+        // All nodes within distance radius of query, up to the max_results closest of them, sorted by increasing
+        // distance. efS is the size of the beam that finds the first ones, see search_level_range.
+        template<class Searcher_T>
+        max_heap_t& predict_range(const feat_vec_t& query, dist_t radius, index_type max_results, Searcher_T& searcher, index_type efS=40) const {
+            auto& topk_queue = searcher.topk_queue;
+            if (max_results == 0) {
+                topk_queue.clear();
+                return topk_queue;
+            }
+            search_level_range(query, search_upper_levels(query), radius, max_results, efS, searcher);
+            std::sort_heap(topk_queue.begin(), topk_queue.end());
+            return topk_queue;
+        }
+
+        // Batch inference over the rows of queries with at most threads threads (<= 0 for all cores).
+        // Each thread takes a prepared Searcher from searcher_pools, so no per-query allocation happens
+        // once the pool is warm. ret_ids and ret_dists hold queries.rows x topk entries in row-major order;
+        // see write_topk_result for how missing entries are filled.
+        template<class MAT_T>
+        void predict_batch(
+            const MAT_T& queries,
+            index_type efS,
+            index_type topk,
+            int threads,
+            index_type* ret_ids,
+            dist_t* ret_dists,
+            index_type num_rerank=0
+        ) const {
+            threads = (threads <= 0) ? omp_get_num_procs() : threads;
+            dispatch_visited_set_kind(visited_set_kind, [&](auto visited_set) {
+                typedef typename decltype(visited_set)::type visited_set_t;
+                auto& searcher_pool = searcher_pools.template get<visited_set_t>();
+#pragma omp parallel num_threads(threads)
+                {
+                    auto searcher = searcher_pool.acquire([this]() {
+                        auto searcher = this->template create_searcher<visited_set_t>();
+                        searcher.prepare_inference();
+                        return searcher;
+                    });
+#pragma omp for schedule(dynamic, 16)
+                    for (index_type i = 0; i < queries.rows; i++) {
+                        const auto& ret_pairs = predict_single(queries.get_row(i), efS, topk, *searcher, num_rerank);
+                        write_topk_result(ret_pairs, topk, num_node, &ret_ids[i * (mem_index_type) topk], &ret_dists[i * (mem_index_type) topk]);
+                    }
+                    searcher_pool.release(std::move(searcher));
+                }
+            });
+        }
+
+        template<class Searcher_T>
         max_heap_t& search_level(
             const feat_vec_t& query,
             index_type init_node,
             index_type efS,
             index_type level,
-            Searcher& searcher,
+            Searcher_T& searcher,
             std::vector<std::mutex>* mtx_nodes=nullptr
         ) const {
             const auto *G0Q = &graph_l0_pq4;
@@ -351,6 +436,104 @@
 
 
 
+            return topk_queue;
+        }
+
+        // search_level at level 0 with searcher.cand_pool in place of the two heaps, see CandidateQueueKind.
+        // The result is returned in searcher.topk_queue as a max-heap, like that of search_level.
+        template<class Searcher_T>
+        max_heap_t& search_level_linear_pool(const feat_vec_t& query, index_type init_node, index_type efS, Searcher_T& searcher) const {
+            const auto *G0Q = &graph_l0_pq4;
+            searcher.reset();
+            searcher.setup_lut(query.val);
+            auto& pool = searcher.cand_pool;
+            pool.reset(efS);
+            pool.insert(feat_vec_t::distance(query, feature_vec.get_node_feat(init_node)), init_node);
+            searcher.mark_visited(init_node);
+
+            while (pool.has_next()) {
+                index_type cand_node = pool.next().node_id;
+
+                // visiting neighbors of candidate node
+                const auto neighbors = G0Q->get_neighborhood(cand_node, 0);
+                if (neighbors.degree() != 0) {
+                    index_type max_j = neighbors.degree() - 1;
+
+                    searcher.approximate_distance(max_j + 1, G0Q->get_neighbor_codes(cand_node));
+                    for (index_type j = 0; j <= max_j; j++) {
+                        auto next_node = neighbors[j];
+                        dist_t next_lb_dist = searcher.appx_dist[j];
+                        if (pool.admits(next_lb_dist) && !searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            pool.insert(next_lb_dist, next_node);
+                        }
+                    }
+                }
+            }
+            pool.copy_to(searcher.topk_queue);
+            return searcher.topk_queue;
+        }
+
+        // search_level at level 0 for predict_range, on the quantized distances except for the radius. A beam of the efS closest nodes, kept in searcher.cand_pool,
+        // leads the search towards query; every node closer than the beam or within the radius is a candidate,
+        // and the search expands them until none is left that is within either. The nodes within radius go to
+        // searcher.topk_queue, a max-heap of at most max_results nodes; once it is full, its farthest node
+        // bounds the radius. The exact distances of the candidates decide which are within radius, so
+        // nodes whose quantized distance exceeds both bounds are never considered.
+        template<class Searcher_T>
+        max_heap_t& search_level_range(const feat_vec_t& query, index_type init_node, dist_t radius, index_type max_results, index_type efS, Searcher_T& searcher) const {
+            const auto *G0Q = &graph_l0_pq4;
+            searcher.reset();
+            searcher.setup_lut(query.val);
+            max_heap_t& topk_queue = searcher.topk_queue;
+            min_heap_t& cand_queue = searcher.cand_queue;
+            auto& beam = searcher.cand_pool;
+            beam.reset(efS);
+            auto range_bound = [&]() {
+                return topk_queue.size() < max_results ? radius : std::min(radius, topk_queue.top().dist);
+            };
+
+            dist_t init_dist = feat_vec_t::distance(query, feature_vec.get_node_feat(init_node));
+            if (init_dist < radius) {
+                topk_queue.emplace(init_dist, init_node);
+            }
+            beam.insert(init_dist, init_node);
+            cand_queue.emplace(init_dist, init_node);
+            searcher.mark_visited(init_node);
+
+            while (!cand_queue.empty()) {
+                pair_t cand_pair = cand_queue.top();
+                if (beam.full() && cand_pair.dist > beam.bound() && cand_pair.dist >= range_bound()) {
+                    break;
+                }
+                cand_queue.pop();
+
+                const auto neighbors = G0Q->get_neighborhood(cand_pair.node_id, 0);
+                if (neighbors.degree() != 0) {
+                    index_type max_j = neighbors.degree() - 1;
+
+                    searcher.approximate_distance(max_j + 1, G0Q->get_neighbor_codes(cand_pair.node_id));
+                    for (index_type j = 0; j <= max_j; j++) {
+                        auto next_node = neighbors[j];
+                        dist_t next_lb_dist = searcher.appx_dist[j];
+                        bool in_beam = beam.admits(next_lb_dist);
+                        if ((in_beam || next_lb_dist < range_bound()) && !searcher.is_visited(next_node)) {
+                            searcher.mark_visited(next_node);
+                            cand_queue.emplace(next_lb_dist, next_node);
+                            if (in_beam) {
+                                beam.insert(next_lb_dist, next_node);
+                            }
+                            dist_t next_dist = feat_vec_t::distance(query, feature_vec.get_node_feat(next_node));
+                            if (next_dist < range_bound()) {
+                                topk_queue.emplace(next_dist, next_node);
+                                if (topk_queue.size() > max_results) {
+                                    topk_queue.pop();
+                                }
+                            }
+                        }
+                    }
+                }
+            }
             return topk_queue;
         }
     };
@@ -0,0 +1,731 @@
+// Build-once, sweep-many benchmark driver.
+//
+// The index is built (or loaded from the cache) once per dataset and build parameters, then searched for every
+// combination of threads, num_rerank and efS in the same process. Results go to <out>.json and <out>.csv, with
+// a pareto column marking the points on the recall/QPS frontier of each thread count.
+//
+//   ./bench --data DIR --model-dir DIR [--index finger|hnsw|pq4] [--space l2|ip|angular] [--M 16] [--efC 200]
+//           [--build-threads 0] [--rank 128] [--sub-dimension 0] [--basis-samples 0] [--gram-basis 0] [--efs 10,20,40,80,160] [--rerank 0]
+//           [--threads 1] [--topk K] [--group-size 1] [--repeats 3] [--lazy-load 0] [--sss 0] [--bbb 0]
+//           [--mode batch|closed|open] [--duration 10] [--warmup 2] [--rates 1000,2000] [--pin 1]
+//           [--visited dense|hash|bitset] [--queue heap|linear_pool] [--out bench]
+//
+// --mode batch times predict_batch over all queries. The other modes are load generators that replay the
+// queries for --duration seconds after --warmup seconds, with one Searcher per worker thread (pinned to its
+// own core with --pin 1), and report latency percentiles:
+//   closed: each of --threads workers issues its next query as soon as the previous one returns
+//   open:   queries arrive as a Poisson process at each of --rates queries per second and are served by
+//           max(--threads) workers; latency is measured from the arrival, so it includes queueing
+//
+// Built with -DPECOS_ANN_SEARCH_STATS (make STATS=1), the results of finger also include the search counters
+// of the predict_batch runs (see pecos::ann::SearchStats), and built with -DPECOS_ANN_SEARCH_TIMING
+// (make TIMING=1) the time per query of each search phase (see pecos::ann::SearchTiming). Only queries
+// searched one at a time are timed, so use --group-size 1 for the latter.
+//
+// --visited selects the visited set of the searches (see pecos::ann::VisitedSetKind) and --queue their
+// candidate queues (see pecos::ann::CandidateQueueKind).
+//
+// --space ip searches by inner product (FeatVecDenseIPSimd, finger and hnsw only) and --space angular by cosine
+// similarity, as the inner product of the rows of X.trn.npy and X.tst.npy scaled to unit norm. Yi.tst.npy must
+// come from groundtruth with the same --metric.
+//
+// DIR holds X.trn.npy, X.tst.npy and Yi.tst.npy. The index is cached in a subfolder of the model dir named
+// after the index type, build parameters and a fingerprint of X.trn.npy, and is reused by later runs.
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "utils/matrix.hpp"
+#include "utils/dense_loader.hpp"
+#include "utils/latency_histogram.hpp"
+#include "ann/hnsw.hpp"
+
+using pecos::ann::index_type;
+typedef uint64_t mem_index_type;
+
+struct BenchParams {
+    std::string data_dir;
+    std::string model_dir;
+    std::string index = "finger";
+    std::string space = "l2";
+    index_type M = 16;
+    index_type efC = 200;
+    int build_threads = 0;
+    int rank = 128;
+    index_type sub_dimension = 0;  // pq4: dimension of each subspace of the product quantizer
+    index_type basis_samples = 0;  // finger: nodes whose edge residuals learn the basis, 0 for all
+    bool gram_basis = false;       // finger: eigenvectors of the Gram matrix of the samples instead of their BDCSVD
+    std::vector<int> efs = {10, 20, 40, 80, 160};
+    std::vector<int> rerank = {0};
+    std::vector<int> threads = {1};
+    int topk = 0;  // 0 for all columns of Yi.tst.npy
+    int group_size = 1;
+    int repeats = 3;
+    bool lazy_load = false;
+    float sss = 0;
+    float bbb = 0;
+    std::string mode = "batch";
+    double duration = 10;
+    double warmup = 2;
+    std::vector<int> rates = {1000};
+    bool pin = true;
+    std::string visited = "dense";
+    std::string queue = "heap";
+    std::string out = "bench";
+
+    static std::vector<int> parse_list(const std::string& str) {
+        std::vector<int> ret;
+        std::stringstream ss(str);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            ret.push_back(std::stoi(item));
+        }
+        return ret;
+    }
+
+    BenchParams(int argc, char** argv) {
+        std::map<std::string, std::string> args;
+        for (int i = 1; i + 1 < argc; i += 2) {
+            if (std::string(argv[i]).compare(0, 2, "--") != 0) {
+                throw std::invalid_argument(std::string("Expected --name value, got ") + argv[i]);
+            }
+            args[argv[i] + 2] = argv[i + 1];
+        }
+        auto get = [&](const std::string& name, std::string& value) {
+            if (args.count(name)) {
+                value = args[name];
+                args.erase(name);
+                return true;
+            }
+            return false;
+        };
+        std::string value;
+        if (get("data", value)) data_dir = value;
+        if (get("model-dir", value)) model_dir = value;
+        if (get("index", value)) index = value;
+        if (get("space", value)) space = value;
+        if (get("M", value)) M = std::stoi(value);
+        if (get("efC", value)) efC = std::stoi(value);
+        if (get("build-threads", value)) build_threads = std::stoi(value);
+        if (get("rank", value)) rank = std::stoi(value);
+        if (get("sub-dimension", value)) sub_dimension = std::stoi(value);
+        if (get("basis-samples", value)) basis_samples = std::stoi(value);
+        if (get("gram-basis", value)) gram_basis = std::stoi(value) != 0;
+        if (get("efs", value)) efs = parse_list(value);
+        if (get("rerank", value)) rerank = parse_list(value);
+        if (get("threads", value)) threads = parse_list(value);
+        if (get("topk", value)) topk = std::stoi(value);
+        if (get("group-size", value)) group_size = std::stoi(value);
+        if (get("repeats", value)) repeats = std::max(std::stoi(value), 1);
+        if (get("lazy-load", value)) lazy_load = std::stoi(value) != 0;
+        if (get("sss", value)) sss = std::stof(value);
+        if (get("bbb", value)) bbb = std::stof(value);
+        if (get("mode", value)) mode = value;
+        if (get("duration", value)) duration = std::stod(value);
+        if (get("warmup", value)) warmup = std::stod(value);
+        if (get("rates", value)) rates = parse_list(value);
+        if (get("pin", value)) pin = std::stoi(value) != 0;
+        if (get("visited", value)) visited = value;
+        if (get("queue", value)) queue = value;
+        if (get("out", value)) out = value;
+        if (!args.empty()) {
+            throw std::invalid_argument("Unknown option --" + args.begin()->first);
+        }
+        if (data_dir.empty() || model_dir.empty()) {
+            throw std::invalid_argument("--data and --model-dir are required");
+        }
+        if (build_threads <= 0) {
+            build_threads = omp_get_num_procs();
+        }
+        if (mode != "batch" && mode != "closed" && mode != "open") {
+            throw std::invalid_argument("Unknown mode " + mode + ", expected batch, closed or open");
+        }
+        if (space != "l2" && space != "ip" && space != "angular") {
+            throw std::invalid_argument("Unknown space " + space + ", expected l2, ip or angular");
+        }
+        if (index == "pq4" && space != "l2") {
+            throw std::invalid_argument("pq4 only supports --space l2");
+        }
+        pecos::ann::visited_set_kind_of(visited);  // throws for unknown names
+        pecos::ann::candidate_queue_kind_of(queue);
+    }
+};
+
+struct BenchResult {
+    int threads;
+    int efs;
+    int num_rerank;
+    int target_qps;          // open loop only
+    double recall;
+    double qps;
+    double mean_latency_us;  // batch: wall time x threads / number of queries
+    pecos::LatencyHistogram latency_ns;  // closed and open loop only
+    uint64_t dropped;        // open loop: arrivals in the window that were not served before it ended
+    nlohmann::json search_stats;  // null unless the index counts them
+    nlohmann::json phase_timing;  // null unless the index times them
+    bool pareto;
+};
+
+// Identifies the content of a dataset file without reading all of it: its shape, size and the checksums of
+// 64 evenly spaced blocks of 64 KiB.
+std::string dataset_fingerprint(const std::string& path) {
+    pecos::mmap_util::MmapFile file(path);
+    const uint64_t num_blocks = 64, block_size = 64 << 10;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (uint64_t b = 0; b < num_blocks; b++) {
+        uint64_t offset = (file.size() - std::min<uint64_t>(block_size, file.size())) / (num_blocks - 1) * b;
+        ranges.emplace_back(offset, std::min<uint64_t>(block_size, file.size() - offset));
+    }
+    auto sums = pecos::mmap_util::section_checksums(file.data(), ranges);
+    uint64_t h = file.size();
+    for (auto sum : sums) {
+        h = pecos::mmap_util::details::fold_checksum(h, sum);
+    }
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016lx", (unsigned long) h);
+    return buf;
+}
+
+// true_ids holds num_queries x true_cols ids, the columns of each row sorted by increasing distance
+double recall_at_k(const index_type* ret_ids, const std::vector<index_type>& true_ids, index_type num_queries, index_type true_cols, index_type topk) {
+    double recall = 0.0;
+    for (index_type i = 0; i < num_queries; i++) {
+        std::unordered_set<index_type> true_indices;
+        for (index_type k = 0; k < topk; k++) {
+            true_indices.insert(true_ids[i * (mem_index_type) true_cols + k]);
+        }
+        for (index_type k = 0; k < topk; k++) {
+            recall += true_indices.count(ret_ids[i * (mem_index_type) topk + k]);
+        }
+    }
+    return recall / num_queries / topk;
+}
+
+void mark_pareto(std::vector<BenchResult>& results) {
+    for (auto& r : results) {
+        r.pareto = true;
+        for (const auto& o : results) {
+            bool dominates = o.threads == r.threads && o.target_qps == r.target_qps && o.recall >= r.recall && o.qps >= r.qps && (o.recall > r.recall || o.qps > r.qps);
+            if (dominates) {
+                r.pareto = false;
+                break;
+            }
+        }
+    }
+}
+
+// search counters of the indexes that keep them
+template<class Indexer>
+void reset_search_stats(const Indexer&) {}
+
+template<class Indexer>
+nlohmann::json get_search_stats(const Indexer&) { return nullptr; }
+
+template<class Indexer>
+nlohmann::json get_phase_timing(const Indexer&) { return nullptr; }
+
+template<class dist_t, class feat_vec_t, int Rank>
+void reset_search_stats(const pecos::ann::HNSWFinger<dist_t, feat_vec_t, Rank>& indexer) {
+    indexer.reset_search_stats();
+    indexer.reset_search_timing();
+}
+
+template<class dist_t, class feat_vec_t, int Rank>
+nlohmann::json get_phase_timing(const pecos::ann::HNSWFinger<dist_t, feat_vec_t, Rank>& indexer) {
+    return indexer.search_timing().to_json();
+}
+
+template<class dist_t, class feat_vec_t, int Rank>
+nlohmann::json get_search_stats(const pecos::ann::HNSWFinger<dist_t, feat_vec_t, Rank>& indexer) {
+    if (!pecos::ann::SearchStats::enabled) {
+        return nullptr;
+    }
+    return indexer.search_stats().to_json();
+}
+
+const double latency_percentiles[] = {50, 90, 95, 99, 99.9};
+
+std::string percentile_name(double p) {
+    std::string name = "p" + std::to_string(p);
+    name.erase(name.find_last_not_of('0') + 1);
+    if (name.back() == '.') {
+        name.pop_back();
+    }
+    std::replace(name.begin(), name.end(), '.', '_');
+    return name;
+}
+
+void write_results(const BenchParams& params, const nlohmann::json& build_info, const std::vector<BenchResult>& results) {
+    bool has_latency = params.mode != "batch";
+    bool has_stats = !results.empty() && !results[0].search_stats.is_null();
+    bool has_timing = !results.empty() && !results[0].phase_timing.is_null();
+    const char* stats_columns[] = {"prune_ratio", "upper_hops_per_query", "exact_hops_per_query", "appx_hops_per_query",
+        "exact_distances_per_query", "appx_scanned_per_query", "appx_passed_per_query", "visited_per_query"};
+    nlohmann::json j_results = nlohmann::json::array();
+    for (const auto& r : results) {
+        nlohmann::json j_r = {
+            {"threads", r.threads},
+            {"efs", r.efs},
+            {"num_rerank", r.num_rerank},
+            {"recall", r.recall},
+            {"qps", r.qps},
+            {"mean_latency_us", r.mean_latency_us},
+            {"pareto", r.pareto}
+        };
+        if (has_latency) {
+            nlohmann::json j_latency = {{"count", r.latency_ns.count()}, {"max", r.latency_ns.max() / 1e3}};
+            for (double p : latency_percentiles) {
+                j_latency[percentile_name(p)] = r.latency_ns.percentile(p) / 1e3;
+            }
+            j_r["latency_us"] = j_latency;
+        }
+        if (params.mode == "open") {
+            j_r["target_qps"] = r.target_qps;
+            j_r["dropped"] = r.dropped;
+        }
+        if (!r.search_stats.is_null()) {
+            j_r["search_stats"] = r.search_stats;
+        }
+        if (!r.phase_timing.is_null()) {
+            j_r["phase_timing_us"] = r.phase_timing;
+        }
+        j_results.push_back(j_r);
+    }
+    nlohmann::json j_out = {
+        {"dataset", params.data_dir},
+        {"index", params.index},
+        {"space", params.space},
+        {"mode", params.mode},
+        {"visited", params.visited},
+        {"queue", params.queue},
+        {"build", build_info},
+        {"results", j_results}
+    };
+    if (has_latency) {
+        j_out["duration_s"] = params.duration;
+        j_out["warmup_s"] = params.warmup;
+        j_out["pin"] = params.pin;
+    }
+    std::ofstream json_file(params.out + ".json", std::ofstream::trunc);
+    json_file << j_out.dump(4) << std::endl;
+
+    std::ofstream csv_file(params.out + ".csv", std::ofstream::trunc);
+    csv_file << "dataset,index,M,efC,rank,threads,efs,num_rerank,recall,qps,mean_latency_us,pareto";
+    if (has_latency) {
+        csv_file << ",mode,target_qps,dropped";
+        for (double p : latency_percentiles) {
+            csv_file << "," << percentile_name(p) << "_us";
+        }
+        csv_file << ",max_us";
+    }
+    if (has_stats) {
+        for (const char* column : stats_columns) {
+            csv_file << "," << column;
+        }
+    }
+    if (has_timing) {
+        for (int p = 0; p < pecos::ann::SearchTiming::NUM_PHASES; p++) {
+            csv_file << "," << pecos::ann::SearchTiming::phase_name(p) << "_mean_us," << pecos::ann::SearchTiming::phase_name(p) << "_p99_us";
+        }
+    }
+    csv_file << std::endl;
+    for (const auto& r : results) {
+        csv_file << params.data_dir << "," << params.index << "," << params.M << "," << params.efC << ","
+            << (params.index == "finger" ? params.rank : 0) << "," << r.threads << "," << r.efs << ","
+            << r.num_rerank << "," << r.recall << "," << r.qps << "," << r.mean_latency_us << "," << r.pareto;
+        if (has_latency) {
+            csv_file << "," << params.mode << "," << r.target_qps << "," << r.dropped;
+            for (double p : latency_percentiles) {
+                csv_file << "," << r.latency_ns.percentile(p) / 1e3;
+            }
+            csv_file << "," << r.latency_ns.max() / 1e3;
+        }
+        if (has_stats) {
+            for (const char* column : stats_columns) {
+                csv_file << "," << r.search_stats[column].get<double>();
+            }
+        }
+        if (has_timing) {
+            for (int p = 0; p < pecos::ann::SearchTiming::NUM_PHASES; p++) {
+                const auto& j_phase = r.phase_timing[pecos::ann::SearchTiming::phase_name(p)];
+                csv_file << "," << j_phase["mean"].get<double>() << "," << j_phase["p99"].get<double>();
+            }
+        }
+        csv_file << std::endl;
+    }
+}
+
+// Pin the calling thread to the worker-th CPU it is allowed to run on.
+void pin_worker(int worker) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus.push_back(cpu);
+        }
+    }
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    CPU_SET(cpus[worker % cpus.size()], &target);
+    pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+}
+
+// Run worker(w) on num_workers threads and wait for all of them.
+template<class WorkerFunc>
+void run_workers(int num_workers, bool pin, WorkerFunc worker) {
+    std::vector<std::thread> workers;
+    for (int w = 0; w < num_workers; w++) {
+        workers.emplace_back([&, w]() {
+            if (pin) {
+                pin_worker(w);
+            }
+            worker(w);
+        });
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+// Closed loop: num_workers threads each search the queries back to back for warmup + duration seconds.
+// Only the queries issued after the warm-up and completed within the window are recorded.
+// make_query() returns a callable query(i) searching the i-th query with its own Searcher.
+template<class MakeQueryFunc>
+void run_closed_loop(const BenchParams& params, int num_workers, index_type num_queries, MakeQueryFunc make_query, BenchResult& r) {
+    typedef std::chrono::steady_clock clock;
+    std::vector<pecos::LatencyHistogram> histograms(num_workers);
+    std::atomic<uint64_t> next_query(0);
+    auto start = clock::now();
+    auto window_begin = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(params.warmup));
+    auto window_end = window_begin + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(params.duration));
+    run_workers(num_workers, params.pin, [&](int w) {
+        auto query = make_query();
+        auto& histogram = histograms[w];
+        for (auto issued = clock::now(); issued < window_end; ) {
+            query(next_query.fetch_add(1, std::memory_order_relaxed) % num_queries);
+            auto completed = clock::now();
+            if (issued >= window_begin && completed <= window_end) {
+                histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(completed - issued).count());
+            }
+            issued = completed;
+        }
+    });
+    for (const auto& histogram : histograms) {
+        r.latency_ns.merge(histogram);
+    }
+    r.qps = r.latency_ns.count() / params.duration;
+    r.mean_latency_us = r.latency_ns.mean() / 1e3;
+    r.dropped = 0;
+}
+
+// Open loop: queries arrive as a Poisson process at target_qps and wait in a queue served by num_workers
+// threads. The latency of a query runs from its arrival, not from when a worker picked it up, so a
+// saturated index shows up as growing latency instead of a lower arrival rate (no coordinated omission).
+// Arrivals during the warm-up are served but not recorded; arrivals still queued at the end of the window
+// are dropped.
+template<class MakeQueryFunc>
+void run_open_loop(const BenchParams& params, int num_workers, int target_qps, index_type num_queries, MakeQueryFunc make_query, BenchResult& r) {
+    typedef std::chrono::steady_clock clock;
+    std::vector<clock::duration> arrivals;  // offsets from the start
+    std::mt19937_64 rng(target_qps);
+    std::exponential_distribution<double> gap(target_qps);
+    for (double t = gap(rng); t < params.warmup + params.duration; t += gap(rng)) {
+        arrivals.push_back(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(t)));
+    }
+    auto warmup = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(params.warmup));
+    std::vector<pecos::LatencyHistogram> histograms(num_workers);
+    std::atomic<uint64_t> next_arrival(0);
+    std::atomic<uint64_t> served_in_window(0);
+    auto start = clock::now();
+    auto window_end = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(params.warmup + params.duration));
+    run_workers(num_workers, params.pin, [&](int w) {
+        auto query = make_query();
+        auto& histogram = histograms[w];
+        uint64_t served = 0;
+        while (true) {
+            uint64_t k = next_arrival.fetch_add(1, std::memory_order_relaxed);
+            if (k >= arrivals.size()) {
+                break;
+            }
+            auto arrival = start + arrivals[k];
+            std::this_thread::sleep_until(arrival);
+            if (clock::now() >= window_end) {
+                break;
+            }
+            query(k % num_queries);
+            if (arrivals[k] >= warmup) {
+                histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - arrival).count());
+                served += 1;
+            }
+        }
+        served_in_window += served;
+    });
+    for (const auto& histogram : histograms) {
+        r.latency_ns.merge(histogram);
+    }
+    uint64_t arrivals_in_window = arrivals.end() - std::lower_bound(arrivals.begin(), arrivals.end(), warmup);
+    r.target_qps = target_qps;
+    r.qps = served_in_window / params.duration;
+    r.mean_latency_us = r.latency_ns.mean() / 1e3;
+    r.dropped = arrivals_in_window - served_in_window;
+}
+
+// Load the index from cache_dir, building and saving it there first if needed, then run the sweep.
+// train(indexer, X_trn) builds, load(indexer, dir) loads,
+// predict(indexer, X_tst, efs, topk, threads, num_rerank, ret_ids, ret_dists) searches a batch of queries and
+// make_search(indexer) returns a callable search(query, efs, topk, num_rerank) with its own Searcher.
+template<class Indexer, class TrainFunc, class LoadFunc, class PredictFunc, class MakeSearchFunc>
+void run_bench(const BenchParams& params, const std::string& cache_dir, bool uses_rerank, TrainFunc train, LoadFunc load, PredictFunc predict, MakeSearchFunc make_search) {
+    pecos::DenseFile X_tst_file(params.data_dir + "/X.tst.npy");
+    pecos::DenseFile Y_tst_file(params.data_dir + "/Yi.tst.npy");
+    std::vector<float> X_tst_normalized;
+    const pecos::drm_t X_tst = params.space == "angular" ? pecos::normalized_rows(X_tst_file.view(), X_tst_normalized) : X_tst_file.view();
+    if (Y_tst_file.rows() < X_tst.rows) {
+        throw std::invalid_argument("Yi.tst.npy has fewer rows than X.tst.npy");
+    }
+    // read as integers, as float32 would round ids above 2^24
+    const index_type Y_tst_cols = Y_tst_file.cols();
+    std::vector<index_type> Y_tst(Y_tst_file.rows() * Y_tst_cols);
+    Y_tst_file.get_rows(0, Y_tst_file.rows(), Y_tst.data());
+    index_type topk = params.topk > 0 ? std::min<index_type>(params.topk, Y_tst_cols) : Y_tst_cols;
+
+    nlohmann::json build_info;
+    std::string build_info_path = cache_dir + "/build_info.json";
+    std::ifstream build_info_file(build_info_path);
+    Indexer indexer;
+    if (build_info_file.is_open()) {
+        build_info = nlohmann::json::parse(std::string(std::istreambuf_iterator<char>(build_info_file), std::istreambuf_iterator<char>()));
+        build_info["cached"] = true;
+        std::cout << "Using the cached index in " << cache_dir << std::endl;
+    } else {
+        pecos::DenseFile X_trn_file(params.data_dir + "/X.trn.npy");
+        std::vector<float> X_trn_normalized;
+        const pecos::drm_t X_trn = params.space == "angular" ? pecos::normalized_rows(X_trn_file.view(), X_trn_normalized) : X_trn_file.view();
+        auto start_time = std::chrono::steady_clock::now();
+        train(indexer, X_trn);
+        double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        indexer.save(cache_dir);
+        build_info = {
+            {"cache_dir", cache_dir},
+            {"M", params.M},
+            {"efC", params.efC},
+            {"rank", params.index == "finger" ? params.rank : 0},
+            {"sub_dimension", params.index == "pq4" ? params.sub_dimension : 0},
+            {"basis_samples", params.index == "finger" ? params.basis_samples : 0},
+            {"gram_basis", params.index == "finger" && params.gram_basis},
+            {"build_threads", params.build_threads},
+            {"build_time_s", build_time}
+        };
+        // written last, so an interrupted build is not mistaken for a cached index
+        std::ofstream(build_info_path, std::ofstream::trunc) << build_info.dump(4) << std::endl;
+        build_info["cached"] = false;
+        std::cout << "Built the index in " << build_time << " s" << std::endl;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    load(indexer, cache_dir);
+    build_info["load_time_s"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    indexer.set_visited_set_kind(pecos::ann::visited_set_kind_of(params.visited));
+    indexer.set_candidate_queue_kind(pecos::ann::candidate_queue_kind_of(params.queue));
+
+    std::vector<index_type> ret_ids(X_tst.rows * (mem_index_type) topk);
+    std::vector<float> ret_dists(X_tst.rows * (mem_index_type) topk);
+    std::vector<int> rerank_values = uses_rerank ? params.rerank : std::vector<int>{0};
+    // the open loop serves every target rate with the largest thread count
+    std::vector<int> thread_values = params.threads;
+    std::vector<int> rate_values = {0};
+    if (params.mode == "open") {
+        thread_values = {*std::max_element(params.threads.begin(), params.threads.end())};
+        rate_values = params.rates;
+    }
+    std::vector<BenchResult> results;
+    for (int threads : thread_values) {
+        for (int target_qps : rate_values) {
+            for (int num_rerank : rerank_values) {
+                for (int efs : params.efs) {
+                    BenchResult r;
+                    r.threads = threads;
+                    r.efs = efs;
+                    r.num_rerank = num_rerank;
+                    r.target_qps = 0;
+                    r.dropped = 0;
+                    reset_search_stats(indexer);
+                    if (params.mode == "batch") {
+                        double best_time = std::numeric_limits<double>::max();
+                        for (int repeat = 0; repeat < params.repeats; repeat++) {
+                            auto start_time = std::chrono::steady_clock::now();
+                            predict(indexer, X_tst, efs, topk, threads, num_rerank, ret_ids.data(), ret_dists.data());
+                            best_time = std::min(best_time, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+                        }
+                        r.qps = X_tst.rows / best_time;
+                        r.mean_latency_us = best_time * threads / X_tst.rows * 1e6;
+                    } else {
+                        // recall from one batch pass, the load generator only measures time
+                        predict(indexer, X_tst, efs, topk, threads, num_rerank, ret_ids.data(), ret_dists.data());
+                        auto make_query = [&]() {
+                            auto search = make_search(indexer);
+                            return [&X_tst, efs, topk, num_rerank, search](index_type i) mutable {
+                                search(X_tst.get_row(i), efs, topk, num_rerank);
+                            };
+                        };
+                        if (params.mode == "closed") {
+                            run_closed_loop(params, threads, X_tst.rows, make_query, r);
+                        } else {
+                            run_open_loop(params, threads, target_qps, X_tst.rows, make_query, r);
+                        }
+                    }
+                    r.recall = recall_at_k(ret_ids.data(), Y_tst, X_tst.rows, Y_tst_cols, topk);
+                    r.search_stats = get_search_stats(indexer);
+                    r.phase_timing = get_phase_timing(indexer);
+                    results.push_back(r);
+                    std::cout << "threads " << threads << " efs " << efs << " num_rerank " << num_rerank
+                        << " recall " << r.recall << " qps " << r.qps;
+                    if (params.mode != "batch") {
+                        std::cout << " p50_us " << r.latency_ns.percentile(50) / 1e3
+                            << " p99_us " << r.latency_ns.percentile(99) / 1e3;
+                    }
+                    if (!r.search_stats.is_null()) {
+                        std::cout << " prune_ratio " << r.search_stats["prune_ratio"].get<double>()
+                            << " visited_per_query " << r.search_stats["visited_per_query"].get<double>();
+                    }
+                    if (params.mode == "open") {
+                        std::cout << " target_qps " << target_qps << " dropped " << r.dropped;
+                    }
+                    std::cout << std::endl;
+                }
+            }
+        }
+    }
+    mark_pareto(results);
+    write_results(params, build_info, results);
+}
+
+template<class feat_vec_t>
+void run_space(const BenchParams& params) {
+    // a search of the open and closed loops, see run_bench; its Searcher has the visited set of --visited
+    typedef std::function<void(const feat_vec_t&, index_type, index_type, index_type)> search_func_t;
+    std::string fingerprint = dataset_fingerprint(params.data_dir + "/X.trn.npy");
+    char cache_name[1024];
+    // only the options an index is built with key its cache, so that e.g. every --sub-dimension shares the hnsw
+    // index; the finger basis options only appear when set, so that indexes of the default basis keep their name
+    std::string options_key;
+    if (params.index == "pq4") {
+        options_key += "_sub-" + std::to_string(params.sub_dimension);
+    }
+    if (params.index == "finger" && params.basis_samples > 0) {
+        options_key += "_bs-" + std::to_string(params.basis_samples);
+    }
+    if (params.index == "finger" && params.gram_basis) {
+        options_key += "_gram";
+    }
+    snprintf(cache_name, sizeof(cache_name), "%s.%s.M-%d_efC-%d_rank-%d%s.%s",
+        params.index.c_str(), params.space.c_str(), params.M, params.efC,
+        params.index == "finger" ? params.rank : 0, options_key.c_str(), fingerprint.c_str());
+    std::string cache_dir = params.model_dir + "/" + cache_name;
+    pecos::ann::IndexLoadOptions options;
+    options.lazy_load = params.lazy_load;
+    if (params.index == "finger") {
+        pecos::ann::dispatch_finger_rank(params.rank, [&](auto rank) {
+            typedef pecos::ann::HNSWFinger<float, feat_vec_t, decltype(rank)::value> indexer_t;
+            run_bench<indexer_t>(params, cache_dir, true,
+                [&](indexer_t& indexer, const pecos::drm_t& X) {
+                    indexer.train(X, params.M, params.efC, params.sub_dimension, params.basis_samples, params.build_threads, 8, params.gram_basis);
+                },
+                [&](indexer_t& indexer, const std::string& dir) { indexer.load(dir, options); },
+                [&](const indexer_t& indexer, const pecos::drm_t& Q, index_type efs, index_type topk, int threads, index_type num_rerank, index_type* ids, float* dists) {
+                    indexer.predict_batch(Q, efs, topk, threads, ids, dists, num_rerank, params.group_size);
+                },
+                [&](const indexer_t& indexer) {
+                    search_func_t search;
+                    pecos::ann::dispatch_visited_set_kind(indexer.visited_set_kind, [&](auto visited_set) {
+                        auto searcher = indexer.template create_searcher<typename decltype(visited_set)::type>();
+                        searcher.setup_appx_results_containers();
+                        search = [searcher](const feat_vec_t& query, index_type efs, index_type topk, index_type num_rerank) mutable {
+                            searcher.predict_single(query, efs, topk, num_rerank);
+                        };
+                    });
+                    return search;
+                }
+            );
+        });
+    } else if (params.index == "hnsw") {
+        typedef pecos::ann::HNSW<float, feat_vec_t> indexer_t;
+        run_bench<indexer_t>(params, cache_dir, false,
+            [&](indexer_t& indexer, const pecos::drm_t& X) {
+                indexer.train(X, params.M, params.efC, params.build_threads, 8);
+            },
+            [&](indexer_t& indexer, const std::string& dir) { indexer.load(dir, options); },
+            [&](const indexer_t& indexer, const pecos::drm_t& Q, index_type efs, index_type topk, int threads, index_type, index_type* ids, float* dists) {
+                indexer.predict_batch(Q, efs, topk, threads, ids, dists);
+            },
+            [&](const indexer_t& indexer) {
+                search_func_t search;
+                pecos::ann::dispatch_visited_set_kind(indexer.visited_set_kind, [&](auto visited_set) {
+                    auto searcher = indexer.template create_searcher<typename decltype(visited_set)::type>();
+                    search = [searcher](const feat_vec_t& query, index_type efs, index_type topk, index_type) mutable {
+                        searcher.predict_single(query, efs, topk);
+                    };
+                });
+                return search;
+            }
+        );
+    } else if (params.index == "pq4") {
+        typedef pecos::ann::HNSWProductQuantizer4Bits<float, feat_vec_t> indexer_t;
+        run_bench<indexer_t>(params, cache_dir, true,
+            [&](indexer_t& indexer, const pecos::drm_t& X) {
+                indexer.train(X, params.M, params.efC, params.sub_dimension, 200, params.build_threads, 8);
+            },
+            [&](indexer_t& indexer, const std::string& dir) { indexer.load(dir); },
+            [&](const indexer_t& indexer, const pecos::drm_t& Q, index_type efs, index_type topk, int threads, index_type num_rerank, index_type* ids, float* dists) {
+                indexer.predict_batch(Q, efs, topk, threads, ids, dists, num_rerank);
+            },
+            [&](const indexer_t& indexer) {
+                search_func_t search;
+                pecos::ann::dispatch_visited_set_kind(indexer.visited_set_kind, [&](auto visited_set) {
+                    auto searcher = indexer.template create_searcher<typename decltype(visited_set)::type>();
+                    searcher.prepare_inference();
+                    search = [searcher](const feat_vec_t& query, index_type efs, index_type topk, index_type num_rerank) mutable {
+                        searcher.predict_single(query, efs, topk, num_rerank);
+                    };
+                });
+                return search;
+            }
+        );
+    } else {
+        throw std::invalid_argument("Unknown index " + params.index + ", expected finger, hnsw or pq4");
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchParams params(argc, argv);
+    pecos::ann::sss = params.sss;
+    pecos::ann::bbb = params.bbb;
+    if (mkdir(params.model_dir.c_str(), 0777) == -1 && errno != EEXIST) {
+        throw std::runtime_error("Unable to create model folder at " + params.model_dir);
+    }
+    if (params.space == "l2") {
+        run_space<pecos::ann::FeatVecDenseL2Simd<float>>(params);
+    } else {
+        run_space<pecos::ann::FeatVecDenseIPSimd<float>>(params);
+    }
+}
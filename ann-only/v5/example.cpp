@@ -1,8 +1,9 @@
 #include <iostream>
 #include <string>
 #include <unordered_set>
+#include <vector>
 #include "utils/matrix.hpp"
-#include "utils/scipy_loader.hpp"
+#include "utils/dense_loader.hpp"
 #include "ann/hnsw.hpp"
 
 
@@ -27,48 +28,57 @@ public:
 
 int num_rerank;
 int sub_dimension;
+bool lazy_load;
+int basis_samples;  // nodes whose edge residuals learn the Finger basis, 0 for all
+bool gram_basis;
+bool unit_norm;  // angular: search by the inner product of the rows scaled to unit norm
+
+pecos::ann::IndexLoadOptions index_load_options() {
+    pecos::ann::IndexLoadOptions options;
+    options.lazy_load = lazy_load;
+    options.verify_checksums = true;
+    return options;
+}
 using pecos::ann::index_type;
 
 typedef float32_t value_type;
 typedef uint64_t mem_index_type;
-typedef pecos::NpyArray<value_type> scipy_npy_t;
 
 
-auto npy_to_drm = [](scipy_npy_t& X_npy) -> pecos::drm_t {
-    pecos::drm_t X;
-    X.rows = X_npy.shape[0];
-    X.cols = X_npy.shape[1];
-    X.val = X_npy.array.data();
-    return X;
-};
-
-
-template<typename MAT, typename feat_vec_t>
+template<typename MAT, typename feat_vec_t, int finger_rank>
 void run_dense(std::string data_dir , char* model_path, index_type M, index_type efC, index_type max_level, int threads, int efs) {
     // data prepare
-    scipy_npy_t X_trn_npy(data_dir + "/X.trn.npy");
-    scipy_npy_t X_tst_npy(data_dir + "/X.tst.npy");
-    scipy_npy_t Y_tst_npy(data_dir + "/Yi.tst.npy");
-    auto X_trn = npy_to_drm(X_trn_npy);
-    auto X_tst = npy_to_drm(X_tst_npy);
-    auto Y_tst = npy_to_drm(Y_tst_npy);
+    // float32 features are used straight from the mapped files
+    pecos::DenseFile X_trn_file(data_dir + "/X.trn.npy");
+    pecos::DenseFile X_tst_file(data_dir + "/X.tst.npy");
+    pecos::DenseFile Y_tst_file(data_dir + "/Yi.tst.npy");
+    auto X_trn = X_trn_file.view();
+    auto X_tst = X_tst_file.view();
+    std::vector<float> X_trn_normalized, X_tst_normalized;
+    if (unit_norm) {
+        X_trn = pecos::normalized_rows(X_trn, X_trn_normalized);
+        X_tst = pecos::normalized_rows(X_tst, X_tst_normalized);
+    }
+    // ids are read as integers, as float32 would round those above 2^24
+    std::vector<index_type> Y_tst(Y_tst_file.rows() * Y_tst_file.cols());
+    Y_tst_file.get_rows(0, Y_tst_file.rows(), Y_tst.data());
     // model prepare
-    index_type topk = Y_tst.cols;
+    index_type topk = Y_tst_file.cols();
     //pecos::ann::HNSW<float, feat_vec_t> indexer;
-    pecos::ann::HNSWFinger<float, feat_vec_t> indexer;
+    pecos::ann::HNSWFinger<float, feat_vec_t, finger_rank> indexer;
     //pecos::ann::HNSWProductQuantizer4Bits<float, feat_vec_t> indexer;
     std::chrono::steady_clock::time_point start_time;
     std::chrono::steady_clock::time_point end_time;
     start_time=std::chrono::steady_clock::now();
     std::cout<< "step 0" <<std::endl;
     std::cout<< "step 1" <<std::endl;
-    indexer.train(X_trn, M, efC, sub_dimension, 200, threads, max_level);
+    indexer.train(X_trn, M, efC, sub_dimension, basis_samples, threads, max_level, gram_basis);
     end_time=std::chrono::steady_clock::now();
     std::cout<< "training time: " <<(std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count())<<std::endl;
     std::cout<< "After train" <<std::endl;
     indexer.save(model_path);
     std::cout<< "After save" <<std::endl;
-    indexer.load(model_path);
+    indexer.load(model_path, index_load_options());
 
     
     // FILE* fp = fopen(model_path, "rb");
@@ -114,10 +124,10 @@ void run_dense(std::string data_dir , char* model_path, index_type M, index_type
         end_time=std::chrono::steady_clock::now();
         search_time=search_time+std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
         //auto ret_pairs = indexer.predict_single(X_tst.get_row(idx), efs, topk, searcher);
-        std::unordered_set<pecos::csr_t::index_type> true_indices;
+        std::unordered_set<index_type> true_indices;
 
         for (auto k = 0u; k < topk; k++) {
-            true_indices.insert(Y_tst.get_row(idx).val[k]);  // assume Y_tst is ascendingly sorted by distance
+            true_indices.insert(Y_tst[idx * (mem_index_type) topk + k]);  // assume Y_tst is ascendingly sorted by distance
         }
         for (auto dist_idx_pair : ret_pairs) {
             if (true_indices.find(dist_idx_pair.node_id) != true_indices.end()) {
@@ -136,14 +146,22 @@ void run_dense(std::string data_dir , char* model_path, index_type M, index_type
 template<typename MAT, typename feat_vec_t>
 void run_dense_hnsw(std::string data_dir , char* model_path, index_type M, index_type efC, index_type max_level, int threads, int efs) {
     // data prepare
-    scipy_npy_t X_trn_npy(data_dir + "/X.trn.npy");
-    scipy_npy_t X_tst_npy(data_dir + "/X.tst.npy");
-    scipy_npy_t Y_tst_npy(data_dir + "/Yi.tst.npy");
-    auto X_trn = npy_to_drm(X_trn_npy);
-    auto X_tst = npy_to_drm(X_tst_npy);
-    auto Y_tst = npy_to_drm(Y_tst_npy);
+    // float32 features are used straight from the mapped files
+    pecos::DenseFile X_trn_file(data_dir + "/X.trn.npy");
+    pecos::DenseFile X_tst_file(data_dir + "/X.tst.npy");
+    pecos::DenseFile Y_tst_file(data_dir + "/Yi.tst.npy");
+    auto X_trn = X_trn_file.view();
+    auto X_tst = X_tst_file.view();
+    std::vector<float> X_trn_normalized, X_tst_normalized;
+    if (unit_norm) {
+        X_trn = pecos::normalized_rows(X_trn, X_trn_normalized);
+        X_tst = pecos::normalized_rows(X_tst, X_tst_normalized);
+    }
+    // ids are read as integers, as float32 would round those above 2^24
+    std::vector<index_type> Y_tst(Y_tst_file.rows() * Y_tst_file.cols());
+    Y_tst_file.get_rows(0, Y_tst_file.rows(), Y_tst.data());
     // model prepare
-    index_type topk = Y_tst.cols;
+    index_type topk = Y_tst_file.cols();
     pecos::ann::HNSW<float, feat_vec_t> indexer;
     // pecos::ann::HNSWFinger<float, feat_vec_t> indexer;
     //pecos::ann::HNSWProductQuantizer4Bits<float, feat_vec_t> indexer;
@@ -158,7 +176,7 @@ void run_dense_hnsw(std::string data_dir , char* model_path, index_type M, index
     std::cout<< "After train" <<std::endl;
     indexer.save(model_path);
     std::cout<< "After save" <<std::endl;
-    indexer.load(model_path);
+    indexer.load(model_path, index_load_options());
 
     
     // FILE* fp = fopen(model_path, "rb");
@@ -204,10 +222,10 @@ void run_dense_hnsw(std::string data_dir , char* model_path, index_type M, index
         end_time=std::chrono::steady_clock::now();
         search_time=search_time+std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
         //auto ret_pairs = indexer.predict_single(X_tst.get_row(idx), efs, topk, searcher);
-        std::unordered_set<pecos::csr_t::index_type> true_indices;
+        std::unordered_set<index_type> true_indices;
 
         for (auto k = 0u; k < topk; k++) {
-            true_indices.insert(Y_tst.get_row(idx).val[k]);  // assume Y_tst is ascendingly sorted by distance
+            true_indices.insert(Y_tst[idx * (mem_index_type) topk + k]);  // assume Y_tst is ascendingly sorted by distance
         }
         for (auto dist_idx_pair : ret_pairs) {
             if (true_indices.find(dist_idx_pair.node_id) != true_indices.end()) {
@@ -228,20 +246,29 @@ int main(int argc, char** argv) {
     std::string space_name = argv[3];
     index_type M = (index_type) atoi(argv[4]);
     index_type efC = (index_type) atoi(argv[5]);
-    int threads = 1;
+    int threads = atoi(argv[6]);
     int efs = atoi(argv[7]);
     num_rerank = atoi(argv[8]);
     sub_dimension = atoi(argv[9]);
     pecos::ann::sss = atof(argv[10]);
     pecos::ann::bbb = atof(argv[11]);
     int type = atoi(argv[12]);
+    // rank of the Finger residual basis: 32, 64, 128 (default) or 256
+    int finger_rank = argc > 13 ? atoi(argv[13]) : 128;
+    // 1 memory-maps the saved index instead of reading it back
+    lazy_load = argc > 14 ? atoi(argv[14]) != 0 : false;
+    // Finger basis: number of sampled nodes (0 for all), and 1 for BDCSVD instead of the Gram eigenvectors
+    basis_samples = argc > 15 ? atoi(argv[15]) : 0;
+    gram_basis = argc > 16 ? atoi(argv[16]) != 0 : false;
     index_type max_level = 8;
     char model_path[2048];
     sprintf(model_path, "%s/pecos.%s.M-%d_efC-%d_t-%d.bin", model_dir.c_str(), space_name.c_str(), M, efC, threads);
     if (space_name.compare("l2") == 0) {
         if (type==0){
             std::cout<< "HNSW-FINGER" <<std::endl;
-            run_dense<pecos::drm_t, pecos::ann::FeatVecDenseL2Simd<float>>(data_dir, model_path, M, efC, max_level, threads, efs);
+            pecos::ann::dispatch_finger_rank(finger_rank, [&](auto rank) {
+                run_dense<pecos::drm_t, pecos::ann::FeatVecDenseL2Simd<float>, decltype(rank)::value>(data_dir, model_path, M, efC, max_level, threads, efs);
+            });
             // std::cout<< "HNSW" <<std::endl;
             // run_dense_hnsw<pecos::drm_t, pecos::ann::FeatVecDenseL2Simd<float>>(data_dir, model_path, M, efC, max_level, threads, efs);
         }
@@ -251,8 +278,18 @@ int main(int argc, char** argv) {
         }
         
     }
-    if (space_name.compare("angular") == 0) {
-        run_dense<pecos::drm_t, pecos::ann::FeatVecDenseL2Simd<float>>(data_dir, model_path, M, efC, max_level, threads, efs);
+    if (space_name.compare("ip") == 0 || space_name.compare("angular") == 0) {
+        unit_norm = space_name.compare("angular") == 0;
+        if (type==0){
+            std::cout<< "HNSW-FINGER" <<std::endl;
+            pecos::ann::dispatch_finger_rank(finger_rank, [&](auto rank) {
+                run_dense<pecos::drm_t, pecos::ann::FeatVecDenseIPSimd<float>, decltype(rank)::value>(data_dir, model_path, M, efC, max_level, threads, efs);
+            });
+        }
+        else {
+            std::cout<< "HNSW" <<std::endl;
+            run_dense_hnsw<pecos::drm_t, pecos::ann::FeatVecDenseIPSimd<float>>(data_dir, model_path, M, efC, max_level, threads, efs);
+        }
     }
     
 }
@@ -0,0 +1,77 @@
+// Exact k nearest neighbors of the test queries, for the recall of example.cpp and bench.cpp.
+//
+//   ./groundtruth --data DIR [--topk 100] [--metric l2|ip|angular] [--threads 0] [--chunk-rows 16384]
+//                 [--base DIR/X.trn.npy] [--queries DIR/X.tst.npy]
+//                 [--out-ids DIR/Yi.tst.npy] [--out-dists DIR/Yd.tst.npy]
+//
+// The base and query files are NPY, fvecs or bvecs (see pecos::DenseFile). The base vectors are streamed in
+// chunks of --chunk-rows rows, so they need not fit in memory. Yi.tst.npy gets the int32 ids and Yd.tst.npy
+// the float32 distances of the neighbors of every query, both queries x topk and sorted by distance.
+// The sgemm threads of OpenBLAS are set with OPENBLAS_NUM_THREADS.
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utils/matrix.hpp"
+#include "utils/dense_loader.hpp"
+#include "utils/scipy_loader.hpp"
+#include "ann/brute_force.hpp"
+
+using pecos::ann::index_type;
+
+int main(int argc, char** argv) {
+    std::map<std::string, std::string> args = {
+        {"topk", "100"},
+        {"metric", "l2"},
+        {"threads", "0"},
+        {"chunk-rows", "16384"}
+    };
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::string(argv[i]).compare(0, 2, "--") != 0) {
+            throw std::invalid_argument(std::string("Expected --name value, got ") + argv[i]);
+        }
+        args[argv[i] + 2] = argv[i + 1];
+    }
+    for (const auto& arg : args) {
+        static const char* names[] = {"data", "base", "queries", "out-ids", "out-dists", "topk", "metric", "threads", "chunk-rows"};
+        if (std::find(std::begin(names), std::end(names), arg.first) == std::end(names)) {
+            throw std::invalid_argument("Unknown option --" + arg.first);
+        }
+    }
+    const std::string data_dir = args.count("data") ? args["data"] : ".";
+    auto path_of = [&](const std::string& name, const std::string& file_name) {
+        return args.count(name) ? args[name] : data_dir + "/" + file_name;
+    };
+    std::string base_path = path_of("base", "X.trn.npy");
+    std::string queries_path = path_of("queries", "X.tst.npy");
+    std::string ids_path = path_of("out-ids", "Yi.tst.npy");
+    std::string dists_path = path_of("out-dists", "Yd.tst.npy");
+    index_type topk = std::stoi(args["topk"]);
+    auto metric = pecos::ann::knn_metric_of(args["metric"]);
+    int threads = std::stoi(args["threads"]);
+    uint64_t chunk_rows = std::stoull(args["chunk-rows"]);
+
+    pecos::DenseFile base(base_path, pecos::mmap_util::MmapAdvice::sequential);
+    pecos::DenseFile queries_file(queries_path);
+    const pecos::drm_t& queries = queries_file.view();
+    std::cout << "base " << base.rows() << " x " << base.cols() << ", queries " << queries.rows << " x " << queries.cols << std::endl;
+
+    std::vector<index_type> ids(queries.rows * (uint64_t) topk);
+    std::vector<float> dists(queries.rows * (uint64_t) topk);
+    auto start_time = std::chrono::steady_clock::now();
+    pecos::ann::exact_knn(queries, base, topk, metric, ids.data(), dists.data(), threads, chunk_rows);
+    double search_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << "exact " << topk << "-NN of " << queries.rows << " queries in " << search_time << " s" << std::endl;
+
+    std::vector<uint64_t> shape = {queries.rows, topk};
+    pecos::NpyArray<int32_t> Y_ids(shape);
+    std::copy(ids.begin(), ids.end(), Y_ids.array.begin());
+    Y_ids.save(ids_path);
+    pecos::NpyArray<float> Y_dists(shape);
+    std::copy(dists.begin(), dists.end(), Y_dists.array.begin());
+    Y_dists.save(dists_path);
+    std::cout << "Saved " << ids_path << " and " << dists_path << std::endl;
+}
@@ -0,0 +1,10 @@
+#!/bin/bash
+#SBATCH -t 40:00:00
+#SBATCH -A PAS2671
+cd ..
+data=[data]
+M=[M]
+EFC=[EFC]
+
+# one build (cached in the dataset folder) for the whole efS curve
+/usr/bin/time -v ./bench --data /users/PAS2671/kabir36/kabir/similarity-search/dataset/${data} --model-dir /users/PAS2671/kabir36/kabir/similarity-search/dataset/${data} --M ${M} --efC ${EFC} --efs 10,20,30,40,50,60,80,100,150,200,300,400 --threads 1 --out finalLogs/${data}-${M}-${EFC} &> finalLogs/${data}-${M}-${EFC}.log
@@ -0,0 +1,330 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"). You may not use this file except in compliance
+ * with the License. A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0/
+ *
+ * or in the "license" file accompanying this file. This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES
+ * OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions
+ * and limitations under the License.
+ */
+
+#ifndef __DENSE_LOADER_H__
+#define __DENSE_LOADER_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "utils/file_util.hpp"
+#include "utils/matrix.hpp"
+#include "utils/mmap_util.hpp"
+#include "utils/scipy_loader.hpp"
+
+namespace pecos {
+
+// On-disk formats of dense matrices:
+//   npy: a 2-D C-ordered NPY array of any numeric dtype in native byte order
+//   fvecs, bvecs, ivecs: the SIFT/GIST/BigANN formats, where each row is its int32 dimension followed by
+//   that many float32, uint8 or int32 values
+enum class DenseFileFormat { npy, fvecs, bvecs, ivecs };
+
+// A dense matrix file that is memory-mapped instead of read into memory. Any range of rows can be copied
+// out as float32, and the rows can be streamed in chunks, so files larger than RAM can be processed.
+// A float32 NPY file is also exposed as a drm_t pointing straight into the (read-only) mapping.
+class DenseFile {
+public:
+    typedef drm_t::value_type value_type;
+
+    DenseFile(const std::string& path, mmap_util::MmapAdvice advice=mmap_util::MmapAdvice::normal) :
+        DenseFile(path, format_of(path), advice) {}
+
+    DenseFile(const std::string& path, DenseFileFormat format, mmap_util::MmapAdvice advice=mmap_util::MmapAdvice::normal) :
+        format_(format), file_(std::make_shared<const mmap_util::MmapFile>(path, advice)) {
+        whole_.rows = 0;
+        whole_.cols = 0;
+        whole_.val = nullptr;
+        if (format == DenseFileFormat::npy) {
+            init_npy(path);
+        } else {
+            init_vecs();
+        }
+    }
+
+    DenseFile(const DenseFile&) = delete;
+    DenseFile& operator=(const DenseFile&) = delete;
+
+    // format from the extension of path; npy unless it ends with .fvecs, .bvecs or .ivecs
+    static DenseFileFormat format_of(const std::string& path) {
+        auto ends_with = [&](const std::string& suffix) {
+            return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+        };
+        if (ends_with(".fvecs")) {
+            return DenseFileFormat::fvecs;
+        } else if (ends_with(".bvecs")) {
+            return DenseFileFormat::bvecs;
+        } else if (ends_with(".ivecs")) {
+            return DenseFileFormat::ivecs;
+        }
+        return DenseFileFormat::npy;
+    }
+
+    uint64_t rows() const { return rows_; }
+    uint64_t cols() const { return cols_; }
+
+    // whether rows are float32 and contiguous in the file, so that view() and chunks() do not copy
+    bool is_zero_copy() const { return elem_type_ == "f4" && row_stride_ == cols_ * sizeof(value_type); }
+
+    // The whole matrix. It points into the mapping if is_zero_copy(), and into a float32 copy made by the
+    // first call otherwise. The mapping is read-only, so the values must not be modified.
+    const drm_t& view() {
+        if (whole_.val == nullptr) {
+            check_rows(rows_);
+            whole_.rows = rows_;
+            whole_.cols = cols_;
+            if (is_zero_copy()) {
+                whole_.val = const_cast<value_type*>(reinterpret_cast<const value_type*>(row_ptr(0)));
+            } else {
+                copy_.resize(rows_ * cols_);
+                const uint64_t block_rows = 4096;
+                int64_t num_blocks = (rows_ + block_rows - 1) / block_rows;
+#pragma omp parallel for schedule(dynamic, 1)
+                for (int64_t b = 0; b < num_blocks; b++) {
+                    uint64_t row_begin = b * block_rows;
+                    uint64_t num_rows = std::min(block_rows, rows_ - row_begin);
+                    get_rows(row_begin, num_rows, &copy_[row_begin * cols_]);
+                }
+                whole_.val = copy_.data();
+            }
+        }
+        return whole_;
+    }
+
+    // copy rows [row_begin, row_begin + num_rows) into dst, which holds num_rows x cols() values, converted to
+    // Dst: float32 by default, or an integer type to read ids exactly (float32 rounds integers above 2^24)
+    template<class Dst=value_type>
+    void get_rows(uint64_t row_begin, uint64_t num_rows, Dst* dst) const {
+        if (row_begin > rows_ || num_rows > rows_ - row_begin) {
+            throw std::out_of_range("Rows beyond the end of " + file_->path());
+        }
+        for (uint64_t i = 0; i < num_rows; i++) {
+            const char* src = row_ptr(row_begin + i);
+            if (format_ != DenseFileFormat::npy) {
+                int32_t dim;
+                memcpy(&dim, src - sizeof(int32_t), sizeof(dim));
+                if (dim < 0 || (uint64_t) dim != cols_) {
+                    throw std::runtime_error("Rows of different dimensions in " + file_->path());
+                }
+            }
+            convert_row(src, dst + i * cols_);
+        }
+    }
+
+    // Consecutive chunks of at most chunk_rows rows:
+    //   for (auto it = file.chunks(chunk_rows); it.next(); ) { use it.chunk(), whose first row is it.row_begin() }
+    // A chunk points into the mapping if is_zero_copy(), and into a buffer of the iterator otherwise.
+    class ChunkIterator {
+    public:
+        ChunkIterator(const DenseFile* file, uint64_t chunk_rows) :
+            file_(file), chunk_rows_(std::max<uint64_t>(chunk_rows, 1)), row_begin_(0), row_end_(0) {
+            check_rows(chunk_rows_);
+            chunk_.rows = 0;
+            chunk_.cols = file->cols();
+            chunk_.val = nullptr;
+        }
+
+        // advance to the next chunk; false after the last one
+        bool next() {
+            row_begin_ = row_end_;
+            if (row_begin_ >= file_->rows()) {
+                return false;
+            }
+            row_end_ = std::min(file_->rows(), row_begin_ + chunk_rows_);
+            chunk_.rows = row_end_ - row_begin_;
+            if (file_->is_zero_copy()) {
+                chunk_.val = const_cast<value_type*>(reinterpret_cast<const value_type*>(file_->row_ptr(row_begin_)));
+            } else {
+                buffer_.resize(chunk_.rows * file_->cols());
+                file_->get_rows(row_begin_, chunk_.rows, buffer_.data());
+                chunk_.val = buffer_.data();
+            }
+            return true;
+        }
+
+        const drm_t& chunk() const { return chunk_; }
+        uint64_t row_begin() const { return row_begin_; }
+
+    private:
+        const DenseFile* file_;
+        uint64_t chunk_rows_;
+        uint64_t row_begin_;
+        uint64_t row_end_;
+        drm_t chunk_;
+        std::vector<value_type> buffer_;
+    };
+
+    ChunkIterator chunks(uint64_t chunk_rows) const {
+        return ChunkIterator(this, chunk_rows);
+    }
+
+private:
+    void init_npy(const std::string& path) {
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            throw std::runtime_error("Unable to open " + path);
+        }
+        NpyHeader header;
+        try {
+            header.load(fp);
+        } catch (...) {
+            fclose(fp);
+            throw;
+        }
+        fclose(fp);
+        if (header.shape.size() != 2 || header.fortran_order) {
+            throw std::runtime_error("Only 2-D C-ordered NPY arrays can be mapped: " + path);
+        }
+        if (pecos::file_util::different_from_runtime(header.endian_code)) {
+            throw std::runtime_error("Only NPY arrays in native byte order can be mapped: " + path);
+        }
+        elem_type_ = header.dtype.substr(1);
+        elem_size_ = header.word_size;
+        rows_ = header.shape[0];
+        cols_ = header.shape[1];
+        row_stride_ = cols_ * elem_size_;
+        data_offset_ = header.data_offset;
+        check_elem_type();
+        if (data_offset_ + rows_ * row_stride_ > file_->size()) {
+            throw std::runtime_error("Truncated NPY file " + path);
+        }
+    }
+
+    void init_vecs() {
+        static const char* elem_types[] = {"", "f4", "u1", "i4"};
+        elem_type_ = elem_types[static_cast<int>(format_)];
+        elem_size_ = (format_ == DenseFileFormat::bvecs) ? 1 : 4;
+        int32_t dim;
+        if (file_->size() < sizeof(dim)) {
+            throw std::runtime_error("Truncated file " + file_->path());
+        }
+        memcpy(&dim, file_->data(), sizeof(dim));
+        if (dim <= 0) {
+            throw std::runtime_error("Invalid dimension in " + file_->path());
+        }
+        cols_ = dim;
+        row_stride_ = sizeof(int32_t) + cols_ * elem_size_;
+        if (file_->size() % row_stride_ != 0) {
+            throw std::runtime_error("Truncated file or rows of different dimensions in " + file_->path());
+        }
+        rows_ = file_->size() / row_stride_;
+        // every row starts after its dimension
+        data_offset_ = sizeof(int32_t);
+        check_elem_type();
+    }
+
+    void check_elem_type() const {
+        static const char* supported[] = {"f4", "f8", "i1", "i2", "i4", "i8", "u1", "u2", "u4", "u8", "b1"};
+        for (const char* type : supported) {
+            if (elem_type_ == type) {
+                return;
+            }
+        }
+        throw std::runtime_error("Unsupported dtype " + elem_type_ + " in " + file_->path());
+    }
+
+    static void check_rows(uint64_t num_rows) {
+        if (num_rows > std::numeric_limits<drm_t::index_type>::max()) {
+            throw std::runtime_error("Too many rows for a drm_t");
+        }
+    }
+
+    const char* row_ptr(uint64_t row) const {
+        return file_->data() + data_offset_ + row * row_stride_;
+    }
+
+    template<class T, class Dst>
+    void convert_row_from(const char* src, Dst* dst) const {
+        for (uint64_t j = 0; j < cols_; j++) {
+            T x;
+            memcpy(&x, src + j * sizeof(T), sizeof(T));
+            dst[j] = static_cast<Dst>(x);
+        }
+    }
+
+    template<class Dst>
+    void convert_row(const char* src, Dst* dst) const {
+        if (elem_type_ == "f4" && std::is_same<Dst, value_type>::value) {
+            memcpy(dst, src, cols_ * sizeof(value_type));
+        } else if (elem_type_ == "f4") {
+            convert_row_from<float>(src, dst);
+        } else if (elem_type_ == "f8") {
+            convert_row_from<double>(src, dst);
+        } else if (elem_type_ == "i1") {
+            convert_row_from<int8_t>(src, dst);
+        } else if (elem_type_ == "i2") {
+            convert_row_from<int16_t>(src, dst);
+        } else if (elem_type_ == "i4") {
+            convert_row_from<int32_t>(src, dst);
+        } else if (elem_type_ == "i8") {
+            convert_row_from<int64_t>(src, dst);
+        } else if (elem_type_ == "u1" || elem_type_ == "b1") {
+            convert_row_from<uint8_t>(src, dst);
+        } else if (elem_type_ == "u2") {
+            convert_row_from<uint16_t>(src, dst);
+        } else if (elem_type_ == "u4") {
+            convert_row_from<uint32_t>(src, dst);
+        } else if (elem_type_ == "u8") {
+            convert_row_from<uint64_t>(src, dst);
+        }
+    }
+
+    DenseFileFormat format_;
+    std::shared_ptr<const mmap_util::MmapFile> file_;
+    std::string elem_type_;  // NPY type code of the values, e.g. "f4"
+    uint64_t elem_size_;
+    uint64_t rows_;
+    uint64_t cols_;
+    uint64_t row_stride_;    // bytes from one row to the next
+    uint64_t data_offset_;   // file offset of the values of row 0
+    drm_t whole_;
+    std::vector<value_type> copy_;
+};
+
+// Copy of X in buffer with every nonzero row scaled to unit L2 norm, e.g. to search by cosine similarity
+// with the inner product of FeatVecDenseIPSimd. The returned matrix points into buffer.
+inline drm_t normalized_rows(const drm_t& X, std::vector<drm_t::value_type>& buffer) {
+    const uint64_t cols = X.cols;
+    buffer.assign(X.val, X.val + (uint64_t) X.rows * cols);
+#pragma omp parallel for schedule(static)
+    for (int64_t i = 0; i < (int64_t) X.rows; i++) {
+        drm_t::value_type* row = &buffer[i * cols];
+        double sq_norm = 0;
+        for (uint64_t j = 0; j < cols; j++) {
+            sq_norm += (double) row[j] * row[j];
+        }
+        if (sq_norm > 0) {
+            drm_t::value_type inv_norm = (drm_t::value_type) (1.0 / std::sqrt(sq_norm));
+            for (uint64_t j = 0; j < cols; j++) {
+                row[j] *= inv_norm;
+            }
+        }
+    }
+    drm_t ret;
+    ret.rows = X.rows;
+    ret.cols = X.cols;
+    ret.val = buffer.data();
+    return ret;
+}
+
+} // end namespace pecos
+
+#endif  // end of __DENSE_LOADER_H__
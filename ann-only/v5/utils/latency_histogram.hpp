@@ -0,0 +1,109 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"). You may not use this file except in compliance
+ * with the License. A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0/
+ *
+ * or in the "license" file accompanying this file. This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES
+ * OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions
+ * and limitations under the License.
+ */
+
+#ifndef __LATENCY_HISTOGRAM_H__
+#define __LATENCY_HISTOGRAM_H__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace pecos {
+
+// Log-linear histogram of non-negative integers, such as latencies in nanoseconds, in the style of
+// HdrHistogram: a value is bucketed by its highest set bit and then linearly by the next sub_bucket_bits - 1
+// bits. Percentiles are thus within a relative error of 2^-(sub_bucket_bits - 1) over the whole 64-bit range,
+// recording is a few instructions, and histograms of different threads are merged by adding counts.
+class LatencyHistogram {
+public:
+    static const int sub_bucket_bits = 8;
+
+    LatencyHistogram() :
+        counts_((66 - sub_bucket_bits) << (sub_bucket_bits - 1), 0),
+        count_(0), sum_(0), min_(std::numeric_limits<uint64_t>::max()), max_(0) {}
+
+    void record(uint64_t value) {
+        counts_[bucket_of(value)] += 1;
+        count_ += 1;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts_.size(); i++) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    void clear() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = 0;
+        sum_ = 0;
+        min_ = std::numeric_limits<uint64_t>::max();
+        max_ = 0;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return count_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? (double) sum_ / count_ : 0.0; }
+
+    // smallest recorded value (up to the bucket resolution) that is >= p percent of the values
+    uint64_t percentile(double p) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t target = std::max<uint64_t>(1, (uint64_t) std::ceil(p / 100.0 * count_));
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            cumulative += counts_[i];
+            if (cumulative >= target) {
+                return std::min(max_, std::max(min_, value_of(i)));
+            }
+        }
+        return max_;
+    }
+
+private:
+    static const uint64_t half_ = 1ULL << (sub_bucket_bits - 1);
+
+    static size_t bucket_of(uint64_t value) {
+        int msb = value ? 63 - __builtin_clzll(value) : 0;
+        int shift = std::max(0, msb - (sub_bucket_bits - 1));
+        return shift * half_ + (value >> shift);
+    }
+
+    // middle of the range of values in bucket i
+    static uint64_t value_of(size_t i) {
+        int shift = std::max<int>(0, (int) (i / half_) - 1);
+        uint64_t low = (i - shift * half_) << shift;
+        return low + ((1ULL << shift) - 1) / 2;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+};
+
+} // end namespace pecos
+
+#endif  // end of __LATENCY_HISTOGRAM_H__
@@ -588,6 +588,9 @@ namespace pecos {
 
         double dcopy_(ptrdiff_t *, double *, ptrdiff_t *, double *, ptrdiff_t *);
         float scopy_(ptrdiff_t *, float *, ptrdiff_t *, float *, ptrdiff_t *);
+
+        ptrdiff_t dgemm_(char *, char *, ptrdiff_t *, ptrdiff_t *, ptrdiff_t *, double *, double *, ptrdiff_t *, double *, ptrdiff_t *, double *, double *, ptrdiff_t *);
+        ptrdiff_t sgemm_(char *, char *, ptrdiff_t *, ptrdiff_t *, ptrdiff_t *, float *, float *, ptrdiff_t *, float *, ptrdiff_t *, float *, float *, ptrdiff_t *);
     }
 
     template<typename val_type> val_type dot(ptrdiff_t *, val_type *, ptrdiff_t *, val_type *, ptrdiff_t *);
@@ -606,6 +609,11 @@ namespace pecos {
     template<> inline double copy(ptrdiff_t *len, double *x, ptrdiff_t *xinc, double *y, ptrdiff_t *yinc) { return dcopy_(len,x,xinc,y,yinc); }
     template<> inline float copy(ptrdiff_t *len, float *x, ptrdiff_t *xinc, float *y, ptrdiff_t *yinc) { return scopy_(len,x,xinc,y,yinc); }
 
+    // column-majored C = alpha * op(A) * op(B) + beta * C, as in Fortran BLAS
+    template<typename val_type> ptrdiff_t gemm(char *, char *, ptrdiff_t *, ptrdiff_t *, ptrdiff_t *, val_type *, val_type *, ptrdiff_t *, val_type *, ptrdiff_t *, val_type *, val_type *, ptrdiff_t *);
+    template<> inline ptrdiff_t gemm(char *transa, char *transb, ptrdiff_t *m, ptrdiff_t *n, ptrdiff_t *k, double *alpha, double *a, ptrdiff_t *lda, double *b, ptrdiff_t *ldb, double *beta, double *c, ptrdiff_t *ldc) { return dgemm_(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc); }
+    template<> inline ptrdiff_t gemm(char *transa, char *transb, ptrdiff_t *m, ptrdiff_t *n, ptrdiff_t *k, float *alpha, float *a, ptrdiff_t *lda, float *b, ptrdiff_t *ldb, float *beta, float *c, ptrdiff_t *ldc) { return sgemm_(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc); }
+
     // ===== do_dot_product =====
     template<typename val_type>
     val_type do_dot_product(const val_type *x, const val_type *y, size_t size) {
@@ -617,6 +625,19 @@ namespace pecos {
         return dot(&len, xx, &inc, yy, &inc);
     }
 
+    // ===== do_matmul_abt =====
+    // Row-majored C = A * B^T, where A is rows_a x size, B is rows_b x size, and row i of C
+    // starts at c + i * ldc. The rows of A and C may be strided (lda, ldc >= size, rows_b).
+    template<typename val_type>
+    void do_matmul_abt(const val_type *a, size_t rows_a, size_t lda, const val_type *b, size_t rows_b, size_t size, val_type *c, size_t ldc) {
+        // row-majored A * B^T is column-majored (B^T)^T * A^T = op(B) * A with op = transpose
+        char transa = 'T', transb = 'N';
+        ptrdiff_t m = (ptrdiff_t) rows_b, n = (ptrdiff_t) rows_a, k = (ptrdiff_t) size;
+        ptrdiff_t ld_b = (ptrdiff_t) size, ld_a = (ptrdiff_t) lda, ld_c = (ptrdiff_t) ldc;
+        val_type alpha = 1, beta = 0;
+        gemm(&transa, &transb, &m, &n, &k, &alpha, const_cast<val_type*>(b), &ld_b, const_cast<val_type*>(a), &ld_a, &beta, c, &ld_c);
+    }
+
     template<class IX, class VX, class IY, class VY>
     float32_t do_dot_product(const sparse_vec_t<IX, VX>& x, const sparse_vec_t<IY, VY>& y) {
         // This function assume that nz entries in both x and y are stored in an
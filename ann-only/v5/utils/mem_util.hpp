@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"). You may not use this file except in compliance
+ * with the License. A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0/
+ *
+ * or in the "license" file accompanying this file. This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES
+ * OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions
+ * and limitations under the License.
+ */
+
+#ifndef __MEM_UTIL_H__
+#define __MEM_UTIL_H__
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace pecos {
+
+namespace mem_util {
+
+// read a "<key>: <value> kB" entry of /proc/self/status, return 0 if it is not available
+static size_t proc_status_kb(const char* key) {
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp == nullptr) {
+        return 0;
+    }
+    size_t value = 0;
+    size_t key_len = strlen(key);
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != nullptr) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            sscanf(line + key_len + 1, "%zu", &value);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+// resident set size of the process in kB
+static size_t current_rss_kb() { return proc_status_kb("VmRSS"); }
+
+// high-water mark of the resident set size in kB, since process start or the last reset_peak_rss()
+static size_t peak_rss_kb() { return proc_status_kb("VmHWM"); }
+
+// reset the high-water mark to the current resident set size (Linux >= 4.0), return false if unsupported
+static bool reset_peak_rss() {
+    FILE* fp = fopen("/proc/self/clear_refs", "w");
+    if (fp == nullptr) {
+        return false;
+    }
+    bool ok = (fputs("5", fp) >= 0);
+    return (fclose(fp) == 0) && ok;
+}
+
+// print the current and peak RSS of a finished stage, then start tracking the peak of the next stage
+static void report_stage(const std::string& stage) {
+    std::cout << "[mem] " << stage
+        << " : peak_rss=" << (peak_rss_kb() >> 10) << "MB"
+        << " current_rss=" << (current_rss_kb() >> 10) << "MB" << std::endl;
+    reset_peak_rss();
+}
+
+} // end namespace mem_util
+
+} // end namespace pecos
+
+#endif  // end of __MEM_UTIL_H__
@@ -0,0 +1,611 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"). You may not use this file except in compliance
+ * with the License. A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0/
+ *
+ * or in the "license" file accompanying this file. This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES
+ * OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions
+ * and limitations under the License.
+ */
+
+#ifndef __MMAP_UTIL_H__
+#define __MMAP_UTIL_H__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <omp.h>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils/file_util.hpp"
+
+namespace pecos {
+
+namespace mmap_util {
+
+// arrays of index files saved for memory-mapped loading start at a multiple of this file offset,
+// so every array begins on its own page and can be advised or prefetched on its own
+static const size_t section_alignment = 4096;
+
+// how the pages of a memory-mapped index are brought in
+enum class MmapAdvice {
+    normal,      // faulted in on first access, with the kernel's default readahead
+    random,      // faulted in on first access without readahead (MADV_RANDOM), for indexes larger than RAM
+    sequential,  // faulted in on first access with aggressive readahead (MADV_SEQUENTIAL), for streaming a file
+    willneed,    // read ahead asynchronously right after mapping (MADV_WILLNEED)
+    populate,    // read in completely before load() returns (MAP_POPULATE)
+};
+
+// A read-only shared mapping of a whole file. Pages come from the page cache, so several
+// processes serving the same index file on one host share a single copy of it in memory.
+class MmapFile {
+public:
+    MmapFile(const std::string& path, MmapAdvice advice=MmapAdvice::normal) : path_(path), data_(nullptr), size_(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("Unable to open " + path + " for mapping: " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size == 0) {
+            close(fd);
+            throw std::runtime_error("Unable to map empty or unreadable file " + path);
+        }
+        size_ = st.st_size;
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if (advice == MmapAdvice::populate) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        void* ptr = mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) {
+            throw std::runtime_error("Unable to map " + path + ": " + strerror(errno));
+        }
+        data_ = reinterpret_cast<const char*>(ptr);
+        if (advice == MmapAdvice::random) {
+            madvise(ptr, size_, MADV_RANDOM);
+        } else if (advice == MmapAdvice::sequential) {
+            madvise(ptr, size_, MADV_SEQUENTIAL);
+        } else if (advice == MmapAdvice::willneed) {
+            madvise(ptr, size_, MADV_WILLNEED);
+        }
+    }
+
+    ~MmapFile() {
+        munmap(const_cast<char*>(data_), size_);
+    }
+
+    MmapFile(const MmapFile&) = delete;
+    MmapFile& operator=(const MmapFile&) = delete;
+
+    const std::string& path() const { return path_; }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    std::string path_;
+    const char* data_;
+    size_t size_;
+};
+
+// A std::vector-like array that either owns its elements or is a read-only view into a MmapFile,
+// which it keeps mapped. Const access is the same in both cases. A view is read-only: non-const
+// access, resize() and swap() assert that the array is owned, and a caller that has to modify a
+// memory-mapped array copies it into owned memory with detach() first. assign() and clear() drop
+// a view without copying it.
+template<class T>
+class MmapableVector {
+public:
+    typedef T value_type;
+
+    MmapableVector() : ptr_(nullptr), size_(0) {}
+
+    MmapableVector(const MmapableVector& other) : store_(other.store_), mapping_(other.mapping_), size_(other.size_) {
+        ptr_ = mapping_ ? other.ptr_ : store_.data();
+    }
+
+    MmapableVector(MmapableVector&& other) : store_(std::move(other.store_)), mapping_(std::move(other.mapping_)), size_(other.size_) {
+        ptr_ = mapping_ ? other.ptr_ : store_.data();
+        other.ptr_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MmapableVector& operator=(MmapableVector other) {
+        store_.swap(other.store_);
+        mapping_.swap(other.mapping_);
+        std::swap(ptr_, other.ptr_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool is_mapped() const { return mapping_ != nullptr; }
+
+    const T* data() const { return ptr_; }
+    T* data() { assert(!mapping_); return ptr_; }
+
+    const T& operator[](size_t i) const { return ptr_[i]; }
+    T& operator[](size_t i) { assert(!mapping_); return ptr_[i]; }
+
+    const T* begin() const { return ptr_; }
+    const T* end() const { return ptr_ + size_; }
+    T* begin() { assert(!mapping_); return ptr_; }
+    T* end() { assert(!mapping_); return ptr_ + size_; }
+
+    void resize(size_t n, const T& value=T()) {
+        assert(!mapping_);
+        store_.resize(n, value);
+        sync();
+    }
+
+    void assign(size_t n, const T& value) {
+        mapping_.reset();
+        store_.assign(n, value);
+        sync();
+    }
+
+    void clear() {
+        mapping_.reset();
+        std::vector<T>().swap(store_);
+        sync();
+    }
+
+    // exchange the elements with an owned std::vector
+    void swap(std::vector<T>& other) {
+        assert(!mapping_);
+        store_.swap(other);
+        sync();
+    }
+
+    // point at num elements of a mapping instead of owning them
+    void map(const std::shared_ptr<const MmapFile>& file, const T* ptr, size_t num) {
+        std::vector<T>().swap(store_);
+        mapping_ = file;
+        ptr_ = const_cast<T*>(ptr);
+        size_ = num;
+    }
+
+    // copy a view into owned memory, so that it can be modified
+    void detach() {
+        if (mapping_) {
+            store_.assign(ptr_, ptr_ + size_);
+            mapping_.reset();
+            sync();
+        }
+    }
+
+private:
+    void sync() {
+        ptr_ = store_.data();
+        size_ = store_.size();
+    }
+
+    std::vector<T> store_;
+    std::shared_ptr<const MmapFile> mapping_;
+    T* ptr_;
+    size_t size_;
+};
+
+// Writes the binary index layout read by BinaryReader: scalars are packed, and an array is
+// its size_t length followed, if not empty, by its elements starting at a multiple of alignment.
+// alignment = 1 gives the original packed layout.
+class BinaryWriter {
+public:
+    BinaryWriter(FILE* fp, size_t alignment=1) : fp_(fp), alignment_(alignment) {}
+
+    template<class T>
+    void fput_multiple(const T* src, size_t num) {
+        pecos::file_util::fput_multiple<T>(src, num, fp_);
+    }
+
+    template<class T>
+    void fput_one(const T& src) {
+        pecos::file_util::fput_one<T>(src, fp_);
+    }
+
+    template<class T>
+    void fput_array(const T* src, size_t num) {
+        fput_one<size_t>(num);
+        if (num) {
+            pad_to_alignment();
+            fput_multiple<T>(src, num);
+        }
+    }
+
+    template<class Vec_T>
+    void fput_vector(const Vec_T& vec) {
+        fput_array(vec.data(), vec.size());
+    }
+
+    size_t tell() const {
+        long pos = ftell(fp_);
+        if (pos < 0) {
+            throw std::runtime_error("Cannot get the position of the stream");
+        }
+        return pos;
+    }
+
+    void pad_to_alignment() {
+        if (alignment_ <= 1) {
+            return;
+        }
+        size_t padding = (alignment_ - tell() % alignment_) % alignment_;
+        std::vector<char> zeros(padding, 0);
+        if (padding) {
+            fput_multiple<char>(zeros.data(), padding);
+        }
+    }
+
+private:
+
+    FILE* fp_;
+    size_t alignment_;
+};
+
+// Reads what BinaryWriter wrote with the same alignment, either from a stdio stream, in which case
+// arrays are copied into memory, or from a MmapFile, in which case arrays read into an MmapableVector
+// point straight into the mapping and nothing is copied.
+class BinaryReader {
+public:
+    BinaryReader(FILE* fp, size_t alignment=1) : fp_(fp), alignment_(alignment), offset_(0) {}
+
+    BinaryReader(const std::shared_ptr<const MmapFile>& file, size_t alignment) :
+        fp_(nullptr), file_(file), alignment_(alignment), offset_(0) {}
+
+    bool is_mapped() const { return file_ != nullptr; }
+
+    template<class T>
+    T* fget_multiple(T* dst, size_t num) {
+        if (fp_) {
+            return pecos::file_util::fget_multiple<T>(dst, num, fp_);
+        }
+        memcpy(dst, take(num * sizeof(T)), num * sizeof(T));
+        return dst;
+    }
+
+    template<class T>
+    T fget_one() {
+        T x;
+        fget_multiple<T>(&x, 1U);
+        return x;
+    }
+
+    template<class T>
+    void fget_vector(std::vector<T>& vec) {
+        vec.resize(fget_one<size_t>());
+        if (vec.size()) {
+            skip_to_alignment();
+            fget_multiple<T>(vec.data(), vec.size());
+        }
+    }
+
+    template<class T>
+    void fget_vector(MmapableVector<T>& vec) {
+        size_t num = fget_one<size_t>();
+        if (num == 0) {
+            vec.clear();
+            return;
+        }
+        skip_to_alignment();
+        if (fp_) {
+            vec.assign(num, T());
+            fget_multiple<T>(vec.data(), num);
+        } else {
+            if (reinterpret_cast<uintptr_t>(file_->data() + offset_) % alignof(T)) {
+                throw std::runtime_error("Misaligned array in " + file_->path());
+            }
+            vec.map(file_, reinterpret_cast<const T*>(take(num * sizeof(T))), num);
+        }
+    }
+
+    size_t tell() const {
+        if (fp_) {
+            long pos = ftell(fp_);
+            if (pos < 0) {
+                throw std::runtime_error("Cannot get the position of the stream");
+            }
+            return pos;
+        }
+        return offset_;
+    }
+
+    // continue reading at the given file offset
+    void seek(size_t offset) {
+        if (fp_) {
+            if (fseek(fp_, offset, SEEK_SET) != 0) {
+                throw std::runtime_error("Cannot seek in the stream");
+            }
+        } else {
+            if (offset > file_->size()) {
+                throw std::runtime_error("Cannot seek beyond the end of " + file_->path());
+            }
+            offset_ = offset;
+        }
+    }
+
+private:
+    void skip_to_alignment() {
+        if (alignment_ <= 1) {
+            return;
+        }
+        if (fp_) {
+            long pos = ftell(fp_);
+            if (pos < 0 || fseek(fp_, (alignment_ - pos % alignment_) % alignment_, SEEK_CUR) != 0) {
+                throw std::runtime_error("Cannot seek in the stream");
+            }
+        } else {
+            take((alignment_ - offset_ % alignment_) % alignment_);
+        }
+    }
+
+    const char* take(size_t len) {
+        if (len > file_->size() - offset_) {
+            throw std::runtime_error("Cannot read enough data from " + file_->path());
+        }
+        const char* ptr = file_->data() + offset_;
+        offset_ += len;
+        return ptr;
+    }
+
+    FILE* fp_;
+    std::shared_ptr<const MmapFile> file_;
+    size_t alignment_;
+    size_t offset_;
+};
+
+// ===== Sectioned files =====
+// A sectioned file holds named sections that can be loaded, skipped and verified independently:
+//   a header: the magic "PECOSSEC", uint32_t format version, uint32_t number of sections, uint64_t table offset
+//   the sections, each starting at a multiple of its alignment
+//   the section table at the table offset: one SectionEntry per section, in the order they were written
+// Offsets are from the start of the file, so arrays inside a section keep the alignment BinaryWriter gave them.
+
+static const char section_file_magic[8] = {'P', 'E', 'C', 'O', 'S', 'S', 'E', 'C'};
+static const uint32_t section_file_version = 2;
+// sections are checksummed in chunks of this size, which are processed in parallel
+static const size_t checksum_chunk_size = 4UL << 20;
+
+struct SectionEntry {
+    char name[32];       // zero-padded
+    uint64_t offset;
+    uint64_t length;
+    uint64_t alignment;
+    uint64_t checksum;   // section_checksum() of the length bytes at offset
+
+    std::string get_name() const { return std::string(name, strnlen(name, sizeof(name))); }
+};
+
+namespace details {
+    static const uint64_t checksum_prime1 = 0x9E3779B185EBCA87ULL;
+    static const uint64_t checksum_prime2 = 0xC2B2AE3D27D4EB4FULL;
+
+    inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    inline uint64_t fold_checksum(uint64_t h, uint64_t x) {
+        return rotl64(h ^ (x * checksum_prime2), 27) * checksum_prime1 + checksum_prime2;
+    }
+
+    // 64-bit non-cryptographic checksum of len bytes; four independent lanes of 8-byte words keep it
+    // bound by memory bandwidth rather than by multiply latency
+    inline uint64_t chunk_checksum(const char* data, size_t len) {
+        uint64_t lanes[4] = {checksum_prime1, checksum_prime2, ~checksum_prime1, ~checksum_prime2};
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32) {
+            for (int k = 0; k < 4; k++) {
+                uint64_t w;
+                memcpy(&w, data + i + 8 * k, sizeof(w));
+                lanes[k] = rotl64(lanes[k] + w * checksum_prime2, 31) * checksum_prime1;
+            }
+        }
+        uint64_t h = len * checksum_prime1;
+        for (int k = 0; k < 4; k++) {
+            h = fold_checksum(h, lanes[k]);
+        }
+        for (; i < len; i++) {
+            h = fold_checksum(h, static_cast<unsigned char>(data[i]));
+        }
+        h ^= h >> 33;
+        h *= checksum_prime2;
+        h ^= h >> 29;
+        return h;
+    }
+} // end namespace details
+
+// Checksums of the byte ranges (offset, length) of data, computed with up to threads threads (<= 0 for all
+// cores). The checksum of a range folds the checksums of its checksum_chunk_size chunks in order, so the
+// chunks of all ranges are processed in parallel.
+inline std::vector<uint64_t> section_checksums(const char* data, const std::vector<std::pair<uint64_t, uint64_t>>& ranges, int threads=0) {
+    std::vector<std::pair<size_t, uint64_t>> chunks;  // (range, offset of the chunk)
+    for (size_t r = 0; r < ranges.size(); r++) {
+        for (uint64_t pos = 0; pos < ranges[r].second; pos += checksum_chunk_size) {
+            chunks.emplace_back(r, ranges[r].first + pos);
+        }
+    }
+    std::vector<uint64_t> chunk_sums(chunks.size());
+    threads = (threads <= 0) ? omp_get_num_procs() : threads;
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (size_t c = 0; c < chunks.size(); c++) {
+        const auto& range = ranges[chunks[c].first];
+        uint64_t len = std::min<uint64_t>(checksum_chunk_size, range.first + range.second - chunks[c].second);
+        chunk_sums[c] = details::chunk_checksum(data + chunks[c].second, len);
+    }
+    std::vector<uint64_t> sums(ranges.size());
+    for (size_t r = 0; r < ranges.size(); r++) {
+        sums[r] = details::fold_checksum(details::checksum_prime1, ranges[r].second);
+    }
+    for (size_t c = 0; c < chunks.size(); c++) {
+        sums[chunks[c].first] = details::fold_checksum(sums[chunks[c].first], chunk_sums[c]);
+    }
+    return sums;
+}
+
+// The section table of a sectioned file.
+class SectionTable {
+public:
+    std::vector<SectionEntry> entries;
+
+    // whether the file at path starts with the header of a sectioned file
+    static bool is_sectioned_file(const std::string& path) {
+        char magic[sizeof(section_file_magic)];
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            return false;
+        }
+        bool ret = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, section_file_magic, sizeof(magic)) == 0;
+        fclose(fp);
+        return ret;
+    }
+
+    void load(BinaryReader& reader) {
+        char magic[sizeof(section_file_magic)];
+        reader.seek(0);
+        reader.fget_multiple<char>(magic, sizeof(magic));
+        if (memcmp(magic, section_file_magic, sizeof(magic)) != 0) {
+            throw std::runtime_error("Not a sectioned file");
+        }
+        uint32_t version = reader.fget_one<uint32_t>();
+        if (version != section_file_version) {
+            throw std::runtime_error("Unable to read a sectioned file of format version " + std::to_string(version));
+        }
+        uint32_t num_sections = reader.fget_one<uint32_t>();
+        uint64_t table_offset = reader.fget_one<uint64_t>();
+        reader.seek(table_offset);
+        entries.resize(num_sections);
+        reader.fget_multiple<SectionEntry>(entries.data(), num_sections);
+    }
+
+    const SectionEntry& find(const std::string& name) const {
+        for (const auto& entry : entries) {
+            if (entry.get_name() == name) {
+                return entry;
+            }
+        }
+        throw std::runtime_error("Missing section " + name);
+    }
+
+    // throw if the checksum of any of the given sections of file does not match the table
+    void verify(const MmapFile& file, const std::vector<std::string>& names, int threads=0) const {
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        for (const auto& name : names) {
+            const SectionEntry& entry = find(name);
+            if (entry.offset > file.size() || entry.length > file.size() - entry.offset) {
+                throw std::runtime_error("Section " + name + " is beyond the end of " + file.path());
+            }
+            ranges.emplace_back(entry.offset, entry.length);
+        }
+        auto sums = section_checksums(file.data(), ranges, threads);
+        for (size_t i = 0; i < names.size(); i++) {
+            if (sums[i] != find(names[i]).checksum) {
+                throw std::runtime_error("Checksum mismatch in section " + names[i] + " of " + file.path());
+            }
+        }
+    }
+};
+
+// Writes a sectioned file to path: the contents of each section are written with writer() between
+// begin_section() and end_section(), and finish() appends the section table with the checksums.
+class SectionFileWriter {
+public:
+    SectionFileWriter(const std::string& path, size_t alignment=section_alignment) :
+        path_(path), fp_(fopen(path.c_str(), "wb")), writer_(fp_, alignment), alignment_(alignment) {
+        if (fp_ == nullptr) {
+            throw std::runtime_error("Unable to open " + path + " for writing");
+        }
+        write_header(0);
+    }
+
+    ~SectionFileWriter() {
+        if (fp_) {
+            fclose(fp_);
+        }
+    }
+
+    SectionFileWriter(const SectionFileWriter&) = delete;
+    SectionFileWriter& operator=(const SectionFileWriter&) = delete;
+
+    BinaryWriter& writer() { return writer_; }
+
+    void begin_section(const std::string& name) {
+        SectionEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        if (name.size() >= sizeof(entry.name)) {
+            throw std::invalid_argument("Section name " + name + " is too long");
+        }
+        memcpy(entry.name, name.data(), name.size());
+        writer_.pad_to_alignment();
+        entry.offset = writer_.tell();
+        entry.alignment = alignment_;
+        entries_.push_back(entry);
+    }
+
+    void end_section() {
+        entries_.back().length = writer_.tell() - entries_.back().offset;
+    }
+
+    // checksum the sections with up to threads threads, write the section table and close the file
+    void finish(int threads=0) {
+        if (fflush(fp_) != 0) {
+            throw std::runtime_error("Unable to write " + path_);
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        for (const auto& entry : entries_) {
+            ranges.emplace_back(entry.offset, entry.length);
+        }
+        if (!entries_.empty()) {
+            MmapFile file(path_);
+            auto sums = section_checksums(file.data(), ranges, threads);
+            for (size_t i = 0; i < entries_.size(); i++) {
+                entries_[i].checksum = sums[i];
+            }
+        }
+        writer_.pad_to_alignment();
+        uint64_t table_offset = writer_.tell();
+        writer_.fput_multiple<SectionEntry>(entries_.data(), entries_.size());
+        if (fseek(fp_, 0, SEEK_SET) != 0) {
+            throw std::runtime_error("Unable to write " + path_);
+        }
+        write_header(table_offset);
+        FILE* fp = fp_;
+        fp_ = nullptr;
+        if (fclose(fp) != 0) {
+            throw std::runtime_error("Unable to write " + path_);
+        }
+    }
+
+private:
+    void write_header(uint64_t table_offset) {
+        writer_.fput_multiple<char>(section_file_magic, sizeof(section_file_magic));
+        writer_.fput_one<uint32_t>(section_file_version);
+        writer_.fput_one<uint32_t>(entries_.size());
+        writer_.fput_one<uint64_t>(table_offset);
+    }
+
+    std::string path_;
+    FILE* fp_;
+    BinaryWriter writer_;
+    size_t alignment_;
+    std::vector<SectionEntry> entries_;
+};
+
+} // end namespace mmap_util
+
+} // end namespace pecos
+
+#endif  // end of __MMAP_UTIL_H__
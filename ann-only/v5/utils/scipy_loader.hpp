@@ -16,6 +16,9 @@
 
 #include <algorithm>
 #include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 #include "utils/file_util.hpp"
@@ -23,31 +26,18 @@
 namespace pecos {
 
 //https://numpy.org/devdocs/reference/generated/numpy.lib.format.html
-template<typename T>
-class NpyArray {
-
-public:
-    typedef T value_type;
-    typedef std::vector<value_type> array_t;
-    typedef std::vector<uint64_t> shape_t;
-
-    shape_t shape;
-    array_t array;
+// Header of an NPY file: the type and shape of the array, and the file offset where its content starts.
+struct NpyHeader {
+    std::string dtype;
+    char endian_code, type_code;
+    uint32_t word_size;
+    std::vector<uint64_t> shape;
     size_t num_elements;
     bool fortran_order;
+    uint64_t data_offset;
 
-    NpyArray() {}
-
-    NpyArray(const std::string& filename, uint64_t offset=0) { load(filename, offset); }
-
-    NpyArray(const std::vector<uint64_t>& shape, value_type default_value=0) { resize(shape, default_value); }
-
-    /* load an NpyArry<T> starting from the `offset`-th byte in the file with `filename` */
-    NpyArray<T>& load(const std::string& filename, uint64_t offset=0) {
-        //https://numpy.org/devdocs/reference/generated/numpy.lib.format.html
-        FILE *fp = fopen(filename.c_str(), "rb");
-        fseek(fp, offset, SEEK_SET);
-
+    /* read the header at the current position of fp, which is left at the start of the array content */
+    void load(FILE *fp) {
         // check magic string
         std::vector<uint8_t> magic = {0x93u, 'N', 'U', 'M', 'P', 'Y'};
         for(size_t i = 0; i < magic.size(); i++) {
@@ -77,39 +67,46 @@ public:
         // load header
         std::vector<char> header(header_len + 1, (char) 0);
         pecos::file_util::fget_multiple<char>(&header[0], header_len, fp);
-        char endian_code, type_code;
-        uint32_t word_size;
-        std::string dtype;
-        this->parse_header(header, endian_code, type_code, word_size, dtype);
-
-        // load array content
-        this->load_content(fp, word_size, dtype);
-
-        fclose(fp);
-        return *this;
+        this->parse(header);
+        this->data_offset = ftell(fp);
     }
 
-    void resize(const std::vector<uint64_t>& new_shape, value_type default_value=value_type()) {
-        shape = new_shape;
-        size_t num_elements = 1;
-        for(auto& dim : shape) {
-            num_elements *= dim;
+    /* write a version 1.0 header for dtype, fortran_order and shape at the current position of fp,
+     * padded so that the array content that follows is 64-byte aligned */
+    void save(FILE *fp) const {
+        std::string header = "{'descr': '" + dtype + "', 'fortran_order': " + (fortran_order ? "True" : "False") + ", 'shape': (";
+        for(size_t i = 0; i < shape.size(); i++) {
+            header += std::to_string(shape[i]) + (shape.size() == 1 ? ",)" : (i + 1 < shape.size() ? ", " : ")"));
         }
-        array.resize(num_elements);
-        std::fill(array.begin(), array.end(), default_value);
+        if(shape.size() == 0) {
+            header += ")";
+        }
+        header += ", }";
+        // magic (6) + version (2) + header len (2) + header + '\n'
+        size_t total_len = 10 + header.size() + 1;
+        header.append((64 - total_len % 64) % 64, ' ');
+        header += '\n';
+        if(header.size() > std::numeric_limits<uint16_t>::max()) {
+            throw std::runtime_error("NPY header too long");
+        }
+        const uint8_t magic[] = {0x93u, 'N', 'U', 'M', 'P', 'Y', 1, 0};
+        pecos::file_util::fput_multiple<uint8_t>(magic, sizeof(magic), fp);
+        pecos::file_util::fput_one<uint16_t>(header.size(), fp, pecos::file_util::different_from_runtime('<'));
+        pecos::file_util::fput_multiple<char>(header.data(), header.size(), fp);
     }
 
-    size_t ndim() const { return shape.size(); }
-    size_t size() const { return num_elements; }
-    value_type* data() { return &array[0]; }
-    value_type& at(size_t idx) { return array[idx]; }
-    const value_type& at(size_t idx) const { return array[idx]; }
-    value_type& operator[](size_t idx) { return array[idx]; }
-    const value_type& operator[](size_t idx) const { return array[idx]; }
+    /* dtype of the NPY arrays of T in native byte order, e.g. "<f4" */
+    template<typename T>
+    static std::string dtype_of() {
+        static_assert(std::is_arithmetic<T>::value, "NPY dtype of a non-arithmetic type");
+        char type_code = std::is_floating_point<T>::value ? 'f' : (std::is_signed<T>::value ? 'i' : 'u');
+        char endian_code = pecos::file_util::different_from_runtime('<') ? '>' : '<';
+        return std::string(1, endian_code) + type_code + std::to_string(sizeof(T));
+    }
 
 private:
 
-    void parse_header(const std::vector<char>& header, char& endian_code, char& type_code, uint32_t& word_size, std::string& dtype) {
+    void parse(const std::vector<char>& header) {
         char value_buffer[1024] = {0};
         const char* header_cstr = &header[0];
 
@@ -148,6 +145,87 @@ private:
             shape.push_back(1);
         }
     }
+};
+
+template<typename T>
+class NpyArray {
+
+public:
+    typedef T value_type;
+    typedef std::vector<value_type> array_t;
+    typedef std::vector<uint64_t> shape_t;
+
+    shape_t shape;
+    array_t array;
+    size_t num_elements;
+    bool fortran_order;
+
+    NpyArray() {}
+
+    NpyArray(const std::string& filename, uint64_t offset=0) { load(filename, offset); }
+
+    NpyArray(const std::vector<uint64_t>& shape, value_type default_value=0) { resize(shape, default_value); }
+
+    /* load an NpyArry<T> starting from the `offset`-th byte in the file with `filename` */
+    NpyArray<T>& load(const std::string& filename, uint64_t offset=0) {
+        //https://numpy.org/devdocs/reference/generated/numpy.lib.format.html
+        FILE *fp = fopen(filename.c_str(), "rb");
+        fseek(fp, offset, SEEK_SET);
+
+        NpyHeader header;
+        header.load(fp);
+        this->shape = header.shape;
+        this->num_elements = header.num_elements;
+        this->fortran_order = header.fortran_order;
+        uint32_t word_size = header.word_size;
+        const std::string& dtype = header.dtype;
+
+        // load array content
+        this->load_content(fp, word_size, dtype);
+
+        fclose(fp);
+        return *this;
+    }
+
+    /* save as a C-ordered NPY file with a version 1.0 header */
+    void save(const std::string& filename) const {
+        FILE *fp = fopen(filename.c_str(), "wb");
+        if(fp == nullptr) {
+            throw std::runtime_error("Unable to open " + filename + " for writing");
+        }
+        NpyHeader header;
+        header.dtype = NpyHeader::dtype_of<value_type>();
+        header.fortran_order = false;
+        header.shape = shape;
+        try {
+            header.save(fp);
+            pecos::file_util::fput_multiple<value_type>(array.data(), array.size(), fp);
+        } catch(...) {
+            fclose(fp);
+            throw;
+        }
+        fclose(fp);
+    }
+
+    void resize(const std::vector<uint64_t>& new_shape, value_type default_value=value_type()) {
+        shape = new_shape;
+        size_t num_elements = 1;
+        for(auto& dim : shape) {
+            num_elements *= dim;
+        }
+        array.resize(num_elements);
+        std::fill(array.begin(), array.end(), default_value);
+    }
+
+    size_t ndim() const { return shape.size(); }
+    size_t size() const { return num_elements; }
+    value_type* data() { return &array[0]; }
+    value_type& at(size_t idx) { return array[idx]; }
+    const value_type& at(size_t idx) const { return array[idx]; }
+    value_type& operator[](size_t idx) { return array[idx]; }
+    const value_type& operator[](size_t idx) const { return array[idx]; }
+
+private:
 
     template<typename U=value_type, typename std::enable_if<std::is_arithmetic<U>::value, U>::type* = nullptr>
     void load_content(FILE *fp, uint32_t& word_size, const std::string& dtype) {